@@ -0,0 +1,157 @@
+#include "xz_protocol_priv.h"
+#include "xz_chat_priv.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+/*
+ per-frame cost of the uplink hot path, measured on the host.
+ frames go through chat_tx_audio, the path read_audio_cb feeds: session check, TX_IDLE bits,
+ trace hook, stats, send_data and release. "_q" cases add send_audio_q and the send task,
+ timed from chat_tx_audio till the frame is released.
+ the websocket and udp sinks are link-time wrapped (see CMakeLists.txt),
+ so numbers cover only the work done by xiaozhi_chat.
+
+ output is one line per case:
+ BENCH case=<name> frames=<n> len=<bytes> p50_ns=<..> p99_ns=<..> max_ns=<..>
+*/
+
+#define BENCH_FRAMES 20000
+#define BENCH_WARMUP 200
+#define BENCH_FRAME_LEN 160 // 60ms opus at ~17kbps is around 130 bytes
+
+int __wrap_esp_websocket_client_send_bin(esp_websocket_client_handle_t client, const char *data, int len, TickType_t timeout) {
+    return len;
+}
+
+ssize_t __wrap_lwip_send(int s, const void *data, size_t size, int flags) {
+    return size;
+}
+
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y? -1: x > y;
+}
+
+static uint64_t samples[BENCH_FRAMES];
+static uint8_t frame[XZ_TX_AUDIO_HEADROOM + BENCH_FRAME_LEN];
+static SemaphoreHandle_t released;
+static int released_frames;
+
+static void release_frame(void* user_data) {
+    released_frames++;
+    if(released) xSemaphoreGive(released);
+}
+
+static void tx_frame(xz_chat_t* chat, int headroom) {
+    xz_tx_audio_pck_t audio = {
+        .buf = &frame[XZ_TX_AUDIO_HEADROOM],
+        .len = BENCH_FRAME_LEN,
+        .headroom = headroom,
+        .writable = true,
+        .release_cb = release_frame,
+    };
+    chat_tx_audio(chat, &audio);
+    if(released) xSemaphoreTake(released, portMAX_DELAY); // one frame in flight, so each sample is a full trip
+}
+
+static int run_case(const char* name, xz_chat_t* chat, int headroom) {
+    for(int i=0; i<BENCH_WARMUP; i++) {
+        tx_frame(chat, headroom);
+    }
+    uint32_t errors0 = atomic_load(&chat->stats.tx_errors);
+    released_frames = 0;
+    for(int i=0; i<BENCH_FRAMES; i++) {
+        uint64_t t0 = now_ns();
+        tx_frame(chat, headroom);
+        samples[i] = now_ns() - t0;
+    }
+    int err = atomic_load(&chat->stats.tx_errors) - errors0 + (BENCH_FRAMES - released_frames);
+    char qname[40];
+    if(chat->send_audio_q) {
+        snprintf(qname, sizeof(qname), "%s_q", name);
+        name = qname;
+    }
+    qsort(samples, BENCH_FRAMES, sizeof(samples[0]), cmp_u64);
+    printf("BENCH case=%s frames=%d len=%d p50_ns=%llu p99_ns=%llu max_ns=%llu errors=%d\n",
+        name, BENCH_FRAMES, BENCH_FRAME_LEN,
+        (unsigned long long)samples[BENCH_FRAMES/2],
+        (unsigned long long)samples[BENCH_FRAMES*99/100],
+        (unsigned long long)samples[BENCH_FRAMES-1], err);
+    return err;
+}
+
+static int bench_ws(xz_chat_t* chat, int version, int headroom) {
+    xz_ws_prot_ctx_t ctx = { .version = version, .alloc = &chat->allocator };
+    chat->prot_ctx = &ctx;
+    chat->prot_if = xz_ws_prot_if;
+    char name[32];
+    snprintf(name, sizeof(name), headroom? "ws_v%d_headroom": "ws_v%d", version);
+    int err = run_case(name, chat, headroom);
+    XZ_BUF_RELEASE(ctx.alloc, ctx.send_audio_buf);
+    return err;
+}
+
+static int bench_mqtt(xz_chat_t* chat, int headroom) {
+    static const uint8_t key[16] = {0x6a,0x0c,0x5a,0x1e,0x2b,0x91,0x47,0xd3,0x88,0x10,0xfe,0x3c,0x55,0x07,0x9b,0x21};
+    char nonce[16] = {0x01};
+    xz_mqtt_prot_ctx_t ctx = { .alloc = &chat->allocator };
+    ctx.udp.sock = -1;
+    ctx.udp.aes_nonce = nonce;
+    ctx.udp.aes_nonce_len = sizeof(nonce);
+    mbedtls_aes_init(&ctx.udp.aes_ctx);
+    mbedtls_aes_setkey_enc(&ctx.udp.aes_ctx, key, 128);
+    chat->prot_ctx = &ctx;
+    chat->prot_if = xz_mqtt_prot_if;
+    int err = run_case(headroom? "mqtt_aes_ctr_in_place": "mqtt_aes_ctr", chat, headroom);
+    XZ_BUF_RELEASE(ctx.alloc, ctx.udp.encrypted_buf);
+    mbedtls_aes_free(&ctx.udp.aes_ctx);
+    return err;
+}
+
+void app_main(void) {
+    for(int i=0; i<sizeof(frame); i++) frame[i] = (uint8_t)rand();
+
+    xz_chat_t* chat = calloc(1, sizeof(xz_chat_t));
+    assert(chat);
+    xz_chat_config_t conf = XZ_CHAT_CONFIG_DEFAULT(NULL, NULL, NULL);
+    chat->send_audio_task_conf = conf.send_audio_task_conf;
+    chat->eg = xEventGroupCreate();
+    assert(chat->eg);
+    xEventGroupSetBits(chat->eg, XZ_EG_TX_IDLE_BIT);
+    chat_set_flag(chat, XZ_FLAG_SESS_LISTENING);
+
+    int err = 0;
+    for(int queued=0; queued<2; queued++) {
+        if(queued) {
+            // as xz_chat_init / _start set it up when send_audio_q_size > 0
+            chat->send_audio_q = xQueueCreate(conf.send_audio_q_size, sizeof(xz_tx_audio_pck_t));
+            released = xSemaphoreCreateBinary();
+            esp_err_t ret = capped_task_create(&chat->send_audio_task, "xz_send_audio_task", chat_send_audio_loop, chat, &chat->send_audio_task_conf);
+            assert(chat->send_audio_q && released && ret == ESP_OK);
+        }
+        for(int v=1; v<=3; v++) {
+            err += bench_ws(chat, v, 0);
+        }
+        err += bench_ws(chat, 2, XZ_TX_AUDIO_HEADROOM);
+        err += bench_ws(chat, 3, XZ_TX_AUDIO_HEADROOM);
+        err += bench_mqtt(chat, 0);
+        err += bench_mqtt(chat, XZ_TX_AUDIO_HEADROOM);
+    }
+
+    term_task_wait(chat->send_audio_task, chat->eg, XZ_EG_SEND_AUDIO_TASK_STOPPED_BIT, pdMS_TO_TICKS(5000));
+    vQueueDelete(chat->send_audio_q);
+    vSemaphoreDelete(released);
+    vEventGroupDelete(chat->eg);
+    free(chat);
+    fflush(stdout);
+    exit(err? EXIT_FAILURE: EXIT_SUCCESS);
+}
@@ -24,6 +24,7 @@
 #include "esp_gmf_io_codec_dev.h"
 #include "gmf_loader_setup_defaults.h"
 #include "esp_audio_simple_player_advance.h"
+#include <stdatomic.h>
 
 static const char* const TAG = "xiaozhi_app";
 
@@ -53,6 +54,7 @@ static audio_prompt_t prompt;
 static recorder_t recorder;
 static playback_t playback;
 static xz_chat_t* chat;
+static atomic_bool tts_stopped; // the reply is fully received, the next empty fifo means playback drained
 
 static esp_err_t audio_prompt_play(audio_prompt_t* prompt, const char *url);
 
@@ -60,6 +62,12 @@ static void xz_chat_on_event(xz_chat_event_t event, xz_chat_event_data_t *event_
 
     if(event==XZ_EVENT_VERSION_CHECK_RESULT) {
         if(event_data->version_check_err ==0) {
+            // protocol config can be tuned here before xz_chat_start, e.g. buffer 3 frames of downlink udp audio to fix reordering
+            // if(xz_chat_get_protocol_type(chat) == XZ_PROT_TYPE_MQTT)
+            //     ((xz_mqtt_prot_config_t*)event_data->protocol_config)->udp_conf.jitter_buf.depth = 3;
+            // or keep the websocket connected between sessions so a wake word only costs the hello round trip
+            // if(xz_chat_get_protocol_type(chat) == XZ_PROT_TYPE_WS)
+            //     ((xz_ws_prot_config_t*)event_data->protocol_config)->persistent = true;
             if(event_data->parsed_response->require_activation) {
 
                 // tell the user they must visit xiaozhi.me and register device with activation code
@@ -74,7 +82,7 @@ static void xz_chat_on_event(xz_chat_event_t event, xz_chat_event_data_t *event_
 
     } else if(event==XZ_EVENT_ACTIVATION_CHECK_RESULT) {
         if(event_data->activation_check_err) { 
-            // device is not registered yet, check again until user register device.
+            // device is not registered yet, check again until user register device. polls are paced by the chat.
             xz_chat_activation_check(chat, NULL);
         } else {
             xz_chat_start(chat);
@@ -82,27 +90,29 @@ static void xz_chat_on_event(xz_chat_event_t event, xz_chat_event_data_t *event_
 
     } else if(event==XZ_EVENT_STARTED) {
 
-    } else if(event==XZ_EVENT_JSON_RECEIVED) {
-        if(QESTREQL(event_data->type, "llm")) {
-            char* em;
-            if((em = emjson_find_string(event_data->json, event_data->len, "$.emotion"))) {
-                // change face img/gif accordingly
-                if(QESTREQL(em, "happy")) {
-                    
-                } else if(QESTREQL(em, "sad")) {
+    } else if(event==XZ_EVENT_LLM_EMOTION) {
+        // change face img/gif accordingly
+        if(QESTREQL(event_data->llm.emotion.s, "happy")) {
+
+        } else if(QESTREQL(event_data->llm.emotion.s, "sad")) {
 
-                }
-            }
-        } else if(QESTREQL(event_data->type, "tts")) {
-            char* st;
-            if((st = emjson_find_string(event_data->json, event_data->len, "$.state"))) {
-                if(QESTREQL(st, "start")) {
-                    // speaking start
-                } else if(QESTREQL(st, "stop")) {
-                    // speaking end
-                }
-            }
         }
+    } else if(event==XZ_EVENT_TTS_START) {
+        // speaking start
+        atomic_store(&tts_stopped, false);
+    } else if(event==XZ_EVENT_TTS_STOP) {
+        // speaking end
+        atomic_store(&tts_stopped, true);
+    } else if(event==XZ_EVENT_STT_TEXT && event_data->text.s) {
+        ESP_LOGI(TAG, ">> %.*s", event_data->text.len, event_data->text.s);
+    } else if(event==XZ_EVENT_TTS_SENTENCE && event_data->text.s) {
+        ESP_LOGI(TAG, "<< %.*s", event_data->text.len, event_data->text.s);
+    } else if(event==XZ_EVENT_LATENCY_RECORD) {
+        const uint32_t* ms = event_data->latency->ms;
+        if(ms[XZ_LAT_REQUEST] && ms[XZ_LAT_FIRST_UPLINK])
+            ESP_LOGI(TAG, "turn %lu: wake to uplink %lums", event_data->latency->turn, ms[XZ_LAT_FIRST_UPLINK] - ms[XZ_LAT_REQUEST]);
+        if(ms[XZ_LAT_LISTEN_STOP] && ms[XZ_LAT_FIRST_DOWNLINK])
+            ESP_LOGI(TAG, "turn %lu: speech end to audio %lums", event_data->latency->turn, ms[XZ_LAT_FIRST_DOWNLINK] - ms[XZ_LAT_LISTEN_STOP]);
     }
 }
 
@@ -133,8 +143,10 @@ static esp_err_t xz_chat_read_audio(xz_tx_audio_pck_t* audio, xz_chat_t* chat) {
         ESP_LOGE(TAG, "Failed to acquire read from recorder FIFO (0x%x)", ret);
         return ESP_FAIL;
     }
-    audio->buf = blk->buf;
-    audio->len = blk->valid_size;
+    audio->buf = blk->buf + XZ_TX_AUDIO_HEADROOM;
+    audio->len = blk->valid_size - XZ_TX_AUDIO_HEADROOM;
+    audio->headroom = XZ_TX_AUDIO_HEADROOM;
+    audio->writable = true; // the fifo block is returned to the recorder after sending, it's ok to encrypt in place
     audio->user_data = blk;
     audio->release_cb = return_blk_to_recorder_fifo;
     return ESP_OK;
@@ -149,7 +161,7 @@ static void afe_event_cb(esp_gmf_obj_handle_t obj, esp_gmf_afe_evt_t *event, voi
                 // the sound must be short
                 audio_prompt_play(&prompt, "file://spiffs/dingding.wav");
                 // start listening only AFTER ding sound has finished playing
-                xz_chat_new_session(chat);
+                xz_chat_post_cmd(chat, XZ_CHAT_CMD_NEW_SESSION); // don't block the afe pipeline
             }
             break;
         }
@@ -188,14 +200,15 @@ static int recorder_outport_acquire_write(void *handle, esp_gmf_data_bus_block_t
 
 static int recorder_outport_release_write(void *handle, esp_gmf_data_bus_block_t *blk, int block_ticks){
     esp_gmf_data_bus_block_t _blk = {0};
-    int ret = esp_gmf_fifo_acquire_write(recorder.fifo, &_blk, blk->valid_size, block_ticks);
+    // reserve headroom in front of the opus frame, so xz_chat can put protocol header there without copying
+    int ret = esp_gmf_fifo_acquire_write(recorder.fifo, &_blk, XZ_TX_AUDIO_HEADROOM + blk->valid_size, block_ticks);
     if (ret < 0) {
         ESP_LOGE(TAG, "%s|%d, Fifo acquire write failed, ret: %d", __func__, __LINE__, ret);
         return ESP_FAIL;
     }
-    memcpy(_blk.buf, blk->buf, blk->valid_size);
+    memcpy(_blk.buf + XZ_TX_AUDIO_HEADROOM, blk->buf, blk->valid_size);
 
-    _blk.valid_size = blk->valid_size;
+    _blk.valid_size = XZ_TX_AUDIO_HEADROOM + blk->valid_size;
     ret = esp_gmf_fifo_release_write(recorder.fifo, &_blk, block_ticks);
     if (ret != ESP_GMF_ERR_OK) {
         ESP_LOGE(TAG, "Fifo release write failed");
@@ -271,6 +284,13 @@ static void recorder_init_and_run(recorder_t* audio) {
 
 static int playback_inport_acquire_read(void *handle, esp_gmf_data_bus_block_t *blk, int wanted_size, int block_ticks){
     esp_gmf_data_bus_block_t _blk = {0};
+    uint32_t filled = 0;
+    if(chat && esp_gmf_db_get_filled_size(playback.fifo, &filled) == ESP_GMF_ERR_OK && filled == 0
+        && atomic_exchange(&tts_stopped, false)) {
+        // last block of the reply is decoded and handed to the codec, let the chat start listening now.
+        // gaps between sentences also empty the fifo, those aren't reported
+        xz_chat_report_playback_drained(chat);
+    }
     int ret = esp_gmf_db_acquire_read(playback.fifo, &_blk, wanted_size, block_ticks);
     if (ret < 0) {
         ESP_LOGE(TAG, "Fifo acquire read failed (0x%x)", ret);
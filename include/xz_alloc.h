@@ -0,0 +1,34 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_heap_caps.h"
+
+/* every buffer xz_chat allocates is tagged with one of these, so the app can place it */
+typedef enum {
+    XZ_BUF_AUDIO_RX,    // downlink audio: udp recv buffer (15KB by default), jitter buffer
+    XZ_BUF_AUDIO_TX,    // uplink audio: frame header copies, aes output. small and touched every frame
+    XZ_BUF_CONTROL,     // json: send buffer, message reassembly, session, mcp payloads, protocol configs
+    XZ_BUF_TRANSIENT,   // version check responses, prot cache scratch, trace io. short lived
+    XZ_BUF_CLASS_MAX,
+} xz_buf_class_t;
+
+/*
+ leave alloc NULL to use heap_caps_malloc with caps[class], 0 caps is plain malloc.
+ with alloc set, realloc and free must be set too and caps is ignored.
+ hooks are called from any xz task, with CONFIG_XZ_CHAT_STATIC_BUFFERS only while initializing.
+*/
+typedef struct {
+    uint32_t caps[XZ_BUF_CLASS_MAX];
+    void* (*alloc)(size_t size, xz_buf_class_t cls, void* user_data);
+    void* (*realloc)(void* ptr, size_t size, xz_buf_class_t cls, void* user_data);
+    void (*free)(void* ptr, void* user_data);
+    void* user_data;
+} xz_chat_allocator_t;
+
+/* bulk buffers in psram, the per frame uplink buffers in internal ram */
+#define XZ_CHAT_ALLOCATOR_PSRAM_BULK { .caps = { \
+    [XZ_BUF_AUDIO_RX] = MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT, \
+    [XZ_BUF_AUDIO_TX] = MALLOC_CAP_INTERNAL|MALLOC_CAP_8BIT, \
+    [XZ_BUF_CONTROL] = MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT, \
+    [XZ_BUF_TRANSIENT] = MALLOC_CAP_SPIRAM|MALLOC_CAP_8BIT, \
+}}
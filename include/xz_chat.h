@@ -3,6 +3,9 @@
 #include "xz_http_client_request.h"
 #include "xz_protocol.h"
 #include "xz_common.h"
+#include "xz_json_idx.h"
+#include "xz_latency.h"
+#include "xz_alloc.h"
 #include "task_util.h"
 
 typedef enum {
@@ -16,12 +19,32 @@ typedef enum {
     XZ_EVENT_STARTED,
     XZ_EVENT_STOPPED,
     // XZ_EVENT_STATE_CHANGED,
-    XZ_EVENT_JSON_RECEIVED,
+    XZ_EVENT_JSON_RECEIVED,     // every json message, after the typed event below if any
+
+    // typed events, already parsed. payload spans point into json and are not nul terminated
+    XZ_EVENT_TTS_START,
+    XZ_EVENT_TTS_STOP,
+    XZ_EVENT_TTS_SENTENCE,      // text
+    XZ_EVENT_STT_TEXT,          // text
+    XZ_EVENT_LLM_EMOTION,       // llm.emotion, llm.text
+    XZ_EVENT_SYSTEM_COMMAND,    // command
+    XZ_EVENT_GOODBYE,           // session_id
+
+    XZ_EVENT_LATENCY_RECORD,    // latency, timeline of the turn that just ended
 } xz_chat_event_t;
 
+/*
+ largest header any protocol puts in front of an uplink audio frame.
+ if read_audio_cb leaves this many bytes free before buf and sets headroom,
+ the header is written in place and the frame is sent without copying.
+*/
+#define XZ_TX_AUDIO_HEADROOM 16
+
 typedef struct {
     void* buf;
     int len;
+    int headroom; // number of bytes right before buf that can be overwritten, 0 if none
+    bool writable; // payload in buf may be modified in place, e.g. encrypted
     void(*release_cb)(void* user_data);
     void* user_data;
 } xz_tx_audio_pck_t;
@@ -29,6 +52,11 @@ typedef struct {
 struct _xz_chat_t;
 typedef struct _xz_chat_t xz_chat_t;
 
+typedef struct {
+    const char* s; // NULL if absent
+    int len;
+} xz_chat_span_t;
+
 typedef struct {
     union {
         struct {                   // 连接服务器时先进行版本检测，以及是否设备已激活
@@ -39,17 +67,63 @@ typedef struct {
         
         int activation_check_err; // 检测设备是否激活
 
+        const xz_lat_record_t* latency; // 一轮对话的时间线, 仅在回调内有效
+
         struct {               // 收得的 json
             char* json;
             int len;
             char* type;
             int type_len;
+            const xz_json_idx_t* idx; // json 的路径索引, 用 xz_json_idx_* 查询, 不必重新扫描
+            union {                   // 按事件类型取值
+                xz_chat_span_t text;
+                xz_chat_span_t command;
+                xz_chat_span_t session_id;
+                struct {
+                    xz_chat_span_t emotion;
+                    xz_chat_span_t text;
+                } llm;
+            };
         };
     };
 }xz_chat_event_data_t;
 
 
+typedef enum {
+    XZ_SEND_AUDIO_Q_DROP_OLDEST, // capture never waits, the oldest queued frame is released when the queue is full
+    XZ_SEND_AUDIO_Q_BLOCK,       // read_audio task waits for room in the queue
+} xz_send_audio_q_policy_t;
+
+typedef struct {
+    int depth;          // frames waiting to be sent now
+    int high_water;     // max depth seen
+    uint32_t dropped;   // frames dropped by XZ_SEND_AUDIO_Q_DROP_OLDEST
+} xz_chat_send_audio_q_stats_t;
+
+/* counters since init or the last reset. byte counts are 32 bit and wrap, read them often enough or reset */
+typedef struct {
+    uint32_t tx_frames;         // uplink audio frames handed to the transport
+    uint32_t tx_bytes;          // their payload, without protocol headers
+    uint32_t tx_errors;         // frames the transport failed to send
+    uint32_t rx_frames;         // downlink audio frames received, delivered or not
+    uint32_t rx_bytes;
+    uint32_t rx_msgs;           // json messages
+    uint32_t rx_oversize;       // messages dropped for exceeding rx_msg_max_size
+    uint32_t rx_bad_packets;    // malformed or undecryptable audio packets
+    uint32_t rx_lost_frames;    // sequence / timestamp gaps
+    uint32_t rx_late_frames;    // out of order or duplicate frames that were dropped
+    uint32_t cmd_q_high_water;  // max commands waiting in a lane
+    uint32_t cmd_q_full;        // commands rejected by a full queue
+    uint32_t audio_cb_calls;
+    uint32_t audio_cb_max_us;   // longest audio_cb
+    uint32_t audio_cb_total_us;
+    uint32_t alloc_overflow;    // CONFIG_XZ_CHAT_STATIC_BUFFERS: buffers a pool couldn't serve, the message / frame / check failed
+    xz_chat_send_audio_q_stats_t send_audio_q;
+} xz_chat_stats_t;
+
 typedef void (*xz_chat_audio_cb_t)(uint8_t *data, int len, xz_chat_t* chat);
+/* lost_frames frames are missing before the frame that is passed to audio_cb next, run packet loss concealment for them */
+typedef void (*xz_chat_audio_loss_cb_t)(int lost_frames, xz_chat_t* chat);
 typedef void (*xz_chat_event_cb_t)(xz_chat_event_t event, xz_chat_event_data_t *event_data, xz_chat_t* chat);
 typedef esp_err_t (*xz_chat_read_audio_cb_t)(xz_tx_audio_pck_t* audio, xz_chat_t* chat);
 
@@ -59,20 +133,28 @@ typedef esp_err_t (*xz_chat_read_audio_cb_t)(xz_tx_audio_pck_t* audio, xz_chat_t
         char* activation_check_url; \
     } ota; \
     char* lang; /*默认语言*/ \
+    const char* device_id; /*设备 id (mac 格式), NULL 则用本机 mac. 一个进程里跑多个实例时各自指定*/ \
+    const char* client_id; /*客户端 uuid, NULL 则用 xz_board_info_load 从 nvs 读取的*/ \
     xz_prot_type_t          prot_pref; /*首选通信协议,websocket或mqtt*/ \
     int send_buf_size; \
+    xz_chat_allocator_t allocator; /* 按用途(xz_buf_class_t)放置缓冲区, 如大块放 psram, 全 0 则用 malloc. 任务栈见 XZ_CHAT_TASK_CAPS */ \
     capped_task_config_t        main_task_conf; \
     capped_task_config_t        read_audio_task_conf; \
+    capped_task_config_t        send_audio_task_conf; \
+    capped_task_config_t        http_task_conf; /* 版本检测/激活检测的 http 线程 */ \
+    int cmd_q_size; \
+    int cmd_hi_q_size; /* 优先命令队列长度, 应用调用的命令(启动/停止/唤醒/打断/按键)按调用顺序走这里, 先于网络消息执行 */ \
+    int send_audio_q_size; /* 上行音频队列长度, 0 则在读取录音的线程里直接发送. 队列中的帧在发送后才 release, 音频源至少要能容纳 send_audio_q_size+1 帧 */ \
+    xz_send_audio_q_policy_t send_audio_q_policy; \
     bool enable_realtime_listening; /* 如果本地 ACE 的选上该选项 */ \
     xz_chat_audio_cb_t  audio_cb; /*接收到音频数据的回调，用户需要在该回调中播放音频*/ \
+    xz_chat_audio_loss_cb_t audio_loss_cb; /*可选, 下行音频丢包时的回调*/ \
     xz_chat_event_cb_t  event_cb;   /*事件回调*/ \
-    xz_chat_read_audio_cb_t read_audio_cb; /*读取录音的回调，内部有个线程会通过该函数读取录音并发送*/ \
+    xz_chat_read_audio_cb_t read_audio_cb; /*读取录音的回调，内部有个线程会通过该函数读取录音并发送. CONFIG_XZ_CHAT_REACTOR 下不能阻塞, 没有帧时返回错误*/ \
 }
 
 typedef struct {
     XZ_CHAT_CONFIG_STRUCT;
-    int cmd_q_size;
-    int send_audio_q_size;
 } xz_chat_config_t;
 
 #ifdef CONFIG_XZ_CHAT_RUN_TASKS_IN_SPIRAM
@@ -80,9 +162,16 @@ typedef struct {
 #else
 #define XZ_CHAT_TASK_CAPS 0
 #endif
+#ifdef CONFIG_XZ_CHAT_REACTOR
+#define XZ_CHAT_MAIN_TASK_STACK 6144 // also reads audio and receives udp
+#else
+#define XZ_CHAT_MAIN_TASK_STACK 4096
+#endif
 #define XZ_CHAT_CONFIG_DEFAULT(read_audio, on_event, on_audio) { \
     .cmd_q_size = 8, \
-    .send_audio_q_size = 36, \
+    .cmd_hi_q_size = 4, \
+    .send_audio_q_size = 4, /* 每帧占着音频源的一块缓冲, 常见的 5 块录音 fifo 也够用 */ \
+    .send_audio_q_policy = XZ_SEND_AUDIO_Q_DROP_OLDEST, \
     .lang = "en-US", \
     .ota = { \
         .version_check_url= CONFIG_XZ_CHAT_VERSION_CHECK_URL, \
@@ -90,7 +179,9 @@ typedef struct {
     }, \
     .prot_pref = XZ_PROT_TYPE_MQTT, \
     .read_audio_task_conf = {.stack=4096,.prio=5,.caps=XZ_CHAT_TASK_CAPS,.core=tskNO_AFFINITY}, \
-    .main_task_conf = {.stack=4096,.prio=4,.caps=XZ_CHAT_TASK_CAPS,.core=tskNO_AFFINITY}, \
+    .send_audio_task_conf = {.stack=4096,.prio=5,.caps=XZ_CHAT_TASK_CAPS,.core=tskNO_AFFINITY}, \
+    .main_task_conf = {.stack=XZ_CHAT_MAIN_TASK_STACK,.prio=4,.caps=XZ_CHAT_TASK_CAPS,.core=tskNO_AFFINITY}, \
+    .http_task_conf = {.stack=6144,.prio=3,.caps=XZ_CHAT_TASK_CAPS,.core=tskNO_AFFINITY}, \
     .send_buf_size = 256, \
     .enable_realtime_listening = false, \
     .event_cb = on_event, \
@@ -105,8 +196,12 @@ xz_chat_t* xz_chat_init(xz_chat_config_t* conf);
  below functions only push corresponding job to the main loop, and return immediately.
  if the job is successfully done, events will be fired and handled by event_cb.
 */
+/* version and activation checks run on their own http task.
+   activation polls are paced by the activation.timeout_ms the server returns, with backoff on errors,
+   so it's fine to call xz_chat_activation_check again right from the result event. */
 void xz_chat_version_check(xz_chat_t* chat_hd, esp_http_client_handle_t client); // either provied your own http_client for reuse, or leave it as NULL
 void xz_chat_activation_check(xz_chat_t* chat_hd, esp_http_client_handle_t client); // either provied your own http_client for reuse, or leave it as NULL
+void xz_chat_cancel_checks(xz_chat_t* chat_hd); // drop pending version / activation checks, one already in flight still reports
 void xz_chat_start(xz_chat_t* chat_hd); // starts protocol thread/connection
 void xz_chat_stop(xz_chat_t* chat_hd); // stops protocol, it does not stop the main loop.
 /* destroy chat and free resources,
@@ -124,6 +219,18 @@ void xz_chat_toggle_chat_state(xz_chat_t* chat);
 void xz_chat_start_manual_listening(xz_chat_t* chat);
 void xz_chat_stop_manual_listening(xz_chat_t* chat);
 
+typedef enum {
+    XZ_CHAT_CMD_NEW_SESSION,
+    XZ_CHAT_CMD_EXIT_SESSION,
+    XZ_CHAT_CMD_TOGGLE_CHAT_STATE,
+    XZ_CHAT_CMD_START_MANUAL_LISTENING,
+    XZ_CHAT_CMD_STOP_MANUAL_LISTENING,
+} xz_chat_cmd_t;
+
+/* non-blocking form of the calls above, safe from ISRs and button callbacks.
+   ESP_ERR_TIMEOUT if the command queue is full */
+esp_err_t xz_chat_post_cmd(xz_chat_t* chat, xz_chat_cmd_t cmd);
+
 /* only after version_checked */
 xz_prot_type_t xz_chat_get_protocol_type(xz_chat_t* chat);
 
@@ -134,7 +241,45 @@ bool xz_chat_is_listening(xz_chat_t* chat);
 bool xz_chat_is_speaking(xz_chat_t* chat);
 bool xz_chat_is_in_session(xz_chat_t* chat);
 
+/* uplink audio queue usage, reset clears high_water and dropped */
+void xz_chat_get_send_audio_q_stats(xz_chat_t* chat, xz_chat_send_audio_q_stats_t* stats, bool reset);
+
+
+/* snapshot of the transport counters, reset zeroes them (and the send audio queue stats) after reading */
+void xz_chat_get_stats(xz_chat_t* chat, xz_chat_stats_t* stats, bool reset);
+
+/*
+ session trace, needs CONFIG_XZ_CHAT_TRACE. records json messages and audio frames of the protocol layer to path (see xz_trace.h).
+ replay feeds a trace back through the protocol parsing path in the calling task, on a chat that is initialized but not started.
+ speed_pct 100 keeps the original timing, 200 twice as fast, 0 as fast as possible.
+*/
+esp_err_t xz_chat_trace_start(xz_chat_t* chat, const char* path);
+void xz_chat_trace_stop(xz_chat_t* chat);
+esp_err_t xz_chat_trace_replay(xz_chat_t* chat, const char* path, int speed_pct);
+
+/* histograms of the turn latencies, see xz_lat_span_t. reset starts a new window */
+void xz_chat_get_latency_stats(xz_chat_t* chat, xz_lat_stats_t* stats, bool reset);
+
+/* total number of downlink audio frames detected as lost */
+uint32_t xz_chat_get_audio_lost_frames(xz_chat_t* chat);
+
+/*
+ tell the chat how much downlink audio is still buffered in the speaker path, 0 when fully played.
+ after tts stop / abort the chat switches to listening as soon as playback drains,
+ without a report it falls back to waiting 500ms / 250ms. callable from any task.
+*/
+void xz_chat_report_playback_remaining(xz_chat_t* chat, int remaining_ms);
+static inline void xz_chat_report_playback_drained(xz_chat_t* chat) {
+    xz_chat_report_playback_remaining(chat, 0);
+}
+
+/*
+ CONFIG_XZ_CHAT_REACTOR: an uplink frame is ready for read_audio_cb, wakes the main task. safe from ISRs.
+ without it the main task looks for frames every 20ms while capturing. no-op in the default mode.
+*/
+void xz_chat_audio_ready(xz_chat_t* chat);
 
 void xz_chat_set_audio_cb(xz_chat_t* chat, xz_chat_audio_cb_t cb);
+void xz_chat_set_audio_loss_cb(xz_chat_t* chat, xz_chat_audio_loss_cb_t cb);
 void xz_chat_set_event_cb(xz_chat_t* chat, xz_chat_event_cb_t cb);
 void xz_chat_set_read_audio_cb(xz_chat_t* chat, xz_chat_read_audio_cb_t cb);
\ No newline at end of file
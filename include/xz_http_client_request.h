@@ -35,7 +35,8 @@ typedef struct {
 } xz_http_client_response_t;
 
 
-esp_err_t xz_http_client_set_headers(esp_http_client_handle_t client, const char* lang);
+/* device_id / client_id go into the headers and the version check body, see xz_chat_config_t */
+esp_err_t xz_http_client_set_headers(esp_http_client_handle_t client, const char* lang, const char* device_id, const char* client_id);
 
 /*
  client must have headers set
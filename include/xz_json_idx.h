@@ -0,0 +1,67 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ one pass index of a json message: every member of the top level object and of nested
+ objects (up to XZ_JSON_IDX_MAX_DEPTH) gets an entry with its key and value span.
+ lookups are by path, e.g. "$.udp.server", and don't rescan the message.
+ array elements are not indexed, the array itself is.
+ spans point into the original buffer, string values exclude the quotes and are not unescaped.
+*/
+
+#ifndef XZ_JSON_IDX_MAX_ENTRIES
+#define XZ_JSON_IDX_MAX_ENTRIES 32
+#endif
+#ifndef XZ_JSON_IDX_MAX_DEPTH
+#define XZ_JSON_IDX_MAX_DEPTH 3
+#endif
+#ifndef XZ_JSON_IDX_MAX_NESTING
+#define XZ_JSON_IDX_MAX_NESTING 32 // deeper messages fail to parse, the parser recurses on the receiving task's stack
+#endif
+
+typedef enum {
+    XZ_JSON_NONE = 0, // not found
+    XZ_JSON_STRING,
+    XZ_JSON_NUMBER,
+    XZ_JSON_TRUE,
+    XZ_JSON_FALSE,
+    XZ_JSON_NULL,
+    XZ_JSON_OBJECT,
+    XZ_JSON_ARRAY,
+} xz_json_type_t;
+
+typedef struct {
+    const char* key;
+    const char* val;
+    int val_len;
+    uint16_t key_len;
+    int8_t parent;   // entry index of the enclosing object, -1 for top level
+    uint8_t type;    // xz_json_type_t
+} xz_json_idx_entry_t;
+
+typedef struct {
+    const char* json;
+    int len;
+    int n;
+    xz_json_idx_entry_t e[XZ_JSON_IDX_MAX_ENTRIES];
+} xz_json_idx_t;
+
+/* ESP_ERR_INVALID_ARG if json is not an object or malformed. members beyond XZ_JSON_IDX_MAX_ENTRIES are skipped */
+esp_err_t xz_json_idx_build(xz_json_idx_t* idx, const char* json, int len);
+
+/* move all spans to a copy of the indexed buffer, e.g. after strndup */
+void xz_json_idx_rebase(xz_json_idx_t* idx, const char* copy);
+
+/* returns type of the value at path, XZ_JSON_NONE if not found */
+xz_json_type_t xz_json_idx_find(const xz_json_idx_t* idx, const char* path, const char** val, int* len);
+
+/* string value at path, NULL if not found or not a string */
+const char* xz_json_idx_str(const xz_json_idx_t* idx, const char* path, int* len);
+
+/* true if the string at path equals s */
+bool xz_json_idx_streq(const xz_json_idx_t* idx, const char* path, const char* s);
+
+/* false if not found or not a number, *out is left unchanged then */
+bool xz_json_idx_i32(const xz_json_idx_t* idx, const char* path, int* out);
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+
+/* points of a conversation turn, stamped in esp_timer ms. a turn runs from a request (or auto re-listen) to the next one or goodbye */
+typedef enum {
+    XZ_LAT_REQUEST,         // new session / toggle / manual listening requested, e.g. wake word
+    XZ_LAT_DEQUEUE,         // request picked up by the main task
+    XZ_LAT_HELLO_SENT,
+    XZ_LAT_HELLO_RECEIVED,
+    XZ_LAT_CONNECTED,       // audio transport ready: websocket connected / udp socket connected, kept connections don't stamp it
+    XZ_LAT_LISTEN_START,
+    XZ_LAT_FIRST_UPLINK,    // first audio frame sent
+    XZ_LAT_LISTEN_STOP,     // end of speech: stt result or manual stop
+    XZ_LAT_TTS_START,
+    XZ_LAT_FIRST_DOWNLINK,  // first audio frame handed to audio_cb
+    XZ_LAT_TTS_STOP,
+    XZ_LAT_GOODBYE,         // session closed
+    XZ_LAT_MARKS,
+} xz_lat_mark_t;
+
+typedef struct {
+    uint32_t turn;              // counted since init
+    uint32_t ms[XZ_LAT_MARKS];  // 0 if the point wasn't reached in this turn
+} xz_lat_record_t;
+
+/* intervals kept in histograms, only recorded when both ends were stamped */
+typedef enum {
+    XZ_LAT_SPAN_QUEUE,              // REQUEST -> DEQUEUE
+    XZ_LAT_SPAN_HELLO,              // HELLO_SENT -> HELLO_RECEIVED
+    XZ_LAT_SPAN_SETUP,              // DEQUEUE -> LISTEN_START
+    XZ_LAT_SPAN_WAKE_TO_UPLINK,     // REQUEST -> FIRST_UPLINK
+    XZ_LAT_SPAN_SPEECH_END_TO_TTS,  // LISTEN_STOP -> TTS_START
+    XZ_LAT_SPAN_SPEECH_END_TO_AUDIO,// LISTEN_STOP -> FIRST_DOWNLINK
+    XZ_LAT_SPAN_TTS,                // TTS_START -> TTS_STOP
+    XZ_LAT_SPANS,
+} xz_lat_span_t;
+
+#define XZ_LAT_BUCKETS 16
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_ms;
+    uint64_t sum_ms;
+    uint32_t bucket[XZ_LAT_BUCKETS]; // upper bounds from xz_lat_bucket_upper_ms
+} xz_lat_hist_t;
+
+typedef struct {
+    xz_lat_hist_t span[XZ_LAT_SPANS];
+} xz_lat_stats_t;
+
+/* upper bound of a bucket in ms, UINT32_MAX for the last one */
+uint32_t xz_lat_bucket_upper_ms(int bucket);
+
+/* upper bound of the bucket the pct-th percentile falls in (capped at max_ms), 0 if empty */
+uint32_t xz_lat_hist_percentile(const xz_lat_hist_t* h, int pct);
+
+void xz_lat_hist_add(xz_lat_hist_t* h, uint32_t ms);
+
+/* adds every complete span of the record */
+void xz_lat_stats_add(xz_lat_stats_t* s, const xz_lat_record_t* r);
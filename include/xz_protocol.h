@@ -4,12 +4,22 @@
 #include <esp_websocket_client.h>
 #include <mqtt_client.h>
 #include "task_util.h"
+
+typedef struct {
+    int depth;      // frames to buffer before playout starts, 0 disables the jitter buffer
+    int window;     // max distance a packet can be ahead of the playout position, also the number of slots
+    int frame_size; // max bytes per frame
+} xz_jitter_buf_config_t;
+
 typedef struct {
     esp_mqtt_client_config_t client_conf;
     char* pub_topic;
+    int rx_msg_max_size; // messages larger than client_conf.buffer.size are reassembled up to this size
     struct {
         capped_task_config_t task_conf;
         int recv_buf_size;
+        xz_jitter_buf_config_t jitter_buf; // reorder downlink audio by sequence, disabled if depth is 0
+        int dns_ttl_ms; // how long a resolved udp server address is reused, 0 resolves on every session
     } udp_conf;
 } xz_mqtt_prot_config_t;
 
@@ -17,6 +27,9 @@ typedef struct {
 typedef struct {
     esp_websocket_client_config_t client_conf;
     int version;
+    int rx_msg_max_size; // messages split by fragmentation or client_conf.buffer_size are reassembled up to this size
+    bool persistent;     // keep the connection between sessions, open/close only exchange hello/goodbye. kept alive by client_conf.ping_interval_sec
+    int idle_timeout_ms; // persistent connection is closed after this long without a session, 0 to never close
     char headers[200];
 } xz_ws_prot_config_t;
 
@@ -0,0 +1,296 @@
+#include "xz_chat.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+/*
+ N simulated devices in one process, each an xz_chat_t with its own identity.
+ every device: version check -> start -> (wake -> uplink opus from a file -> tts)*turns -> goodbye, sessions times.
+ settings come from the environment, app_main has no argv:
+
+ XZ_LOADGEN_DEVICES   simulated devices (10)
+ XZ_LOADGEN_OTA_URL   version check url (CONFIG_XZ_CHAT_VERSION_CHECK_URL), the activation url is derived from it
+ XZ_LOADGEN_PROT      mqtt or ws (mqtt)
+ XZ_LOADGEN_RAMP_MS   devices are started evenly over this time (1000)
+ XZ_LOADGEN_SESSIONS  sessions per device (1)
+ XZ_LOADGEN_TURNS     turns per session (1)
+ XZ_LOADGEN_OPUS      uplink frames, each prefixed with a 2 byte big endian length (default silence)
+ XZ_LOADGEN_TIMEOUT_S (120)
+
+ output, one line each:
+ LOADGEN setup devices=.. ok=.. failed=.. rate_per_s=.. p50_ms=.. p99_ms=..
+ LOADGEN span=<name> count=.. p50_ms=.. p90_ms=.. p99_ms=.. max_ms=..
+ LOADGEN per_device span=speech_end_to_audio p90_ms_p50=.. p90_ms_p99=..
+ LOADGEN throughput secs=.. tx_frames=.. rx_frames=.. tx_kbps=.. rx_kbps=.. tx_errors=.. rx_lost=..
+*/
+
+#define LOADGEN_MAX_FRAME 1500
+#define LOADGEN_FRAME_MS 60 // frame_duration the chat announces in its hello
+
+typedef struct {
+    int idx;
+    xz_chat_t* chat;
+    char device_id[18];
+    char client_id[37];
+    int64_t t_begin;
+    int64_t t_started;
+    int turns;
+    int sessions;
+    int frame;              // next uplink frame
+    int64_t next_read_us;
+    bool done;
+    bool failed;
+    uint8_t buf[XZ_TX_AUDIO_HEADROOM + LOADGEN_MAX_FRAME];
+} device_t;
+
+static struct {
+    int devices;
+    const char* ota_url;
+    char act_url[256];
+    xz_prot_type_t prot;
+    int ramp_ms;
+    int sessions;
+    int turns;
+    int timeout_s;
+} s_conf;
+
+static uint8_t** s_frames;
+static uint16_t* s_frame_len;
+static int s_nframes;
+static SemaphoreHandle_t s_done;
+static _Atomic int s_failed;
+
+static int env_int(const char* name, int def) {
+    const char* v = getenv(name);
+    return v && *v? atoi(v): def;
+}
+
+static int load_frames(const char* path) {
+    static const uint8_t silence[] = {0xfb, 0x03, 0xff, 0xfe, 0xff, 0xfe, 0xff, 0xfe}; // 3 x 20ms celt silence
+    if(!path) {
+        s_frames = malloc(sizeof(*s_frames));
+        s_frame_len = malloc(sizeof(*s_frame_len));
+        if(!s_frames || !s_frame_len) return -1;
+        s_frames[0] = (uint8_t*)silence;
+        s_frame_len[0] = sizeof(silence);
+        s_nframes = 1;
+        return 0;
+    }
+    FILE* fp = fopen(path, "rb");
+    if(!fp) return -1;
+    uint8_t lb[2];
+    while(fread(lb, 2, 1, fp) == 1) {
+        int len = (lb[0] << 8) | lb[1];
+        uint8_t** f = realloc(s_frames, (s_nframes + 1) * sizeof(*s_frames));
+        if(f) s_frames = f;
+        uint16_t* l = realloc(s_frame_len, (s_nframes + 1) * sizeof(*s_frame_len));
+        if(l) s_frame_len = l;
+        uint8_t* d = len <= LOADGEN_MAX_FRAME? malloc(len + 1): NULL;
+        if(!f || !l || !d || (len && fread(d, len, 1, fp) != 1)) {
+            fclose(fp);
+            return -1;
+        }
+        s_frames[s_nframes] = d;
+        s_frame_len[s_nframes++] = len;
+    }
+    fclose(fp);
+    return s_nframes? 0: -1;
+}
+
+static void device_done(device_t* dev, bool failed) {
+    if(dev->done) return;
+    dev->done = true;
+    dev->failed = failed;
+    if(failed) atomic_fetch_add(&s_failed, 1);
+    xSemaphoreGive(s_done);
+}
+
+// paced at the opus frame duration, as a microphone would be. sent from the read audio task, no queue, so one buffer will do
+static esp_err_t on_read_audio(xz_tx_audio_pck_t* audio, xz_chat_t* chat) {
+    device_t* dev = xz_chat_get_user_data(chat);
+    int64_t now = esp_timer_get_time();
+    if(dev->next_read_us < now - 1000000) dev->next_read_us = now;
+    if(dev->next_read_us > now) vTaskDelay(pdMS_TO_TICKS((dev->next_read_us - now) / 1000) + 1);
+    dev->next_read_us += LOADGEN_FRAME_MS * 1000;
+    int i = dev->frame++ % s_nframes;
+    memcpy(dev->buf + XZ_TX_AUDIO_HEADROOM, s_frames[i], s_frame_len[i]);
+    audio->buf = dev->buf + XZ_TX_AUDIO_HEADROOM;
+    audio->len = s_frame_len[i];
+    audio->headroom = XZ_TX_AUDIO_HEADROOM;
+    audio->writable = true;
+    return ESP_OK;
+}
+
+static void on_audio(uint8_t* data, int len, xz_chat_t* chat) {
+    // nothing to play, downlink is counted by xz_chat_get_stats
+}
+
+static void session_end(device_t* dev) {
+    dev->turns = 0;
+    if(++ dev->sessions >= s_conf.sessions) {
+        device_done(dev, false);
+    } else {
+        xz_chat_new_session(dev->chat);
+    }
+}
+
+static void on_event(xz_chat_event_t event, xz_chat_event_data_t* event_data, xz_chat_t* chat) {
+    device_t* dev = xz_chat_get_user_data(chat);
+    switch(event) {
+    case XZ_EVENT_VERSION_CHECK_RESULT:
+        if(event_data->version_check_err) device_done(dev, true);
+        else if(event_data->parsed_response->require_activation) xz_chat_activation_check(chat, NULL);
+        else xz_chat_start(chat);
+        break;
+    case XZ_EVENT_ACTIVATION_CHECK_RESULT:
+        if(event_data->activation_check_err) xz_chat_activation_check(chat, NULL);
+        else xz_chat_start(chat);
+        break;
+    case XZ_EVENT_STARTED:
+        dev->t_started = esp_timer_get_time();
+        xz_chat_new_session(chat); // wake
+        break;
+    case XZ_EVENT_STOPPED:
+        device_done(dev, true);
+        break;
+    case XZ_EVENT_TTS_STOP:
+        if(dev->done || ++ dev->turns < s_conf.turns) break; // auto listening goes on
+        xz_chat_exit_session(chat);
+        session_end(dev);
+        break;
+    case XZ_EVENT_GOODBYE: // the server ended the session first
+        if(!dev->done && dev->turns) session_end(dev);
+        break;
+    default:
+        break;
+    }
+}
+
+static void print_hist(const char* name, const xz_lat_hist_t* h) {
+    printf("LOADGEN span=%s count=%lu p50_ms=%lu p90_ms=%lu p99_ms=%lu max_ms=%lu\n", name, (unsigned long)h->count,
+        (unsigned long)xz_lat_hist_percentile(h, 50), (unsigned long)xz_lat_hist_percentile(h, 90),
+        (unsigned long)xz_lat_hist_percentile(h, 99), (unsigned long)h->max_ms);
+}
+
+static void merge_hist(xz_lat_hist_t* to, const xz_lat_hist_t* from) {
+    for(int b=0; b<XZ_LAT_BUCKETS; b++) to->bucket[b] += from->bucket[b];
+    to->count += from->count;
+    to->sum_ms += from->sum_ms;
+    if(from->max_ms > to->max_ms) to->max_ms = from->max_ms;
+}
+
+static void report(device_t* devs, int64_t t0, int64_t t1) {
+    static const char* const span_names[XZ_LAT_SPANS] = {
+        [XZ_LAT_SPAN_QUEUE] = "queue",
+        [XZ_LAT_SPAN_HELLO] = "hello",
+        [XZ_LAT_SPAN_SETUP] = "setup",
+        [XZ_LAT_SPAN_WAKE_TO_UPLINK] = "wake_to_uplink",
+        [XZ_LAT_SPAN_SPEECH_END_TO_TTS] = "speech_end_to_tts",
+        [XZ_LAT_SPAN_SPEECH_END_TO_AUDIO] = "speech_end_to_audio",
+        [XZ_LAT_SPAN_TTS] = "tts",
+    };
+    xz_lat_hist_t setup = {0}, per_device = {0};
+    xz_lat_stats_t all = {0};
+    uint64_t tx_frames = 0, rx_frames = 0, tx_bytes = 0, rx_bytes = 0, tx_errors = 0, rx_lost = 0;
+    int64_t first_begin = INT64_MAX, last_started = 0;
+    int ok = 0;
+    for(int i=0; i<s_conf.devices; i++) {
+        device_t* dev = &devs[i];
+        if(dev->t_started) {
+            xz_lat_hist_add(&setup, (dev->t_started - dev->t_begin) / 1000);
+            if(dev->t_begin < first_begin) first_begin = dev->t_begin;
+            if(dev->t_started > last_started) last_started = dev->t_started;
+        }
+        if(dev->done && !dev->failed) ok++;
+        if(!dev->chat) continue;
+        xz_lat_stats_t s;
+        xz_chat_get_latency_stats(dev->chat, &s, false);
+        for(int k=0; k<XZ_LAT_SPANS; k++) merge_hist(&all.span[k], &s.span[k]);
+        if(s.span[XZ_LAT_SPAN_SPEECH_END_TO_AUDIO].count)
+            xz_lat_hist_add(&per_device, xz_lat_hist_percentile(&s.span[XZ_LAT_SPAN_SPEECH_END_TO_AUDIO], 90));
+        xz_chat_stats_t st;
+        xz_chat_get_stats(dev->chat, &st, false);
+        tx_frames += st.tx_frames;
+        rx_frames += st.rx_frames;
+        tx_bytes += st.tx_bytes;
+        rx_bytes += st.rx_bytes;
+        tx_errors += st.tx_errors;
+        rx_lost += st.rx_lost_frames;
+    }
+    double setup_secs = last_started > first_begin? (last_started - first_begin) / 1e6: 0;
+    printf("LOADGEN setup devices=%d ok=%d failed=%d rate_per_s=%.1f p50_ms=%lu p99_ms=%lu\n",
+        s_conf.devices, ok, s_conf.devices - ok, setup_secs > 0? setup.count / setup_secs: 0,
+        (unsigned long)xz_lat_hist_percentile(&setup, 50), (unsigned long)xz_lat_hist_percentile(&setup, 99));
+    for(int k=0; k<XZ_LAT_SPANS; k++) print_hist(span_names[k], &all.span[k]);
+    printf("LOADGEN per_device span=speech_end_to_audio p90_ms_p50=%lu p90_ms_p99=%lu\n",
+        (unsigned long)xz_lat_hist_percentile(&per_device, 50), (unsigned long)xz_lat_hist_percentile(&per_device, 99));
+    double secs = (t1 - t0) / 1e6;
+    printf("LOADGEN throughput secs=%.1f tx_frames=%llu rx_frames=%llu tx_kbps=%.1f rx_kbps=%.1f tx_errors=%llu rx_lost=%llu\n",
+        secs, (unsigned long long)tx_frames, (unsigned long long)rx_frames,
+        tx_bytes * 8 / 1000.0 / secs, rx_bytes * 8 / 1000.0 / secs,
+        (unsigned long long)tx_errors, (unsigned long long)rx_lost);
+}
+
+void app_main(void) {
+    s_conf.devices = env_int("XZ_LOADGEN_DEVICES", 10);
+    s_conf.ota_url = getenv("XZ_LOADGEN_OTA_URL")? getenv("XZ_LOADGEN_OTA_URL"): CONFIG_XZ_CHAT_VERSION_CHECK_URL;
+    snprintf(s_conf.act_url, sizeof(s_conf.act_url), "%s%sactivate", s_conf.ota_url, s_conf.ota_url[strlen(s_conf.ota_url)-1] == '/'? "": "/");
+    s_conf.prot = getenv("XZ_LOADGEN_PROT") && 0 == strcmp(getenv("XZ_LOADGEN_PROT"), "ws")? XZ_PROT_TYPE_WS: XZ_PROT_TYPE_MQTT;
+    s_conf.ramp_ms = env_int("XZ_LOADGEN_RAMP_MS", 1000);
+    s_conf.sessions = env_int("XZ_LOADGEN_SESSIONS", 1);
+    s_conf.turns = env_int("XZ_LOADGEN_TURNS", 1);
+    s_conf.timeout_s = env_int("XZ_LOADGEN_TIMEOUT_S", 120);
+    if(s_conf.devices <= 0 || load_frames(getenv("XZ_LOADGEN_OPUS"))) {
+        fprintf(stderr, "bad settings or opus file\n");
+        exit(EXIT_FAILURE);
+    }
+    device_t* devs = calloc(s_conf.devices, sizeof(device_t));
+    s_done = xSemaphoreCreateCounting(s_conf.devices, 0);
+    assert(devs && s_done);
+
+    int64_t t0 = esp_timer_get_time();
+    for(int i=0; i<s_conf.devices; i++) {
+        device_t* dev = &devs[i];
+        dev->idx = i;
+        // locally administered mac and a uuid derived from the index, stable between runs
+        snprintf(dev->device_id, sizeof(dev->device_id), "02:4c:%02x:%02x:%02x:%02x", (i>>24)&0xff, (i>>16)&0xff, (i>>8)&0xff, i&0xff);
+        snprintf(dev->client_id, sizeof(dev->client_id), "00000000-0000-4000-8000-%012x", i);
+        xz_chat_config_t conf = XZ_CHAT_CONFIG_DEFAULT(on_read_audio, on_event, on_audio);
+        conf.device_id = dev->device_id;
+        conf.client_id = dev->client_id;
+        conf.ota.version_check_url = (char*)s_conf.ota_url;
+        conf.ota.activation_check_url = s_conf.act_url;
+        conf.prot_pref = s_conf.prot;
+        conf.send_audio_q_size = 0; // sent from the read task, the frame buffer is reused right away
+        dev->t_begin = esp_timer_get_time();
+        if(!(dev->chat = xz_chat_init(&conf))) {
+            device_done(dev, true);
+            continue;
+        }
+        xz_chat_set_user_data(dev->chat, dev);
+        xz_chat_version_check(dev->chat, NULL);
+        if(s_conf.ramp_ms > 0) vTaskDelay(pdMS_TO_TICKS(s_conf.ramp_ms / s_conf.devices));
+    }
+
+    int done = 0;
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(s_conf.timeout_s * 1000);
+    while(done < s_conf.devices) {
+        TickType_t now = xTaskGetTickCount();
+        if(now >= deadline || pdTRUE != xSemaphoreTake(s_done, deadline - now)) break;
+        done++;
+    }
+    int64_t t1 = esp_timer_get_time();
+    if(done < s_conf.devices) fprintf(stderr, "timeout, %d devices unfinished\n", s_conf.devices - done);
+    report(devs, t0, t1);
+    fflush(stdout);
+
+    for(int i=0; i<s_conf.devices; i++) {
+        if(devs[i].chat) xz_chat_destroy(devs[i].chat);
+    }
+    exit(done < s_conf.devices || atomic_load(&s_failed)? EXIT_FAILURE: EXIT_SUCCESS);
+}
@@ -0,0 +1,114 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <openssl/sha.h>
+
+static int s_activation_calls;
+static bool s_activated;
+
+// value of a header in the request head, NULL if absent. the head is nul terminated
+static const char* header(const char* head, const char* name, int* len) {
+    size_t nl = strlen(name);
+    for(const char* p = strstr(head, "\r\n"); p && p[2] != '\r'; p = strstr(p + 2, "\r\n")) {
+        const char* line = p + 2;
+        if(strncasecmp(line, name, nl) || line[nl] != ':') continue;
+        const char* v = line + nl + 1;
+        while(*v == ' ') v++;
+        const char* e = strstr(v, "\r\n");
+        *len = e? e - v: (int)strlen(v);
+        return v;
+    }
+    return NULL;
+}
+
+static int respond(conn_t* c, int status, const char* reason, const char* body) {
+    char head[256];
+    int blen = strlen(body);
+    int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n", status, reason, blen);
+    return conn_write(c, head, n) || conn_write(c, body, blen)? -1: 0;
+}
+
+static int ota_response(conn_t* c) {
+    char body[1024];
+    int n = snprintf(body, sizeof(body), "{\"firmware\":{\"version\":\"0.0.0\",\"url\":\"\"}");
+    if(g_conf.activation_pending >= 0 && !s_activated) {
+        n += snprintf(body + n, sizeof(body) - n,
+            ",\"activation\":{\"message\":\"local server\",\"code\":\"123456\",\"challenge\":\"local\",\"timeout_ms\":3000}");
+    }
+    if(strcmp(g_conf.prot, "ws")) {
+        n += snprintf(body + n, sizeof(body) - n,
+            ",\"mqtt\":{\"endpoint\":\"%s:%d\",\"client_id\":\"local-%p\",\"username\":\"local\",\"password\":\"local\",\"publish_topic\":\"device-server\"}",
+            g_conf.host, g_conf.mqtt_port, (void*)c);
+    }
+    if(strcmp(g_conf.prot, "mqtt")) {
+        n += snprintf(body + n, sizeof(body) - n, ",\"websocket\":{\"url\":\"ws://%s:%d/xiaozhi/v1/\",\"token\":\"local-token\"", g_conf.host, g_conf.http_port);
+        if(g_conf.ws_version) n += snprintf(body + n, sizeof(body) - n, ",\"version\":%d", g_conf.ws_version);
+        n += snprintf(body + n, sizeof(body) - n, "}");
+    }
+    snprintf(body + n, sizeof(body) - n, "}");
+    return respond(c, 200, "OK", body);
+}
+
+static int activation_response(conn_t* c) {
+    if(g_conf.activation_pending >= 0 && s_activation_calls++ < g_conf.activation_pending) {
+        return respond(c, 202, "Accepted", "{\"message\":\"pending\"}");
+    }
+    s_activated = true;
+    return respond(c, 200, "OK", "{\"message\":\"activated\"}");
+}
+
+static int ws_upgrade(conn_t* c, const char* head) {
+    int klen, vlen, ilen;
+    const char* key = header(head, "Sec-WebSocket-Key", &klen);
+    const char* ver = header(head, "Protocol-Version", &vlen);
+    const char* id = header(head, "Client-Id", &ilen);
+    if(!key || klen > 64) return respond(c, 400, "Bad Request", "{}");
+    char buf[128];
+    int n = snprintf(buf, sizeof(buf), "%.*s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", klen, key);
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1((uint8_t*)buf, n, digest);
+    char accept[64];
+    EVP_EncodeBlock((uint8_t*)accept, digest, sizeof(digest));
+    c->ws_version = ver? atoi(ver): 1;
+    if(c->ws_version < 1 || c->ws_version > 3) c->ws_version = 1;
+    snprintf(c->client_id, sizeof(c->client_id), "%.*s", id? ilen: 0, id? id: "");
+    n = snprintf(buf, sizeof(buf), "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+    if(conn_write(c, buf, n)) return -1;
+    c->type = CONN_WS;
+    LOG("ws connected, version %d, client %s", c->ws_version, c->client_id);
+    return 0;
+}
+
+int http_process(conn_t* c) {
+    while(c->type == CONN_HTTP) {
+        uint8_t* end = memmem(c->in, c->in_len, "\r\n\r\n", 4);
+        if(!end) return c->in_len > 16384? -1: 0;
+        size_t head_len = end + 4 - c->in;
+        char* head = malloc(head_len + 1);
+        if(!head) return -1;
+        memcpy(head, c->in, head_len);
+        head[head_len] = 0;
+        int n;
+        const char* cl = header(head, "Content-Length", &n);
+        size_t body_len = cl? strtoul(cl, NULL, 10): 0;
+        if(c->in_len < head_len + body_len) {
+            free(head);
+            return body_len > 65536? -1: 0;
+        }
+        char method[8] = "", path[128] = "";
+        sscanf(head, "%7s %127s", method, path);
+        LOGV("http %s %s", method, path);
+        int ret;
+        const char* up = header(head, "Upgrade", &n);
+        if(up && 0 == strncasecmp(up, "websocket", 9)) ret = ws_upgrade(c, head);
+        else if(strstr(path, "activate")) ret = activation_response(c);
+        else if(strstr(path, "ota")) ret = ota_response(c);
+        else ret = respond(c, 404, "Not Found", "{}");
+        free(head);
+        memmove(c->in, c->in + head_len + body_len, c->in_len - head_len - body_len);
+        c->in_len -= head_len + body_len;
+        if(ret) return ret;
+    }
+    return 0;
+}
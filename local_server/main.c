@@ -0,0 +1,271 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+server_conf_t g_conf = {
+    .host = "127.0.0.1",
+    .http_port = 8080,
+    .mqtt_port = 1883,
+    .udp_port = 8888,
+    .ws_version = 1,
+    .prot = "both",
+    .activation_pending = -1,
+    .utterance_ms = 1500,
+    .tts_frames = 25,
+};
+
+static conn_t* s_conns;
+static int s_nconns;
+
+int64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+conn_t* conn_first() {
+    return s_conns;
+}
+
+static int grow(uint8_t** buf, size_t* cap, size_t need) {
+    if(need <= *cap) return 0;
+    size_t n = *cap? *cap: 4096;
+    while(n < need) n *= 2;
+    uint8_t* tmp = realloc(*buf, n);
+    if(!tmp) return -1;
+    *buf = tmp;
+    *cap = n;
+    return 0;
+}
+
+static void flush_out(conn_t* c) {
+    while(c->out_len) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if(n <= 0) {
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            c->closing = true;
+            c->out_len = 0;
+            return;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+}
+
+// queued till the loop polls the socket writable, so pieces of a packet go out together. a slow device only grows its own buffer
+int conn_write(conn_t* c, const void* data, size_t len) {
+    if(c->closing && c->out_len == 0) return -1;
+    if(len == 0) return 0;
+    if(grow(&c->out, &c->out_cap, c->out_len + len)) return -1;
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+static int listen_tcp(int port) {
+    int fd = socket(AF_INET6, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    int one = 1, zero = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons(port), .sin6_addr = in6addr_any };
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 128)) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static void accept_conn(int lfd, conn_type_t type) {
+    int fd;
+    while((fd = accept(lfd, NULL, NULL)) >= 0) {
+        conn_t* c = calloc(1, sizeof(conn_t));
+        if(!c) {
+            close(fd);
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        c->fd = fd;
+        c->type = type;
+        c->sess.conn = c;
+        c->next = s_conns;
+        s_conns = c;
+        s_nconns++;
+        LOGV("accepted %s conn fd=%d", type == CONN_MQTT? "mqtt": "http", fd);
+    }
+}
+
+static void free_conn(conn_t* c) {
+    LOGV("closed conn fd=%d", c->fd);
+    session_close(&c->sess);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+    s_nconns--;
+}
+
+static void read_conn(conn_t* c) {
+    for(;;) {
+        if(grow(&c->in, &c->in_cap, c->in_len + 4096)) {
+            c->closing = true;
+            return;
+        }
+        ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if(n <= 0) {
+            c->closing = true;
+            c->out_len = 0;
+            return;
+        }
+        c->in_len += n;
+    }
+    int ret;
+    switch(c->type) { // an upgrade request may be followed by ws frames in the same read
+    case CONN_HTTP:
+        ret = http_process(c);
+        if(ret >= 0 && c->type == CONN_WS) ret = ws_process(c);
+        break;
+    case CONN_WS: ret = ws_process(c); break;
+    case CONN_MQTT: ret = mqtt_process(c); break;
+    default: ret = -1;
+    }
+    if(ret < 0) {
+        c->closing = true;
+    }
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --host ADDR            address announced to the device (%s)\n"
+        "  --http-port N          ota, activation and websocket (%d)\n"
+        "  --mqtt-port N          (%d)\n"
+        "  --udp-port N           (%d)\n"
+        "  --prot mqtt|ws|both    sections of the ota response (%s)\n"
+        "  --ws-version N         websocket binary protocol offered in the ota response, 1..3 (%d)\n"
+        "  --activation N         ask for activation, the check passes after N pending replies\n"
+        "  --utterance-ms N       uplink audio of an auto turn before stt is sent (%d)\n"
+        "  --tts-frames N         frames per reply (%d)\n"
+        "  --turns N              say goodbye after N turns, 0 = never (%d)\n"
+        "  --opus FILE            canned tts frames, each prefixed with a 2 byte big endian length (default silence)\n"
+        "  -v                     log every message\n",
+        prog, g_conf.host, g_conf.http_port, g_conf.mqtt_port, g_conf.udp_port, g_conf.prot, g_conf.ws_version,
+        g_conf.utterance_ms, g_conf.tts_frames, g_conf.turns);
+}
+
+static int parse_args(int argc, char** argv) {
+    static const struct option opts[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"http-port", required_argument, NULL, 'h'},
+        {"mqtt-port", required_argument, NULL, 'm'},
+        {"udp-port", required_argument, NULL, 'u'},
+        {"prot", required_argument, NULL, 'p'},
+        {"ws-version", required_argument, NULL, 'w'},
+        {"activation", required_argument, NULL, 'a'},
+        {"utterance-ms", required_argument, NULL, 'U'},
+        {"tts-frames", required_argument, NULL, 't'},
+        {"turns", required_argument, NULL, 'T'},
+        {"opus", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, '?'},
+        {0},
+    };
+    int opt;
+    while((opt = getopt_long(argc, argv, "v?", opts, NULL)) != -1) {
+        switch(opt) {
+        case 'H': g_conf.host = optarg; break;
+        case 'h': g_conf.http_port = atoi(optarg); break;
+        case 'm': g_conf.mqtt_port = atoi(optarg); break;
+        case 'u': g_conf.udp_port = atoi(optarg); break;
+        case 'p': g_conf.prot = optarg; break;
+        case 'w': g_conf.ws_version = atoi(optarg); break;
+        case 'a': g_conf.activation_pending = atoi(optarg); break;
+        case 'U': g_conf.utterance_ms = atoi(optarg); break;
+        case 't': g_conf.tts_frames = atoi(optarg); break;
+        case 'T': g_conf.turns = atoi(optarg); break;
+        case 'o': g_conf.opus_file = optarg; break;
+        case 'v': g_conf.verbose = 1; break;
+        default: return -1;
+        }
+    }
+    if(g_conf.ws_version < 0 || g_conf.ws_version > 3) return -1;
+    if(strcmp(g_conf.prot, "mqtt") && strcmp(g_conf.prot, "ws") && strcmp(g_conf.prot, "both")) return -1;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if(parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if(session_load_opus(g_conf.opus_file)) return 1;
+    int http_fd = listen_tcp(g_conf.http_port);
+    int mqtt_fd = listen_tcp(g_conf.mqtt_port);
+    int udp_fd = udp_open(g_conf.udp_port);
+    if(http_fd < 0 || mqtt_fd < 0 || udp_fd < 0) {
+        LOG("listen failed: %s", strerror(errno));
+        return 1;
+    }
+    LOG("http :%d  mqtt :%d  udp :%d  announced as %s", g_conf.http_port, g_conf.mqtt_port, g_conf.udp_port, g_conf.host);
+
+    struct pollfd* fds = NULL;
+    int fds_cap = 0;
+    for(;;) {
+        // due work first, it sets the poll timeout
+        int64_t now = now_us(), wait_us = -1;
+        for(conn_t* c = s_conns; c; c = c->next) {
+            int64_t w = session_poll(&c->sess, now);
+            if(w >= 0 && (wait_us < 0 || w < wait_us)) wait_us = w;
+        }
+        for(conn_t** pp = &s_conns; *pp; ) {
+            conn_t* c = *pp;
+            if(c->closing && c->out_len == 0) {
+                *pp = c->next;
+                free_conn(c);
+            } else {
+                pp = &c->next;
+            }
+        }
+        if(fds_cap < s_nconns + 3) {
+            fds_cap = (s_nconns + 3) * 2;
+            fds = realloc(fds, fds_cap * sizeof(*fds));
+            if(!fds) return 1;
+        }
+        int n = 0;
+        fds[n++] = (struct pollfd){ .fd = http_fd, .events = POLLIN };
+        fds[n++] = (struct pollfd){ .fd = mqtt_fd, .events = POLLIN };
+        fds[n++] = (struct pollfd){ .fd = udp_fd, .events = POLLIN };
+        for(conn_t* c = s_conns; c; c = c->next) {
+            fds[n++] = (struct pollfd){ .fd = c->fd, .events = POLLIN | (c->out_len? POLLOUT: 0) };
+        }
+        int timeout_ms = wait_us < 0? 1000: (int)((wait_us + 999) / 1000);
+        if(poll(fds, n, timeout_ms) < 0 && errno != EINTR) {
+            LOG("poll: %s", strerror(errno));
+            return 1;
+        }
+        if(fds[0].revents & POLLIN) accept_conn(http_fd, CONN_HTTP);
+        if(fds[1].revents & POLLIN) accept_conn(mqtt_fd, CONN_MQTT);
+        if(fds[2].revents & POLLIN) udp_process(udp_fd);
+        // conns accepted above aren't in fds yet, they are the head of the list
+        int i = 3;
+        for(conn_t* c = s_conns; c && i < n; c = c->next) {
+            if(c->fd != fds[i].fd) continue;
+            short ev = fds[i++].revents;
+            if(ev & POLLOUT) flush_out(c);
+            if(ev & (POLLIN | POLLHUP | POLLERR)) read_conn(c);
+        }
+    }
+}
@@ -0,0 +1,128 @@
+#include "server.h"
+#include <string.h>
+
+/*
+ just enough of mqtt 3.1.1 for the device: connect, qos 0/1 publish, subscribe, ping.
+ there is no routing, whatever the device publishes goes to its session
+ and the session publishes back on devices/p2p/<client id>, like the cloud broker does.
+*/
+
+enum {
+    MQTT_CONNECT = 1,
+    MQTT_CONNACK,
+    MQTT_PUBLISH,
+    MQTT_PUBACK,
+    MQTT_SUBSCRIBE = 8,
+    MQTT_SUBACK,
+    MQTT_UNSUBSCRIBE,
+    MQTT_UNSUBACK,
+    MQTT_PINGREQ,
+    MQTT_PINGRESP,
+    MQTT_DISCONNECT,
+};
+
+static int put_remaining_len(uint8_t* p, size_t len) {
+    int n = 0;
+    do {
+        p[n] = len & 0x7f;
+        len >>= 7;
+        if(len) p[n] |= 0x80;
+        n++;
+    } while(len);
+    return n;
+}
+
+static int send_packet(conn_t* c, uint8_t type_flags, const void* var, size_t var_len, const void* payload, size_t payload_len) {
+    uint8_t h[5];
+    h[0] = type_flags;
+    int hl = 1 + put_remaining_len(&h[1], var_len + payload_len);
+    return conn_write(c, h, hl) || conn_write(c, var, var_len) || conn_write(c, payload, payload_len)? -1: 0;
+}
+
+int mqtt_publish(conn_t* c, const char* topic, const void* data, size_t len) {
+    uint8_t var[2 + 128];
+    size_t tl = strlen(topic);
+    if(tl > 128) return -1;
+    var[0] = tl >> 8;
+    var[1] = tl;
+    memcpy(&var[2], topic, tl);
+    return send_packet(c, MQTT_PUBLISH << 4, var, 2 + tl, data, len);
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static int on_connect(conn_t* c, const uint8_t* p, size_t len) {
+    // protocol name, level, flags, keepalive, then client id first in the payload
+    if(len < 10) return -1;
+    size_t off = 2 + get_u16(p);
+    if(off + 6 > len) return -1;
+    off += 4;
+    size_t idl = get_u16(p + off);
+    if(off + 2 + idl > len) return -1;
+    snprintf(c->client_id, sizeof(c->client_id), "%.*s", (int)idl, p + off + 2);
+    LOG("mqtt connected, client %s", c->client_id);
+    uint8_t ack[2] = {0, 0};
+    return send_packet(c, MQTT_CONNACK << 4, ack, 2, NULL, 0);
+}
+
+static int on_publish(conn_t* c, uint8_t flags, uint8_t* p, size_t len) {
+    int qos = (flags >> 1) & 3;
+    if(len < 2) return -1;
+    size_t off = 2 + get_u16(p);
+    if(qos) {
+        if(off + 2 > len) return -1;
+        uint8_t id[2] = {p[off], p[off+1]};
+        off += 2;
+        if(send_packet(c, MQTT_PUBACK << 4, id, 2, NULL, 0)) return -1; // qos 2 isn't used by the device
+    }
+    if(off > len) return -1;
+    session_on_json(c, (char*)p + off, len - off);
+    return 0;
+}
+
+static int on_subscribe(conn_t* c, const uint8_t* p, size_t len) {
+    if(len < 2) return -1;
+    uint8_t ack[2 + 32] = {p[0], p[1]};
+    int n = 0;
+    for(size_t off = 2; off + 2 <= len && n < 32; n++) {
+        off += 2 + get_u16(p + off) + 1;
+        ack[2 + n] = 0; // granted qos 0
+    }
+    return send_packet(c, MQTT_SUBACK << 4, ack, 2 + n, NULL, 0);
+}
+
+int mqtt_process(conn_t* c) {
+    for(;;) {
+        if(c->in_len < 2) return 0;
+        size_t rl = 0, hl = 1;
+        int shift = 0;
+        do {
+            if(hl >= c->in_len) return 0;
+            if(hl > 4) return -1;
+            rl |= (size_t)(c->in[hl] & 0x7f) << shift;
+            shift += 7;
+        } while(c->in[hl++] & 0x80);
+        if(rl > (1 << 20)) return -1;
+        if(c->in_len < hl + rl) return 0;
+        uint8_t type = c->in[0] >> 4, flags = c->in[0] & 0x0f;
+        uint8_t* p = c->in + hl;
+        int ret = 0;
+        switch(type) {
+        case MQTT_CONNECT: ret = on_connect(c, p, rl); break;
+        case MQTT_PUBLISH: ret = on_publish(c, flags, p, rl); break;
+        case MQTT_SUBSCRIBE: ret = on_subscribe(c, p, rl); break;
+        case MQTT_UNSUBSCRIBE: ret = rl < 2? -1: send_packet(c, MQTT_UNSUBACK << 4, p, 2, NULL, 0); break;
+        case MQTT_PINGREQ: ret = send_packet(c, MQTT_PINGRESP << 4, NULL, 0, NULL, 0); break;
+        case MQTT_DISCONNECT: c->closing = true; break;
+        case MQTT_PUBACK: break;
+        default:
+            LOG("mqtt packet type %d not supported", type);
+            ret = -1;
+        }
+        memmove(c->in, c->in + hl + rl, c->in_len - hl - rl);
+        c->in_len -= hl + rl;
+        if(ret || c->closing) return ret;
+    }
+}
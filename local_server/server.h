@@ -0,0 +1,118 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+
+/*
+ local stand-in for the xiaozhi cloud, one thread, one poll loop.
+ http:  ota version check, activation, websocket upgrade (same port)
+ mqtt:  a minimal 3.1.1 broker, device publishes json, the server publishes back on devices/p2p/<client id>
+ udp:   aes-128-ctr audio with the 16 byte nonce header, one socket for all sessions
+*/
+
+#define LOG(fmt, ...) fprintf(stderr, "%lld " fmt "\n", (long long)(now_us() / 1000), ##__VA_ARGS__)
+#define LOGV(fmt, ...) do{ if(g_conf.verbose) LOG(fmt, ##__VA_ARGS__); }while(0)
+
+typedef struct {
+    const char* host;       // address the device connects to, put in the ota response and the udp block
+    int http_port;
+    int mqtt_port;
+    int udp_port;
+    int ws_version;         // offered in the ota response, 0 = let the device choose
+    const char* prot;       // "mqtt" or "ws" or "both" in the ota response
+    int activation_pending; // activation check returns 202 this many times before 200, -1 = no activation block
+    int utterance_ms;       // uplink audio of an auto/realtime turn before the server "hears" the end of speech
+    int tts_frames;         // frames per reply
+    int turns;              // goodbye after this many turns, 0 = never
+    const char* opus_file;  // canned frames, each prefixed with a 2 byte big endian length
+    int verbose;
+} server_conf_t;
+
+extern server_conf_t g_conf;
+
+int64_t now_us();
+
+typedef enum {
+    CONN_HTTP,
+    CONN_WS,
+    CONN_MQTT,
+} conn_type_t;
+
+typedef enum {
+    SESS_IDLE,      // no hello yet
+    SESS_OPEN,      // hello answered
+} sess_state_t;
+
+struct conn;
+
+typedef struct session {
+    struct conn* conn;      // control channel
+    sess_state_t state;
+    char id[24];
+    int frame_ms;
+    uint32_t turns;
+    // uplink
+    bool listening;
+    bool manual;
+    int64_t heard_ms;       // uplink audio of the current turn
+    uint32_t rx_frames;
+    uint32_t rx_bytes;
+    // tts
+    int tts_left;           // frames still to send, 0 = not speaking
+    int64_t next_frame_us;
+    uint32_t tts_ts;
+    bool goodbye_after_tts;
+    // udp, mqtt only
+    uint8_t key[16];
+    uint8_t nonce[16];
+    uint32_t tag;           // nonce bytes 4..7, tells sessions apart on the shared socket
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    uint32_t tx_seq;
+    EVP_CIPHER_CTX* aes;
+} session_t;
+
+typedef struct conn {
+    int fd;
+    conn_type_t type;
+    uint8_t* in;
+    size_t in_len, in_cap;
+    uint8_t* out;
+    size_t out_len, out_cap;
+    bool closing;           // close once out is flushed
+    int ws_version;
+    int ws_msg_op;          // of the message being assembled
+    size_t ws_msg_len;
+    char client_id[64];
+    session_t sess;
+    struct conn* next;
+} conn_t;
+
+/* main.c */
+int conn_write(conn_t* c, const void* data, size_t len);
+conn_t* conn_first();
+
+/* http.c, consumes what it can from c->in, returns <0 to drop the connection */
+int http_process(conn_t* c);
+
+/* ws.c */
+int ws_process(conn_t* c);
+int ws_send(conn_t* c, int op, const void* data, size_t len);
+int ws_send_audio(conn_t* c, const uint8_t* frame, int len, uint32_t ts);
+
+/* mqtt.c */
+int mqtt_process(conn_t* c);
+int mqtt_publish(conn_t* c, const char* topic, const void* data, size_t len);
+
+/* session.c */
+int session_load_opus(const char* path);
+void session_on_json(conn_t* c, const char* json, size_t len);
+void session_on_audio(session_t* s, const uint8_t* frame, int len);
+int session_send_json(session_t* s, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void session_close(session_t* s);
+int64_t session_poll(session_t* s, int64_t now); // runs due work, returns us till the next, -1 if nothing is due
+int udp_open(int port);
+void udp_process(int fd);
@@ -0,0 +1,299 @@
+#include "server.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/rand.h>
+
+#define MAX_FRAME 4096
+
+typedef struct {
+    uint16_t len;
+    uint8_t data[];
+} opus_frame_t;
+
+static opus_frame_t** s_frames; // canned tts, NULL = silence made for the session's frame duration
+static int s_nframes;
+static int s_udp_fd = -1;
+static uint32_t s_next_tag;
+static uint32_t s_next_id;
+
+int session_load_opus(const char* path) {
+    if(!path) return 0;
+    FILE* fp = fopen(path, "rb");
+    if(!fp) {
+        LOG("open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    uint8_t lb[2];
+    while(fread(lb, 2, 1, fp) == 1) {
+        int len = (lb[0] << 8) | lb[1];
+        opus_frame_t* f = malloc(sizeof(opus_frame_t) + len);
+        opus_frame_t** tmp = realloc(s_frames, (s_nframes + 1) * sizeof(*s_frames));
+        if(!f || !tmp || len > MAX_FRAME || (len && fread(f->data, len, 1, fp) != 1)) {
+            LOG("bad opus file %s at frame %d", path, s_nframes);
+            fclose(fp);
+            return -1;
+        }
+        f->len = len;
+        s_frames = tmp;
+        s_frames[s_nframes++] = f;
+    }
+    fclose(fp);
+    LOG("%d canned frames from %s", s_nframes, path);
+    return s_nframes? 0: -1;
+}
+
+// celt silence, code 3 packet of 10 or 20 ms frames
+static int silence_frame(int frame_ms, uint8_t* out) {
+    int fms = frame_ms % 20? 10: 20;
+    int count = frame_ms / fms;
+    if(count < 1) count = 1;
+    if(count > 12) count = 12;
+    int n = 0;
+    out[n++] = ((fms == 10? 30: 31) << 3) | 3;
+    out[n++] = count; // cbr, no padding
+    for(int i=0; i<count; i++) {
+        out[n++] = 0xff;
+        out[n++] = 0xfe;
+    }
+    return n;
+}
+
+// value of the first "key" in the text, strings without quotes. flat lookup, good for what the device sends
+static int json_get(const char* js, size_t len, const char* key, char* out, int size) {
+    char pat[40];
+    int pl = snprintf(pat, sizeof(pat), "\"%s\"", key);
+    const char* end = js + len;
+    const char* p = memmem(js, len, pat, pl);
+    if(!p) return -1;
+    p += pl;
+    while(p < end && (*p == ' ' || *p == ':')) p++;
+    int n = 0;
+    if(p < end && *p == '"') {
+        for(p++; p < end && *p != '"' && n < size - 1; p++) {
+            if(*p == '\\' && p + 1 < end) p++;
+            out[n++] = *p;
+        }
+    } else {
+        for(; p < end && *p != ',' && *p != '}' && *p != ' ' && n < size - 1; p++) out[n++] = *p;
+    }
+    out[n] = 0;
+    return n;
+}
+
+int session_send_json(session_t* s, const char* fmt, ...) {
+    char buf[1024];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if(n >= (int)sizeof(buf)) return -1;
+    LOGV("-> %s: %s", s->conn->client_id, buf);
+    if(s->conn->type == CONN_WS) return ws_send(s->conn, 0x1, buf, n);
+    char topic[96];
+    snprintf(topic, sizeof(topic), "devices/p2p/%s", s->conn->client_id);
+    return mqtt_publish(s->conn, topic, buf, n);
+}
+
+void session_close(session_t* s) {
+    if(s->aes) EVP_CIPHER_CTX_free(s->aes);
+    conn_t* c = s->conn;
+    memset(s, 0, sizeof(*s));
+    s->conn = c;
+}
+
+static void hex(const uint8_t* in, int n, char* out) {
+    for(int i=0; i<n; i++) sprintf(out + 2*i, "%02x", in[i]);
+}
+
+static void on_hello(conn_t* c, const char* json, size_t len) {
+    session_t* s = &c->sess;
+    char v[32];
+    session_close(s);
+    s->frame_ms = json_get(json, len, "frame_duration", v, sizeof(v)) > 0? atoi(v): 60;
+    if(s->frame_ms <= 0 || s->frame_ms > 120) s->frame_ms = 60;
+    snprintf(s->id, sizeof(s->id), "local-%08x", ++ s_next_id);
+    s->state = SESS_OPEN;
+    if(c->type == CONN_WS) {
+        session_send_json(s, "{\"type\":\"hello\",\"transport\":\"websocket\",\"session_id\":\"%s\","
+            "\"audio_params\":{\"format\":\"opus\",\"sample_rate\":16000,\"channels\":1,\"frame_duration\":%d}}", s->id, s->frame_ms);
+        return;
+    }
+    RAND_bytes(s->key, sizeof(s->key));
+    RAND_bytes(s->nonce, sizeof(s->nonce));
+    memset(s->nonce, 0, 4);
+    memset(s->nonce + 8, 0, 8); // size, timestamp and sequence are filled per packet
+    s->nonce[0] = 0x01;
+    s->tag = ++ s_next_tag;
+    memcpy(s->nonce + 4, &s->tag, 4);
+    s->aes = EVP_CIPHER_CTX_new();
+    if(!s->aes || !EVP_EncryptInit_ex(s->aes, EVP_aes_128_ctr(), NULL, s->key, NULL)) {
+        LOG("aes init failed");
+        session_close(s);
+        return;
+    }
+    char key[33], nonce[33];
+    hex(s->key, 16, key);
+    hex(s->nonce, 16, nonce);
+    session_send_json(s, "{\"type\":\"hello\",\"version\":3,\"transport\":\"udp\",\"session_id\":\"%s\","
+        "\"udp\":{\"server\":\"%s\",\"port\":%d,\"key\":\"%s\",\"nonce\":\"%s\"},"
+        "\"audio_params\":{\"format\":\"opus\",\"sample_rate\":16000,\"channels\":1,\"frame_duration\":%d}}",
+        s->id, g_conf.host, g_conf.udp_port, key, nonce, s->frame_ms);
+}
+
+static void start_reply(session_t* s, const char* text) {
+    session_send_json(s, "{\"type\":\"tts\",\"state\":\"start\",\"session_id\":\"%s\"}", s->id);
+    session_send_json(s, "{\"type\":\"tts\",\"state\":\"sentence_start\",\"text\":\"%s\",\"session_id\":\"%s\"}", text, s->id);
+    s->tts_left = g_conf.tts_frames;
+    s->next_frame_us = now_us();
+}
+
+static void stop_reply(session_t* s) {
+    s->tts_left = 0;
+    session_send_json(s, "{\"type\":\"tts\",\"state\":\"stop\",\"session_id\":\"%s\"}", s->id);
+    if(g_conf.turns && ++ s->turns >= (uint32_t)g_conf.turns) {
+        session_send_json(s, "{\"type\":\"goodbye\",\"session_id\":\"%s\"}", s->id);
+        session_close(s);
+    }
+}
+
+static void end_of_speech(session_t* s) {
+    s->listening = false;
+    LOG("%s: turn %u, heard %lld ms, %u frames %u bytes", s->id, s->turns + 1, (long long)s->heard_ms, s->rx_frames, s->rx_bytes);
+    session_send_json(s, "{\"type\":\"stt\",\"text\":\"heard %lld ms\",\"session_id\":\"%s\"}", (long long)s->heard_ms, s->id);
+    session_send_json(s, "{\"type\":\"llm\",\"emotion\":\"neutral\",\"text\":\"\",\"session_id\":\"%s\"}", s->id);
+    start_reply(s, "local reply");
+}
+
+void session_on_json(conn_t* c, const char* json, size_t len) {
+    session_t* s = &c->sess;
+    char type[16], state[16], mode[16];
+    LOGV("<- %s: %.*s", c->client_id, (int)len, json);
+    if(json_get(json, len, "type", type, sizeof(type)) <= 0) return;
+    if(0 == strcmp(type, "hello")) {
+        on_hello(c, json, len);
+        return;
+    }
+    if(s->state != SESS_OPEN) return;
+    if(0 == strcmp(type, "listen")) {
+        json_get(json, len, "state", state, sizeof(state));
+        if(0 == strcmp(state, "start")) {
+            s->listening = true;
+            s->manual = json_get(json, len, "mode", mode, sizeof(mode)) > 0 && 0 == strcmp(mode, "manual");
+            s->heard_ms = 0;
+            s->rx_frames = s->rx_bytes = 0;
+        } else if(0 == strcmp(state, "stop")) {
+            if(s->listening) end_of_speech(s);
+        } else if(0 == strcmp(state, "detect")) {
+            start_reply(s, "wake word");
+        }
+    } else if(0 == strcmp(type, "abort")) {
+        if(s->tts_left) stop_reply(s);
+    } else if(0 == strcmp(type, "goodbye")) {
+        LOG("%s: goodbye from device", s->id);
+        session_close(s);
+    }
+}
+
+void session_on_audio(session_t* s, const uint8_t* frame, int len) {
+    if(s->state != SESS_OPEN || !s->listening) return;
+    s->rx_frames++;
+    s->rx_bytes += len;
+    s->heard_ms += s->frame_ms;
+    if(!s->manual && s->heard_ms >= g_conf.utterance_ms) end_of_speech(s);
+}
+
+static int udp_send_audio(session_t* s, const uint8_t* frame, int len, uint32_t ts) {
+    uint8_t pck[16 + MAX_FRAME], iv[16];
+    int outl = 0;
+    memcpy(pck, s->nonce, 16);
+    *(uint16_t*)&pck[2] = htons(len);
+    *(uint32_t*)&pck[8] = htonl(ts);
+    *(uint32_t*)&pck[12] = htonl(++ s->tx_seq);
+    memcpy(iv, pck, 16);
+    if(!EVP_EncryptInit_ex(s->aes, NULL, NULL, NULL, iv) || !EVP_EncryptUpdate(s->aes, pck + 16, &outl, frame, len)) return -1;
+    return sendto(s_udp_fd, pck, 16 + len, 0, (struct sockaddr*)&s->peer, s->peer_len) < 0? -1: 0;
+}
+
+int64_t session_poll(session_t* s, int64_t now) {
+    if(s->state != SESS_OPEN || s->tts_left == 0) return -1;
+    if(s->conn->type == CONN_MQTT && s->peer_len == 0) {
+        s->next_frame_us = now + 10000; // the device's first uplink packet tells where to send
+        return 10000;
+    }
+    int64_t frame_us = s->frame_ms * 1000;
+    if(now - s->next_frame_us > 1000000) s->next_frame_us = now; // too far behind, don't burst
+    while(s->tts_left && s->next_frame_us <= now) {
+        uint8_t buf[32];
+        const uint8_t* f = buf;
+        int len;
+        if(s_nframes) {
+            opus_frame_t* of = s_frames[(g_conf.tts_frames - s->tts_left) % s_nframes];
+            f = of->data;
+            len = of->len;
+        } else {
+            len = silence_frame(s->frame_ms, buf);
+        }
+        int err = s->conn->type == CONN_WS? ws_send_audio(s->conn, f, len, s->tts_ts): udp_send_audio(s, f, len, s->tts_ts);
+        if(err) LOGV("%s: send audio failed", s->id);
+        s->tts_ts += s->frame_ms;
+        s->next_frame_us += frame_us;
+        if(-- s->tts_left == 0) {
+            stop_reply(s);
+            return -1;
+        }
+    }
+    return s->next_frame_us - now;
+}
+
+int udp_open(int port) {
+    int fd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if(fd < 0) return -1;
+    int zero = 0;
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons(port), .sin6_addr = in6addr_any };
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    s_udp_fd = fd;
+    return fd;
+}
+
+void udp_process(int fd) {
+    uint8_t pck[16 + MAX_FRAME], iv[16];
+    struct sockaddr_storage from;
+    for(;;) {
+        socklen_t from_len = sizeof(from);
+        ssize_t n = recvfrom(fd, pck, sizeof(pck), 0, (struct sockaddr*)&from, &from_len);
+        if(n < 0) return;
+        if(n < 16 || pck[0] != 0x01) continue;
+        uint32_t tag;
+        memcpy(&tag, pck + 4, 4);
+        session_t* s = NULL;
+        for(conn_t* c = conn_first(); c; c = c->next) {
+            if(c->type == CONN_MQTT && c->sess.state == SESS_OPEN && c->sess.tag == tag) {
+                s = &c->sess;
+                break;
+            }
+        }
+        if(!s) {
+            LOGV("udp packet of unknown session %08x", tag);
+            continue;
+        }
+        if(s->peer_len != from_len || memcmp(&s->peer, &from, from_len)) {
+            memcpy(&s->peer, &from, from_len);
+            s->peer_len = from_len;
+        }
+        int outl = 0;
+        memcpy(iv, pck, 16);
+        if(!EVP_EncryptInit_ex(s->aes, NULL, NULL, NULL, iv) || !EVP_EncryptUpdate(s->aes, pck + 16, &outl, pck + 16, n - 16)) continue;
+        session_on_audio(s, pck + 16, n - 16);
+    }
+}
@@ -0,0 +1,119 @@
+#include "server.h"
+#include <string.h>
+#include <arpa/inet.h>
+
+int ws_send(conn_t* c, int op, const void* data, size_t len) {
+    uint8_t h[10];
+    int hl = 2;
+    h[0] = 0x80 | op; // fin, server frames aren't masked
+    if(len < 126) {
+        h[1] = len;
+    } else if(len < 65536) {
+        h[1] = 126;
+        h[2] = len >> 8;
+        h[3] = len;
+        hl = 4;
+    } else {
+        h[1] = 127;
+        for(int i=0; i<8; i++) h[2+i] = (uint64_t)len >> (56 - 8*i);
+        hl = 10;
+    }
+    return conn_write(c, h, hl) || conn_write(c, data, len)? -1: 0;
+}
+
+// framed as the device's binary protocol version
+int ws_send_audio(conn_t* c, const uint8_t* frame, int len, uint32_t ts) {
+    uint8_t buf[16 + 4096];
+    int hl = 0;
+    if(len > 4096) return -1;
+    if(c->ws_version == 2) {
+        *(uint16_t*)&buf[0] = htons(2);
+        *(uint16_t*)&buf[2] = 0;        // opus
+        *(uint32_t*)&buf[4] = 0;
+        *(uint32_t*)&buf[8] = htonl(ts);
+        *(uint32_t*)&buf[12] = htonl(len);
+        hl = 16;
+    } else if(c->ws_version == 3) {
+        buf[0] = 0;
+        buf[1] = 0;
+        *(uint16_t*)&buf[2] = htons(len);
+        hl = 4;
+    }
+    memcpy(buf + hl, frame, len);
+    return ws_send(c, 0x2, buf, hl + len);
+}
+
+static void on_binary(conn_t* c, uint8_t* data, size_t len) {
+    switch(c->ws_version) {
+    case 2:
+        if(len < 16 || 16 + ntohl(*(uint32_t*)&data[12]) > len) return;
+        session_on_audio(&c->sess, data + 16, ntohl(*(uint32_t*)&data[12]));
+        break;
+    case 3:
+        if(len < 4 || 4 + ntohs(*(uint16_t*)&data[2]) > len) return;
+        session_on_audio(&c->sess, data + 4, ntohs(*(uint16_t*)&data[2]));
+        break;
+    default:
+        session_on_audio(&c->sess, data, len);
+    }
+}
+
+/*
+ device frames are masked and may be fragmented. payloads of fragments are moved together
+ at the front of the buffer (ws_msg_len bytes) till the final one.
+*/
+int ws_process(conn_t* c) {
+    for(;;) {
+        uint8_t* p = c->in + c->ws_msg_len;
+        size_t avail = c->in_len - c->ws_msg_len;
+        if(avail < 2) break;
+        int op = p[0] & 0x0f;
+        bool fin = p[0] & 0x80;
+        bool masked = p[1] & 0x80;
+        uint64_t len = p[1] & 0x7f;
+        size_t hl = 2;
+        if(len == 126) {
+            if(avail < 4) break;
+            len = (p[2] << 8) | p[3];
+            hl = 4;
+        } else if(len == 127) {
+            if(avail < 10) break;
+            len = 0;
+            for(int i=0; i<8; i++) len = (len << 8) | p[2+i];
+            hl = 10;
+        }
+        if(len > (1 << 20)) return -1;
+        uint8_t mask[4] = {0};
+        if(masked) {
+            if(avail < hl + 4) break;
+            memcpy(mask, p + hl, 4);
+            hl += 4;
+        }
+        if(avail < hl + len) break;
+        uint8_t* payload = p + hl;
+        for(uint64_t i=0; i<len; i++) payload[i] ^= mask[i & 3];
+
+        if(op >= 0x8) { // control frames may come between fragments
+            if(op == 0x8) {
+                ws_send(c, 0x8, payload, len < 2? len: 2);
+                c->closing = true;
+                return 0;
+            }
+            if(op == 0x9) ws_send(c, 0xa, payload, len);
+            memmove(p, p + hl + len, avail - hl - len);
+            c->in_len -= hl + len;
+            continue;
+        }
+        if(op) c->ws_msg_op = op;
+        memmove(p, payload, avail - hl); // the payload joins the message
+        c->in_len -= hl;
+        c->ws_msg_len += len;
+        if(!fin) continue;
+        if(c->ws_msg_op == 0x1) session_on_json(c, (char*)c->in, c->ws_msg_len);
+        else if(c->ws_msg_op == 0x2) on_binary(c, c->in, c->ws_msg_len);
+        memmove(c->in, c->in + c->ws_msg_len, c->in_len - c->ws_msg_len);
+        c->in_len -= c->ws_msg_len;
+        c->ws_msg_len = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "xz_alloc.h"
+
+/* a may be NULL for plain malloc */
+void* xz_buf_alloc(const xz_chat_allocator_t* a, xz_buf_class_t cls, size_t size);
+void* xz_buf_realloc(const xz_chat_allocator_t* a, xz_buf_class_t cls, void* ptr, size_t size);
+void xz_buf_free(const xz_chat_allocator_t* a, void* ptr);
+
+#define XZ_BUF_RELEASE(a, p) do{ xz_buf_free(a, p); (p) = NULL; }while(0)
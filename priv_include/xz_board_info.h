@@ -8,6 +8,9 @@
 #endif
 #define XZ_BOARD_NAME XZ_BOARD_TYPE
 
+#define XZ_NVS_PART_NAME CONFIG_XZ_NVS_PART_NAME_TO_SAVE_BOARD_INFO
+#define XZ_NVS_NS "xz"
+
 // FAKE
 #define XZ_VER "1.7.6"
 // #define XZ_COMPILE_DATE "May  4 2025"
@@ -15,9 +18,8 @@
 // #define XZ_IDF_VER "v5.4-dev-5041-gd4aa25a38e-dirty"
 // #define XZ_ELF_SHA256 "90e74f2becc2342b93026b6c8c85f487b3355911857d3e788a0521ca3421b7a3"
 
-void xz_board_info_init();
-
+/* default identity of the device, instances may carry their own (xz_chat_config_t.device_id / client_id) */
 const char* xz_board_info_mac();
 const char* xz_board_info_uuid();
 
-size_t xz_board_info_printf(char* buf, size_t len, const char* lang);
\ No newline at end of file
+size_t xz_board_info_printf(char* buf, size_t len, const char* lang, const char* mac, const char* uuid);
\ No newline at end of file
@@ -1,6 +1,14 @@
 #pragma once
 #include "xz_chat.h"
 #include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "xz_trace.h"
+#include "xz_pool.h"
+#include "esp_log.h"
 
 #define XZ_EG_SERVER_HELLO_BIT (1<<0)
 #define XZ_EG_PROT_CONN_BIT (1<<1)
@@ -11,6 +19,10 @@
 // #define XZ_EG_UDP_TASK_RESUMED_BIT (1<<6)
 #define XZ_EG_READ_AUDIO_TASK_STOPPED_BIT (1<<8)
 #define XZ_EG_READ_AUDIO_TASK_RUN_BIT (1<<9)
+#define XZ_EG_SEND_AUDIO_TASK_STOPPED_BIT (1<<10)
+#define XZ_EG_HTTP_TASK_STOPPED_BIT (1<<11)
+#define XZ_EG_MAIN_TASK_STOPPED_BIT (1<<12) // reactor mode only
+#define XZ_EG_TX_IDLE_BIT (1<<13) // cleared while an uplink frame is in prot_if.send_data
 
 typedef enum {
     XZ_LISTENING_MODE_AUTO_STOP,
@@ -18,6 +30,12 @@ typedef enum {
     XZ_LISTENING_MODE_REALTIME,
 } xz_chat_listening_mode_t;
 
+typedef enum {
+    XZ_CMD_LANE_NORMAL, // internal: network messages, http results
+    XZ_CMD_LANE_HI,   // every command from the public api, so they keep their call order. served before anything in the normal lane
+    XZ_CMD_LANES,
+} xz_cmd_lane_t;
+
 struct _xz_chat_t {
     XZ_CHAT_CONFIG_STRUCT; // this must be the first memeber in struct.
 
@@ -30,16 +48,57 @@ struct _xz_chat_t {
     
     EventGroupHandle_t eg;
     TaskHandle_t main_task;
+    int wake_fd;       // reactor mode: eventfd the main task selects on with the udp socket, written on every posted command
+    bool reactor_exit; // set by the last command the reactor runs
+    TaskHandle_t http_task;
+    _Atomic uint32_t http_req;                          // checks waiting for the http task
+    _Atomic(esp_http_client_handle_t) http_user_client; // client given with the last request, used once
+    esp_http_client_handle_t http;                      // own client, kept alive between activation polls
+    int64_t next_activation_poll;                       // esp_timer us
+    int activation_backoff_ms;
+    _Atomic int activation_pace_ms;                     // server's poll interval, copied by the main task from its version check response
     TaskHandle_t read_audio_task;
+    TaskHandle_t send_audio_task;
 
     xz_prot_if_t prot_if;
     void* prot_ctx;
 
     QueueHandle_t cmd_q;
+    QueueHandle_t cmd_hi_q;
+    SemaphoreHandle_t cmd_sem;               // one count per queued command in either lane
+    _Atomic uintptr_t cmd_tail[XZ_CMD_LANES]; // fn of the last command posted to a lane and not run yet
+    QueueHandle_t send_audio_q;
+    _Atomic int send_audio_q_hwm;
+    _Atomic uint32_t send_audio_q_dropped;
+    _Atomic uint32_t audio_lost_frames;
+    struct {                    // see xz_chat_stats_t, bumped with relaxed atomics from the hot paths
+        _Atomic uint32_t tx_frames, tx_bytes, tx_errors;
+        _Atomic uint32_t rx_frames, rx_bytes, rx_msgs, rx_oversize, rx_bad_packets, rx_lost_frames, rx_late_frames;
+        _Atomic uint32_t cmd_q_high_water, cmd_q_full;
+        _Atomic uint32_t audio_cb_calls, audio_cb_max_us, audio_cb_total_us;
+        _Atomic uint32_t alloc_overflow;
+    } stats;
+    _Atomic uint32_t lat_ms[XZ_LAT_MARKS]; // timeline of the current turn
+    _Atomic uint32_t lat_request_ms;       // request posted, moved into the timeline when the main task takes it
+    uint32_t lat_turns;
+    xz_lat_stats_t lat_stats;
+    portMUX_TYPE lat_lock;                 // lat_stats, written by the main task, read by anyone
+    TimerHandle_t drain_timer;  // fallback for a playback drain the app doesn't report
+    int drain_listening_mode;   // what to do once drained, XZ_DRAIN_NO_LISTENING to stay idle
+    _Atomic bool playback_idle; // app reported drained and no audio was delivered since
     char* send_buf;
     xz_chat_event_data_t event_data;
+    xz_json_idx_t json_idx; // index of the last received json, built once by the protocol and shared with event_cb
+    _Atomic(xz_trace_t*) trace; // recording if set
+    xz_trace_t* trace_ctx;      // kept from the first xz_chat_trace_start till destroy
 
-    char* session_buf;
+    struct {            // CONFIG_XZ_CHAT_STATIC_BUFFERS, reserved by xz_chat_init
+        xz_pool_t resp;     // version check responses, the one in use and a new one, and prot cache scratch
+        xz_pool_t prot_conf;
+        xz_pool_t session;  // one block, session_buf
+        xz_pool_t mcp;
+    } pools;
+    char* session_buf;  // copy of the server hello the session strings point into, NULL outside a session
     char* session_id;
     int server_sample_rate;
     int server_frame_duration;
@@ -57,6 +116,7 @@ struct _xz_chat_t {
 #define XZ_FLAG_SESS_LEAVING (1<<8)
 #define XZ_FLAG_SESS_LISTENING (1<<9)
 #define XZ_FLAG_SESS_SPEAKING (1<<10)
+#define XZ_FLAG_PLAYBACK_DRAINING (1<<11) // switch to listening deferred till playback drains
 
 #define XZ_FLAGS_IN_SESS (XZ_FLAG_SESS_LEAVING|XZ_FLAG_SESS_LISTENING|XZ_FLAG_SESS_SPEAKING)
 
@@ -73,6 +133,104 @@ static inline bool chat_has_every_flag(xz_chat_t* chat, int bit) {
     return (atomic_load(&chat->flags) & bit) == bit;
 }
 
+#define CHAT_STAT_ADD(chat, field, n) atomic_fetch_add_explicit(&(chat)->stats.field, (n), memory_order_relaxed)
+
+static inline void chat_stat_max(_Atomic uint32_t* stat, uint32_t v) {
+    uint32_t cur = atomic_load_explicit(stat, memory_order_relaxed);
+    while(v > cur && !atomic_compare_exchange_weak_explicit(stat, &cur, v, memory_order_relaxed, memory_order_relaxed));
+}
+
+// called by protocols before handing the next downlink frame to audio_cb
+static inline void chat_report_audio_loss(xz_chat_t* chat, int lost_frames) {
+    if(lost_frames <= 0) return;
+    atomic_fetch_add(&chat->audio_lost_frames, lost_frames);
+    CHAT_STAT_ADD(chat, rx_lost_frames, lost_frames);
+    if(chat_has_any_flag(chat, XZ_FLAG_SESS_SPEAKING) && chat->audio_loss_cb)
+        chat->audio_loss_cb(lost_frames, chat);
+}
+
+static inline uint32_t chat_lat_now() {
+    return (uint32_t)(esp_timer_get_time() / 1000) | 1; // 0 means not stamped
+}
+
+// stamp a point of the current turn, the first one counts
+static inline void chat_lat_mark(xz_chat_t* chat, xz_lat_mark_t m) {
+    if(atomic_load_explicit(&chat->lat_ms[m], memory_order_relaxed)) return;
+    atomic_store_explicit(&chat->lat_ms[m], chat_lat_now(), memory_order_relaxed);
+}
+
+// called by protocols with every downlink audio frame
+static inline void chat_deliver_audio(xz_chat_t* chat, uint8_t* data, int len) {
+    CHAT_STAT_ADD(chat, rx_frames, 1);
+    CHAT_STAT_ADD(chat, rx_bytes, len);
+    if(chat_has_any_flag(chat, XZ_FLAG_SESS_SPEAKING) && chat->audio_cb) {
+        chat_lat_mark(chat, XZ_LAT_FIRST_DOWNLINK);
+        atomic_store(&chat->playback_idle, false);
+        int64_t t0 = esp_timer_get_time();
+        chat->audio_cb(data, len, chat);
+        uint32_t us = esp_timer_get_time() - t0;
+        CHAT_STAT_ADD(chat, audio_cb_calls, 1);
+        CHAT_STAT_ADD(chat, audio_cb_total_us, us);
+        chat_stat_max(&chat->stats.audio_cb_max_us, us);
+    }
+}
+
+/*
+ allocations of the steady state, pool names double as the buffer class tag of chat->allocator.
+ with CONFIG_XZ_CHAT_STATIC_BUFFERS they come from chat->pools, reserved once from that class,
+ a pool that can't serve one logs it and counts alloc_overflow, the caller sees NULL as from malloc.
+*/
+#define XZ_POOL_CLASS_resp XZ_BUF_TRANSIENT
+#define XZ_POOL_CLASS_prot_conf XZ_BUF_CONTROL
+#define XZ_POOL_CLASS_session XZ_BUF_CONTROL
+#define XZ_POOL_CLASS_mcp XZ_BUF_CONTROL
+#ifdef CONFIG_XZ_CHAT_STATIC_BUFFERS
+static inline void* chat_pool_alloc(xz_chat_t* chat, xz_pool_t* pool, size_t size, const char* name) {
+    void* p = xz_pool_alloc(pool, size);
+    if(!p) {
+        CHAT_STAT_ADD(chat, alloc_overflow, 1);
+        ESP_LOGE("xz_chat", "%s pool can't serve %u bytes", name, (unsigned)size);
+    }
+    return p;
+}
+#define CHAT_ALLOC(chat, pool, size) chat_pool_alloc(chat, &(chat)->pools.pool, size, #pool)
+#define CHAT_FREE(chat, pool, p) do{ xz_pool_free(&(chat)->pools.pool, p); (p) = NULL; }while(0)
+#define CHAT_POOL_INIT(chat, pool, blocks, size) xz_pool_init(&(chat)->pools.pool, blocks, size, &(chat)->allocator, XZ_POOL_CLASS_##pool)
+#else
+#define CHAT_ALLOC(chat, pool, size) xz_buf_alloc(&(chat)->allocator, XZ_POOL_CLASS_##pool, size)
+#define CHAT_FREE(chat, pool, p) XZ_BUF_RELEASE(&(chat)->allocator, p)
+#endif
+
+static inline char* chat_session_buf_set(xz_chat_t* chat, const char* data, int len) {
+    CHAT_FREE(chat, session, chat->session_buf);
+    if((chat->session_buf = CHAT_ALLOC(chat, session, len + 1))) {
+        memcpy(chat->session_buf, data, len);
+        chat->session_buf[len] = 0;
+    }
+    return chat->session_buf;
+}
+static inline void chat_session_buf_release(xz_chat_t* chat) {
+    CHAT_FREE(chat, session, chat->session_buf);
+}
+
+// for an uplink frame that can't be built in the caller's buffer, NULL if need doesn't fit. XZ_BUF_AUDIO_TX
+static inline void* chat_tx_buf(xz_chat_t* chat, void** buf, int* size, int need) {
+    if(*size >= need) return *buf;
+#ifdef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    CHAT_STAT_ADD(chat, alloc_overflow, 1);
+    ESP_LOGE("xz_chat", "uplink frame of %d bytes over the reserved %d", need, *size);
+    return NULL;
+#else
+    void* tmp = xz_buf_realloc(&chat->allocator, XZ_BUF_AUDIO_TX, *buf, need);
+    if(!tmp) return NULL;
+    *buf = tmp;
+    *size = need;
+    return tmp;
+#endif
+}
+
+#define XZ_DRAIN_NO_LISTENING (-1)
+
 typedef esp_err_t (*_cmd_el_fn_t)(void* a,void* b,void* c);
 typedef struct {
     _cmd_el_fn_t fn;
@@ -83,4 +241,20 @@ typedef struct {
 
 
 
-#define CMD(chat, fn, ...) do{cmd_q_el_t el={(_cmd_el_fn_t)fn, __VA_ARGS__ };xQueueSend(chat->cmd_q, &el, portMAX_DELAY);}while(0)
\ No newline at end of file
+/*
+ uplink path below read_audio_cb, also driven by the host bench:
+ chat_tx_audio queues a frame for chat_send_audio_loop (the send task), or sends it right away without send_audio_q.
+ frames are released once sent or dropped.
+*/
+void chat_tx_audio(xz_chat_t* chat, xz_tx_audio_pck_t* audio);
+void chat_send_audio_loop(void* arg);
+
+/*
+ coalesce: dropped if the last command posted to the lane is the same fn and hasn't run yet.
+ only commands taking nothing but the chat are merged, the args aren't compared.
+ safe from ISRs, wait is ignored there.
+*/
+esp_err_t chat_post_cmd(xz_chat_t* chat, xz_cmd_lane_t lane, const cmd_q_el_t* el, bool coalesce, TickType_t wait);
+
+#define CMD_EX(chat, lane, coalesce, fn, ...) do{cmd_q_el_t el={(_cmd_el_fn_t)fn, __VA_ARGS__ };chat_post_cmd(chat, lane, &el, coalesce, portMAX_DELAY);}while(0)
+#define CMD(chat, fn, ...) CMD_EX(chat, XZ_CMD_LANE_NORMAL, false, fn, __VA_ARGS__)
\ No newline at end of file
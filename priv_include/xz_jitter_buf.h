@@ -0,0 +1,49 @@
+#pragma once
+#include "esp_err.h"
+#include "xz_protocol.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "xz_alloc_priv.h"
+
+/*
+ reorder buffer for downlink udp audio, keyed on the packet sequence number.
+ frames are copied in by put() as they arrive, and taken out by pop() once per
+ frame duration. sequence numbers are compared by signed distance, so wraparound
+ of the 32bit counter is handled, slots are a ring indexed from next_seq so any window works.
+ slots are XZ_BUF_AUDIO_RX memory.
+*/
+
+typedef struct {
+    uint8_t* data;      // window * frame_size
+    int* lens;          // -1 for an empty slot
+    int slots;
+    int frame_size;
+    int depth;
+    int count;          // frames currently held
+    int head;           // slot of next_seq
+    int skipped;        // given up by put() for being too far behind, reported by the next pop()
+    uint32_t next_seq;  // sequence to be released next
+    uint32_t last_seq;  // highest sequence seen
+    bool started;       // next_seq is valid
+    bool released;      // a frame was popped, next_seq can't move back anymore
+    bool primed;        // depth was reached, playout is running
+    const xz_chat_allocator_t* alloc;
+} xz_jitter_buf_t;
+
+esp_err_t xz_jitter_buf_init(xz_jitter_buf_t* jb, const xz_jitter_buf_config_t* conf, const xz_chat_allocator_t* alloc);
+void xz_jitter_buf_deinit(xz_jitter_buf_t* jb);
+void xz_jitter_buf_reset(xz_jitter_buf_t* jb);
+
+/*
+ ESP_ERR_INVALID_STATE if the frame is late or a duplicate,
+ ESP_ERR_INVALID_SIZE if it is larger than frame_size.
+ if the frame is more than window ahead, the oldest frames are given up to make room.
+*/
+esp_err_t xz_jitter_buf_put(xz_jitter_buf_t* jb, uint32_t seq, const uint8_t* data, int len);
+
+/*
+ returns length of the next frame and points *data to it, the frame stays valid till the next put().
+ returns 0 if nothing is ready (still buffering or underrun).
+ *lost is set to the number of frames skipped because they never arrived or were given up by put().
+*/
+int xz_jitter_buf_pop(xz_jitter_buf_t* jb, uint8_t** data, int* lost);
@@ -0,0 +1,30 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "xz_alloc_priv.h"
+
+/*
+ fixed number of equal blocks carved from one allocation made at init.
+ alloc / free are lock free and safe from any task, a block is taken with a cas on the used bitmap.
+*/
+
+#define XZ_POOL_MAX_BLOCKS 32
+
+typedef struct {
+    uint8_t* mem;
+    const xz_chat_allocator_t* alloc; // mem came from it
+    size_t block_size;
+    int blocks;
+    _Atomic uint32_t used; // bit per block
+} xz_pool_t;
+
+esp_err_t xz_pool_init(xz_pool_t* p, int blocks, size_t block_size, const xz_chat_allocator_t* alloc, xz_buf_class_t cls);
+void xz_pool_deinit(xz_pool_t* p);
+
+/* NULL if size is over block_size or every block is taken */
+void* xz_pool_alloc(xz_pool_t* p, size_t size);
+
+/* ptr may be NULL */
+void xz_pool_free(xz_pool_t* p, void* ptr);
@@ -0,0 +1,21 @@
+#pragma once
+#include "xz_http_client_request.h"
+
+/*
+ protocol section of the last good version check response (mqtt endpoint/credentials
+ or websocket url/token), kept in nvs so the next boot can connect without the ota round trip.
+ a cache is only valid for the protocol preference it was saved with.
+*/
+
+#define XZ_PROT_CACHE_MAX_SIZE 1024
+#define XZ_PROT_CACHE_SCRATCH_SIZE (2*XZ_PROT_CACHE_MAX_SIZE) // save and matches work in caller's scratch
+
+esp_err_t xz_prot_cache_save(const xz_http_client_response_t* resp, xz_prot_type_t prot_pref, void* scratch);
+
+/* fills resp (require_activation false), buf_size is the room after it. ESP_ERR_NOT_FOUND if nothing usable is cached */
+esp_err_t xz_prot_cache_load(xz_prot_type_t prot_pref, xz_http_client_response_t* resp, size_t buf_size);
+
+/* true if resp carries the same protocol section as the cache */
+bool xz_prot_cache_matches(const xz_http_client_response_t* resp, xz_prot_type_t prot_pref, void* scratch);
+
+esp_err_t xz_prot_cache_erase();
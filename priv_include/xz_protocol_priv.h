@@ -1,22 +1,51 @@
 #pragma once
 #include "xz_chat.h"
+#include <stdatomic.h>
 #include "xz_protocol.h"
 #include "xz_http_client_request.h"
 #include <mbedtls/aes.h>
+#include "lwip/sockets.h"
+#include "freertos/timers.h"
 #include "task_util.h"
+#include "xz_jitter_buf.h"
+#include "xz_rx_asm.h"
+#include "xz_trace.h"
 
 typedef esp_err_t (*xz_prot_fn_t)(xz_chat_t* chat);
 typedef esp_err_t (*xz_prot_send_msg_fn_t)(xz_chat_t* chat, const char* msg, int len);
-typedef esp_err_t (*xz_prot_send_data_fn_t)(xz_chat_t* chat, const void* data, int len);
+typedef esp_err_t (*xz_prot_send_data_fn_t)(xz_chat_t* chat, xz_tx_audio_pck_t* audio);
+typedef int (*xz_prot_io_fd_fn_t)(xz_chat_t* chat);
+typedef int64_t (*xz_prot_io_fn_t)(xz_chat_t* chat, bool readable);
 
 
 typedef struct {
     xz_prot_fn_t start, stop, open_audio_chan, close_audio_chan;
     xz_prot_send_msg_fn_t send_msg;
     xz_prot_send_data_fn_t send_data;
+    /*
+     reactor mode, NULL if the protocol has nothing for the main task to watch.
+     io_fd: socket to select on, -1 if none. io: drain it if readable and run due timers,
+     returns us till io wants to run again, 0 if nothing is pending.
+    */
+    xz_prot_io_fd_fn_t io_fd;
+    xz_prot_io_fn_t io;
 } xz_prot_if_t;
 
-void xz_prot_process_json( xz_chat_t* chat, char*  json,  int len,  char*  type,  int tlen);
+typedef enum {
+    XZ_MSG_UNKNOWN,
+    XZ_MSG_HELLO,
+    XZ_MSG_GOODBYE,
+    XZ_MSG_TTS,
+    XZ_MSG_STT,
+    XZ_MSG_LLM,
+    XZ_MSG_MCP,
+    XZ_MSG_SYSTEM,
+    XZ_MSG_IOT,
+    XZ_MSG_ALERT,
+} xz_msg_type_t;
+
+xz_msg_type_t xz_prot_msg_type(const char* type, int tlen);
+void xz_prot_process_json( xz_chat_t* chat, const xz_json_idx_t* idx, xz_msg_type_t mt, char*  type,  int tlen);
 
 
 /* ws */
@@ -26,29 +55,63 @@ typedef struct {
     int version;
     void* send_audio_buf;
     int send_audio_buf_size;
+    uint32_t rx_timestamp; // of the last v2 audio frame, to detect loss
+    bool rx_timestamp_valid;
+    xz_rx_asm_t rx;        // for messages split into several events
+    int rx_op_code;
+    bool persistent;
+    TimerHandle_t idle_timer; // closes a persistent connection left without session
+    const xz_chat_allocator_t* alloc; // of the chat, the buffers hanging off the ctx come from it
 } xz_ws_prot_ctx_t;
 
 
 void xz_ws_prot_config_set_default(xz_ws_prot_config_t* conf);
-void xz_ws_prot_config_fill_rest_from_response(xz_ws_prot_config_t* conf, struct xz_http_client_resp_ws* resp);
+esp_err_t xz_ws_prot_config_fill_rest_from_response(xz_ws_prot_config_t* conf, struct xz_http_client_resp_ws* resp, const char* device_id, const char* client_id);
 esp_err_t xz_ws_prot_init(xz_ws_prot_ctx_t** ctx, xz_ws_prot_config_t* conf, xz_chat_t* chat);
 esp_err_t xz_ws_prot_destroy(xz_ws_prot_ctx_t* ctx);
 
 extern const xz_prot_if_t xz_ws_prot_if;
 
+void xz_ws_prot_replay(xz_chat_t* chat, const xz_trace_rec_t* rec, uint8_t* payload);
+
 /* mqtt */
 
 typedef struct {
     esp_mqtt_client_handle_t mqtt_hd;
     char* pub_topic;
+    xz_rx_asm_t rx;     // for messages larger than the mqtt rx buffer
+    char rx_topic[64];  // topic of the message in rx, chunks carrying another topic don't belong to it
     struct {
         capped_task_config_t task_conf;
-        int sock;
+        int sock;       // kept connected between sessions while the server address stays the same
+        struct sockaddr_storage peer; // address sock is connected to
+        socklen_t peer_len;
         char* server;
         int port;
+        struct {
+            char host[64];
+            int port;
+            struct sockaddr_storage addr;
+            socklen_t addr_len; // 0 if nothing is cached
+            int64_t expiry;     // us
+        } dns;
+        int dns_ttl_ms;
         char* aes_nonce;
         int aes_nonce_len;
-        uint8_t* encrypted_buf;
+        uint8_t nonce[16];
+        uint8_t key[16]; // key aes_ctx is set with, valid if keyed
+        bool keyed;      // aes_ctx encrypts uplink, it's set by the hello handler while nothing is sent
+        /*
+         the receiving task has its own key, taken from rx_key when rx_gen moves on, together with
+         the sequence and jitter buffer reset, so a hello never changes them under a packet being decrypted
+        */
+        portMUX_TYPE rx_lock; // rx_key, rx_gen
+        uint8_t rx_key[16];
+        _Atomic uint32_t rx_gen; // bumped by every hello
+        uint32_t rx_gen_seen;    // receiving task only, like rx_aes_ctx
+        uint8_t rx_keyed[16];    // key rx_aes_ctx is set with, valid once rx_gen_seen isn't 0
+        mbedtls_aes_context rx_aes_ctx;
+        void* encrypted_buf;
         int encrypted_buf_size;
         mbedtls_aes_context aes_ctx;
         uint32_t remote_sequence;
@@ -56,8 +119,10 @@ typedef struct {
         TaskHandle_t task_hd;
         uint8_t* recv_buf;
         int recv_buf_size;
+        xz_jitter_buf_t jb; // unused if jb.slots is 0
+        int64_t jb_next_release;
     } udp;
-
+    const xz_chat_allocator_t* alloc; // of the chat, the buffers hanging off the ctx come from it
 } xz_mqtt_prot_ctx_t;
 
 void xz_mqtt_prot_config_set_default(xz_mqtt_prot_config_t* conf);
@@ -65,4 +130,6 @@ void xz_mqtt_prot_config_fill_rest_from_response(xz_mqtt_prot_config_t* conf, st
 esp_err_t xz_mqtt_prot_init(xz_mqtt_prot_ctx_t** ctx, xz_mqtt_prot_config_t* conf, xz_chat_t* chat);
 esp_err_t xz_mqtt_prot_destroy(xz_mqtt_prot_ctx_t* ctx);
 
-extern const xz_prot_if_t xz_mqtt_prot_if;
\ No newline at end of file
+extern const xz_prot_if_t xz_mqtt_prot_if;
+
+void xz_mqtt_prot_replay(xz_chat_t* chat, const xz_trace_rec_t* rec, uint8_t* payload);
\ No newline at end of file
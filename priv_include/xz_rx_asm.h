@@ -0,0 +1,35 @@
+#pragma once
+#include "esp_err.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include "xz_alloc_priv.h"
+
+/*
+ reassembles a message that arrives in several chunks (websocket fragments,
+ partial mqtt data events). the buffer is kept between messages and only grows
+ to the largest message seen, up to max_size. with CONFIG_XZ_CHAT_STATIC_BUFFERS
+ max_size is reserved by init. the buffer is of class XZ_BUF_CONTROL.
+*/
+typedef struct {
+    uint8_t* buf;
+    int cap;
+    int len;
+    int max_size;   // larger messages are dropped
+    bool active;    // a message is being assembled
+    bool dropping;  // current message is over max_size or out of memory, skip its chunks
+    const xz_chat_allocator_t* alloc;
+} xz_rx_asm_t;
+
+esp_err_t xz_rx_asm_init(xz_rx_asm_t* a, int max_size, const xz_chat_allocator_t* alloc);
+void xz_rx_asm_deinit(xz_rx_asm_t* a);
+
+/* start a new message, total is its size if known in advance, otherwise 0 */
+esp_err_t xz_rx_asm_begin(xz_rx_asm_t* a, int total);
+
+/* add next chunk, ESP_ERR_INVALID_SIZE once the message goes over max_size */
+esp_err_t xz_rx_asm_append(xz_rx_asm_t* a, const void* data, int len);
+
+/* message is done, the assembled bytes stay in buf till the next begin */
+static inline void xz_rx_asm_end(xz_rx_asm_t* a) {
+    a->active = false;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "esp_transport.h"
+#include "esp_tls.h"
+#include "esp_err.h"
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ tls transport on top of esp-tls that resumes sessions.
+ the session of the last handshake with a host:port is kept in ram and offered
+ on the next connect, so reconnects take the abbreviated handshake.
+ the cache is shared by every transport created here (mqtt and websocket).
+ needs CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS.
+*/
+
+typedef struct {
+    /*
+     verification, client certificate, alpn... as the replaced client transport would have them.
+     as with esp-tls, one of crt_bundle_attach / cacert_buf / use_global_ca_store is needed
+     unless CONFIG_ESP_TLS_INSECURE is on. timeout_ms, client_session and keep_alive_cfg are set per connect.
+    */
+    esp_tls_cfg_t tls;
+    tls_keep_alive_cfg_t keep_alive; // used if keep_alive_enable
+    int default_port;
+} xz_tls_transport_config_t;
+
+/* length esp-tls expects for a cert / key given as buf and len the way the mqtt and ws clients take them, 0 len is a nul terminated pem */
+static inline unsigned int xz_tls_pem_len(const char* buf, int len) {
+    return !buf? 0: len? len: strlen(buf) + 1;
+}
+
+esp_transport_handle_t xz_tls_transport_init(const xz_tls_transport_config_t* conf);
+
+/* drop every cached session, e.g. after the server set changed */
+void xz_tls_session_cache_clear();
@@ -0,0 +1,53 @@
+#pragma once
+#include "xz_chat.h"
+#include <stdint.h>
+
+/*
+ session trace: every json message and audio frame crossing the protocol layer,
+ in a binary file (spiffs, sd card or the host fs, anything stdio can open).
+
+ file:   xz_trace_file_hdr_t, then records
+ record: xz_trace_rec_t, then len bytes of payload
+ rx audio is stored after decryption, websocket frames as received (with their binary protocol header).
+*/
+
+#define XZ_TRACE_MAGIC "XZTR"
+#define XZ_TRACE_VERSION 1
+#define XZ_TRACE_REC_MAX_LEN (64*1024) // replay rejects larger records, a json message or audio frame is far below
+
+typedef enum {
+    XZ_TRACE_RX_JSON,
+    XZ_TRACE_TX_JSON,
+    XZ_TRACE_RX_AUDIO,  // mqtt: decrypted udp payload, seq/ts from the packet. ws: binary frame, arg is the opcode
+    XZ_TRACE_TX_AUDIO,  // opus frame before framing / encryption, seq counts frames
+} xz_trace_kind_t;
+
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t prot_type;  // xz_prot_type_t
+    uint8_t ws_version; // websocket binary protocol version
+    uint8_t reserved;
+} xz_trace_file_hdr_t;
+
+typedef struct {
+    int64_t t_us;   // esp_timer
+    uint32_t seq;
+    uint32_t ts;
+    uint32_t len;
+    uint8_t kind;   // xz_trace_kind_t
+    uint8_t arg;
+    uint16_t reserved;
+} xz_trace_rec_t;
+
+struct xz_trace;
+typedef struct xz_trace xz_trace_t;
+
+void xz_chat_trace_free(xz_chat_t* chat); // on destroy
+
+#ifdef CONFIG_XZ_CHAT_TRACE
+void xz_trace_write(xz_trace_t* tr, xz_trace_kind_t kind, int arg, uint32_t seq, uint32_t ts, const void* data, int len);
+#define CHAT_TRACE(chat, kind, arg, seq, ts, data, len) do{ xz_trace_t* _tr = atomic_load_explicit(&(chat)->trace, memory_order_relaxed); if(_tr) xz_trace_write(_tr, kind, arg, seq, ts, data, len); }while(0)
+#else
+#define CHAT_TRACE(chat, kind, arg, seq, ts, data, len) do{}while(0)
+#endif
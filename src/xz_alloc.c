@@ -0,0 +1,20 @@
+#include "xz_alloc_priv.h"
+#include <stdlib.h>
+
+void* xz_buf_alloc(const xz_chat_allocator_t* a, xz_buf_class_t cls, size_t size) {
+    if(!a) return malloc(size);
+    if(a->alloc) return a->alloc(size, cls, a->user_data);
+    return a->caps[cls]? heap_caps_malloc(size, a->caps[cls]): malloc(size);
+}
+
+void* xz_buf_realloc(const xz_chat_allocator_t* a, xz_buf_class_t cls, void* ptr, size_t size) {
+    if(!a) return realloc(ptr, size);
+    if(a->alloc) return a->realloc(ptr, size, cls, a->user_data);
+    return a->caps[cls]? heap_caps_realloc(ptr, size, a->caps[cls]): realloc(ptr, size);
+}
+
+void xz_buf_free(const xz_chat_allocator_t* a, void* ptr) {
+    if(!ptr) return;
+    if(a && a->alloc) a->free(ptr, a->user_data);
+    else free(ptr); // heap_caps_malloc'ed memory is freed by free() as well
+}
@@ -1,8 +1,14 @@
 #include "xz_board_info.h"
 #include <esp_log.h>
 #include <esp_random.h>
-#include <esp_flash.h>
 #include <esp_system.h>
+#include <esp_check.h>
+#include <nvs_flash.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#ifndef CONFIG_IDF_TARGET_LINUX
+#include <esp_flash.h>
 #include <esp_wifi.h>
 #include <esp_partition.h>
 #include <esp_chip_info.h>
@@ -10,22 +16,37 @@
 #include <esp_ota_ops.h>
 #include <esp_netif.h>
 #include <esp_mac.h>
-#include <esp_check.h>
-#include <nvs_flash.h>
-
-#define NVS_PART_NAME CONFIG_XZ_NVS_PART_NAME_TO_SAVE_BOARD_INFO
+#else
+#include <unistd.h>
+#include <stdio.h>
+#endif
 
-#define XZ_NS "xz"
 #define XZ_UUID "xz_uuid"
 
 const static char* const TAG = "xz_board_info";
 
+// filled once, chats may be initialized from several tasks at a time
 const char* xz_board_info_mac() {
     static char mac_str[18];
-    if(*mac_str == 0) {
+    static _Atomic bool mac_ready;
+    static portMUX_TYPE mac_lock = portMUX_INITIALIZER_UNLOCKED;
+    if(!atomic_load(&mac_ready)) {
+        char tmp[sizeof(mac_str)];
+#ifndef CONFIG_IDF_TARGET_LINUX
         uint8_t mac[6];
         esp_efuse_mac_get_default(mac);
-        sprintf(mac_str, MACSTR, MAC2STR(mac));
+        snprintf(tmp, sizeof(tmp), MACSTR, MAC2STR(mac));
+#else
+        // no efuse on host, make a locally administered mac from host id
+        uint32_t id = (uint32_t)gethostid();
+        snprintf(tmp, sizeof(tmp), "02:00:%02x:%02x:%02x:%02x", (uint8_t)(id>>24), (uint8_t)(id>>16), (uint8_t)(id>>8), (uint8_t)id);
+#endif
+        portENTER_CRITICAL(&mac_lock);
+        if(!atomic_load(&mac_ready)) {
+            memcpy(mac_str, tmp, sizeof(mac_str));
+            atomic_store(&mac_ready, true);
+        }
+        portEXIT_CRITICAL(&mac_lock);
     }
     return mac_str;
 }
@@ -53,7 +74,7 @@ esp_err_t xz_board_info_load() {
     nvs_handle_t hl;
     esp_err_t ret;
     size_t n;
-    ESP_RETURN_ON_ERROR(nvs_open_from_partition(NVS_PART_NAME, XZ_NS, NVS_READWRITE, &hl), TAG, "can't open partition %s", NVS_PART_NAME);
+    ESP_RETURN_ON_ERROR(nvs_open_from_partition(XZ_NVS_PART_NAME, XZ_NVS_NS, NVS_READWRITE, &hl), TAG, "can't open partition %s", XZ_NVS_PART_NAME);
     if((ret=nvs_get_str(hl, XZ_UUID, uuid_str, &n)) || n!=sizeof(uuid_str)) {
         gen_uuid(uuid_str, sizeof(uuid_str));
         ret = nvs_set_str(hl, XZ_UUID, uuid_str) || nvs_commit(hl);
@@ -70,10 +91,14 @@ const char* xz_board_info_uuid() {
     return uuid_str;
 }
 
-void xz_board_info_init() {
-    xz_board_info_uuid();
+#ifdef CONFIG_IDF_TARGET_LINUX
+size_t xz_board_info_printf(char* buf, size_t len, const char* lang, const char* mac, const char* uuid) {
+    return snprintf(buf, len, "{\"version\":2,\"language\":\"%s\",\"mac_address\":\"%s\",\"uuid\":\"%s\",\"chip_model_name\":\"linux\","
+            "\"application\":{\"name\":\""APP_NAME"\",\"version\":\""XZ_VER"\"},"
+            "\"board\":{\"type\":\""XZ_BOARD_TYPE"\",\"name\":\""XZ_BOARD_NAME"\",\"mac\":\"%s\"}}",
+            lang, mac, uuid, mac);
 }
-
+#else
 static uint32_t xz_board_info_flash_size() {
     uint32_t flash_size;
     if (esp_flash_get_size(NULL, &flash_size) != ESP_OK) {
@@ -83,10 +108,10 @@ static uint32_t xz_board_info_flash_size() {
     return flash_size;
 }
 
-size_t xz_board_info_printf(char* buf, size_t len, const char* lang) {
+size_t xz_board_info_printf(char* buf, size_t len, const char* lang, const char* mac, const char* uuid) {
     char* ptr = buf;
     ptr += sprintf(ptr, "{\"version\":2,\"language\":\"%s\",\"flash_size\":%ld,\"minimum_free_heap_size\":%ld,\"mac_address\":\"%s\",\"uuid\":\"%s\",\"chip_model_name\":\""CONFIG_IDF_TARGET"\",",
-            lang, xz_board_info_flash_size(), esp_get_minimum_free_heap_size(), xz_board_info_mac(), xz_board_info_uuid());
+            lang, xz_board_info_flash_size(), esp_get_minimum_free_heap_size(), mac, uuid);
 
     esp_chip_info_t chip_info;
     esp_chip_info(&chip_info);
@@ -121,7 +146,8 @@ size_t xz_board_info_printf(char* buf, size_t len, const char* lang) {
     esp_netif_get_ip_info(sta_netif, &ip_info);
     
     ptr += sprintf(ptr, "\"board\":{\"type\":\""XZ_BOARD_TYPE"\",\"name\":\""XZ_BOARD_NAME"\",\"ssid\":\"%s\",\"rssi\":%d,\"channel\":%d,\"ip\":\""IPSTR"\",\"mac\":\"%s\"}}",
-                    ap_info.ssid, ap_info.rssi, ap_info.primary, IP2STR(&ip_info.ip), xz_board_info_mac());
+                    ap_info.ssid, ap_info.rssi, ap_info.primary, IP2STR(&ip_info.ip), mac);
     
     return ptr- buf;
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -2,9 +2,21 @@
 #include "xz_util.h"
 #include "xz_chat_priv.h"
 #include "xz_board_info.h"
+#include "xz_prot_cache.h"
 #include "esp_check.h"
+#include "esp_timer.h"
 #include "ext_mjson.h"
 #include "task_util.h"
+#ifdef CONFIG_XZ_CHAT_REACTOR
+    #include <unistd.h>
+    #include <sys/select.h>
+    #ifdef CONFIG_IDF_TARGET_LINUX
+        #include <sys/eventfd.h>
+        #define EFD_SUPPORT_ISR 0
+    #else
+        #include "esp_vfs_eventfd.h"
+    #endif
+#endif
 
 
 static const char* const TAG = "xz_chat";
@@ -71,17 +83,25 @@ xz_prot_type_t xz_chat_get_protocol_type(xz_chat_t* chat) {
 }
 
 
-static void* gen_prot_conf_from_http_resp(xz_http_client_response_t* resp) {
+#define XZ_VERSION_RESP_BUF_SIZE 2048
+#define XZ_VERSION_RESP_SIZE (sizeof(xz_http_client_response_t) + XZ_VERSION_RESP_BUF_SIZE)
+_Static_assert(XZ_VERSION_RESP_BUF_SIZE >= XZ_PROT_CACHE_SCRATCH_SIZE, "prot cache scratch is taken from the resp pool");
+#define XZ_PROT_CONF_SIZE (sizeof(xz_ws_prot_config_t) > sizeof(xz_mqtt_prot_config_t)? sizeof(xz_ws_prot_config_t): sizeof(xz_mqtt_prot_config_t))
+
+static void* gen_prot_conf_from_http_resp(xz_chat_t* chat, xz_http_client_response_t* resp) {
     void* conf;
     switch(resp->prot_type) {
     case XZ_PROT_TYPE_WS:
-        if((conf=calloc(1, sizeof(xz_ws_prot_config_t)))) {
+        if((conf=CHAT_ALLOC(chat, prot_conf, sizeof(xz_ws_prot_config_t)))) {
+            memset(conf, 0, sizeof(xz_ws_prot_config_t));
             xz_ws_prot_config_set_default((xz_ws_prot_config_t*)conf);
-            xz_ws_prot_config_fill_rest_from_response((xz_ws_prot_config_t*)conf, &resp->ws);
+            if(xz_ws_prot_config_fill_rest_from_response((xz_ws_prot_config_t*)conf, &resp->ws, chat->device_id, chat->client_id))
+                CHAT_FREE(chat, prot_conf, conf); // headers overflow, the caller sees it as no conf
         }
         break;
     case XZ_PROT_TYPE_MQTT:
-        if((conf=calloc(1, sizeof(xz_mqtt_prot_config_t)))) {
+        if((conf=CHAT_ALLOC(chat, prot_conf, sizeof(xz_mqtt_prot_config_t)))) {
+            memset(conf, 0, sizeof(xz_mqtt_prot_config_t));
             xz_mqtt_prot_config_set_default((xz_mqtt_prot_config_t*)conf);
             xz_mqtt_prot_config_fill_rest_from_response((xz_mqtt_prot_config_t*)conf, &resp->mqtt);
         }
@@ -96,37 +116,123 @@ static inline void dispatch_event(xz_chat_t* chat, xz_chat_event_t eid) {
         chat->event_cb(eid, &chat->event_data, chat);
 }
 
+// chat->event_data is filled by the network task, events raised on the main task bring their own
+static inline void dispatch_event_with(xz_chat_t* chat, xz_chat_event_t eid, xz_chat_event_data_t* data) {
+    if(chat->event_cb)
+        chat->event_cb(eid, data, chat);
+}
+
+// takes one command, hi lane first, and runs it. false if none came within wait
+static bool run_cmd(xz_chat_t* chat, TickType_t wait) {
+    cmd_q_el_t cmd;
+    if(xSemaphoreTake(chat->cmd_sem, wait) != pdTRUE) return false;
+    xz_cmd_lane_t lane = XZ_CMD_LANE_HI;
+    if(xQueueReceive(chat->cmd_hi_q, &cmd, 0) != pdTRUE) {
+        lane = XZ_CMD_LANE_NORMAL;
+        if(xQueueReceive(chat->cmd_q, &cmd, 0) != pdTRUE) return true; // taken along with an earlier count
+    }
+    uintptr_t fn = (uintptr_t)cmd.fn;
+    atomic_compare_exchange_strong(&chat->cmd_tail[lane], &fn, 0);
+    esp_err_t ret= cmd.fn(cmd.a, cmd.b, cmd.c);
+    if(ret) {
+        ESP_LOGW(TAG, "cmd err=%d", ret);
+    }
+    return true;
+}
+
 static void main_task_loop(void* arg) {
     xz_chat_t* chat = (xz_chat_t*) arg;
     chat_set_flag(chat, XZ_FLAG_INIT);
     while (1) {
-        cmd_q_el_t cmd;
-        xQueueReceive( chat->cmd_q, &cmd, portMAX_DELAY );
-        esp_err_t ret= cmd.fn(cmd.a, cmd.b, cmd.c);
-        if(ret) {
-            ESP_LOGW(TAG, "cmd err=%d", ret);
-        }
+        run_cmd(chat, portMAX_DELAY);
     }
     atomic_store(&chat->flags, 0);
     chat->main_task = NULL;
     capped_task_delete(NULL);
 }
 
-xz_chat_t* xz_chat_init(xz_chat_config_t* conf) {
-    xz_board_info_init();
+static inline void chat_wake(xz_chat_t* chat) {
+#ifdef CONFIG_XZ_CHAT_REACTOR
+    uint64_t one = 1;
+    if(chat->wake_fd >= 0) write(chat->wake_fd, &one, sizeof(one));
+#endif
+}
+
+esp_err_t chat_post_cmd(xz_chat_t* chat, xz_cmd_lane_t lane, const cmd_q_el_t* el, bool coalesce, TickType_t wait) {
+    uintptr_t fn = (uintptr_t)el->fn;
+    coalesce = coalesce && !el->b && !el->c;
+    uintptr_t tail = atomic_load(&chat->cmd_tail[lane]);
+    do {
+        if(coalesce && tail == fn) return ESP_OK;
+    } while(!atomic_compare_exchange_weak(&chat->cmd_tail[lane], &tail, fn));
+    QueueHandle_t q = lane==XZ_CMD_LANE_HI? chat->cmd_hi_q: chat->cmd_q;
+    if(xPortInIsrContext()) {
+        BaseType_t woken = pdFALSE;
+        if(xQueueSendFromISR(q, el, &woken) != pdTRUE) goto full;
+        chat_stat_max(&chat->stats.cmd_q_high_water, uxQueueMessagesWaitingFromISR(q));
+        xSemaphoreGiveFromISR(chat->cmd_sem, &woken);
+        chat_wake(chat);
+        if(woken) portYIELD_FROM_ISR();
+    } else {
+        if(xQueueSend(q, el, wait) != pdTRUE) goto full;
+        chat_stat_max(&chat->stats.cmd_q_high_water, uxQueueMessagesWaiting(q));
+        xSemaphoreGive(chat->cmd_sem);
+        chat_wake(chat);
+    }
+    return ESP_OK;
+full:
+    atomic_compare_exchange_strong(&chat->cmd_tail[lane], &fn, 0); // unless another post took the tail since
+    CHAT_STAT_ADD(chat, cmd_q_full, 1);
+    return ESP_ERR_TIMEOUT;
+}
+
+static void http_task_loop(void* arg);
+static void drain_timer_cb(TimerHandle_t timer);
+#ifdef CONFIG_XZ_CHAT_REACTOR
+static esp_err_t reactor_init(xz_chat_t* chat);
+static void reactor_loop(void* arg);
+#endif
 
+xz_chat_t* xz_chat_init(xz_chat_config_t* conf) {
     esp_err_t ret = ESP_OK;
     xz_chat_t* chat = NULL;
     ESP_GOTO_ON_FALSE(conf->read_audio_cb, ESP_ERR_INVALID_ARG, err, TAG, "xz_chat_config_t.read_audio_cb must be set");
+    ESP_GOTO_ON_FALSE(!conf->allocator.alloc || (conf->allocator.realloc && conf->allocator.free), ESP_ERR_INVALID_ARG, err, TAG, "xz_chat_config_t.allocator needs alloc, realloc and free");
     
     ESP_GOTO_ON_FALSE((chat=calloc(1, sizeof(xz_chat_t))), ESP_ERR_NO_MEM, err, TAG, "calloc chat handle");
     memcpy(chat, conf, sizeof(xz_chat_config_t));
+    chat->wake_fd = -1;
+    if(!chat->device_id) chat->device_id = xz_board_info_mac();
+    if(!chat->client_id) chat->client_id = xz_board_info_uuid();
+    portMUX_INITIALIZE(&chat->lat_lock);
 
-    ESP_GOTO_ON_FALSE((chat->send_buf=malloc(chat->send_buf_size)), ESP_ERR_NO_MEM, err, TAG, "malloc send buf");
+    ESP_GOTO_ON_FALSE((chat->send_buf=xz_buf_alloc(&chat->allocator, XZ_BUF_CONTROL, chat->send_buf_size)), ESP_ERR_NO_MEM, err, TAG, "malloc send buf");
+#ifdef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    ESP_GOTO_ON_ERROR(CHAT_POOL_INIT(chat, resp, 3, XZ_VERSION_RESP_SIZE), err, TAG, "reserve resp pool");
+    ESP_GOTO_ON_ERROR(CHAT_POOL_INIT(chat, prot_conf, 2, XZ_PROT_CONF_SIZE), err, TAG, "reserve prot conf pool");
+    ESP_GOTO_ON_ERROR(CHAT_POOL_INIT(chat, session, 1, CONFIG_XZ_CHAT_STATIC_SESSION_BUF_SIZE), err, TAG, "reserve session pool");
+    ESP_GOTO_ON_ERROR(CHAT_POOL_INIT(chat, mcp, CONFIG_XZ_CHAT_STATIC_MCP_SLOTS, CONFIG_XZ_CHAT_STATIC_MCP_SIZE), err, TAG, "reserve mcp pool");
+#endif
     ESP_GOTO_ON_FALSE((chat->eg=xEventGroupCreate()), ESP_ERR_NO_MEM, err, TAG, "create event group");
+    xEventGroupSetBits(chat->eg, XZ_EG_TX_IDLE_BIT);
 
     ESP_GOTO_ON_FALSE((chat->cmd_q=xQueueCreate(conf->cmd_q_size, sizeof(cmd_q_el_t))), ESP_ERR_NO_MEM, err, TAG, "create cmd q");
+    ESP_GOTO_ON_FALSE((chat->cmd_hi_q=xQueueCreate(conf->cmd_hi_q_size, sizeof(cmd_q_el_t))), ESP_ERR_NO_MEM, err, TAG, "create cmd hi q");
+    ESP_GOTO_ON_FALSE((chat->cmd_sem=xSemaphoreCreateCounting(conf->cmd_q_size + conf->cmd_hi_q_size, 0)), ESP_ERR_NO_MEM, err, TAG, "create cmd sem");
+#ifdef CONFIG_XZ_CHAT_REACTOR
+    ESP_GOTO_ON_ERROR(reactor_init(chat), err, TAG, "init reactor");
+#else
+    if(conf->send_audio_q_size > 0) {
+        ESP_GOTO_ON_FALSE((chat->send_audio_q=xQueueCreate(conf->send_audio_q_size, sizeof(xz_tx_audio_pck_t))), ESP_ERR_NO_MEM, err, TAG, "create send audio q");
+    }
+#endif
+    ESP_GOTO_ON_FALSE((chat->drain_timer=xTimerCreate("xz_drain", 1, pdFALSE, chat, drain_timer_cb)), ESP_ERR_NO_MEM, err, TAG, "create drain timer");
+#ifdef CONFIG_XZ_CHAT_REACTOR
+    ESP_GOTO_ON_ERROR(capped_task_create(&chat->main_task, "xz_main_task", reactor_loop, chat, &conf->main_task_conf), err, TAG, "create main task");
+#else
     ESP_GOTO_ON_ERROR(capped_task_create(&chat->main_task, "xz_main_task", main_task_loop, chat, &conf->main_task_conf), err, TAG, "create main task");
+#endif
+    ESP_GOTO_ON_ERROR(capped_task_create(&chat->http_task, "xz_http_task", http_task_loop, chat, &conf->http_task_conf), err, TAG, "create http task");
     
 err:
     if(ret) {
@@ -137,51 +243,120 @@ err:
 }
 
 
-static esp_err_t _version_check(xz_chat_t* chat, esp_http_client_handle_t client) {
-    if(chat_has_any_flag(chat, XZ_FLAG_VER_CHECKED)) return ESP_ERR_INVALID_STATE;
-    esp_err_t ret = ESP_OK;
-    esp_http_client_handle_t http = client;
-    if(!http) {
-        ESP_GOTO_ON_FALSE((http=http_client_util_create()), ESP_ERR_NO_MEM, err, TAG, "create http client");
-        ESP_GOTO_ON_ERROR(xz_http_client_set_headers(http, chat->lang), err, TAG, "set header");
-    }
-    ESP_GOTO_ON_FALSE((chat->version_check_response=malloc(2048 + sizeof(xz_http_client_response_t))), ESP_ERR_NO_MEM, err, TAG, "malloc resp");
-    ESP_GOTO_ON_ERROR(xz_http_client_version_check(http, chat->ota.version_check_url, chat->prot_pref, chat->version_check_response->buf, 2048, chat->version_check_response), err, TAG, "check version");
-    chat->prot_type = chat->version_check_response->prot_type;
-    ESP_GOTO_ON_FALSE((chat->prot_conf=gen_prot_conf_from_http_resp(chat->version_check_response)), ESP_ERR_NO_MEM, err, TAG, "gen prot conf");
-err:
-    if(!client && http) http_client_util_delete(http);
+/*
+ version / activation checks run on the http task so the main loop stays responsive.
+ results are handed back to the main task, which updates state and fires the events.
+*/
+#define XZ_HTTP_REQ_VERSION_CHECK (1<<0)
+#define XZ_HTTP_REQ_ACTIVATION_CHECK (1<<1)
+#define XZ_HTTP_REQ_REVALIDATE (1<<2) // version check behind a cached protocol config
+
+#define XZ_ACTIVATION_POLL_DEFAULT_MS 3000
+#define XZ_ACTIVATION_POLL_MAX_MS 60000
+
+static esp_http_client_handle_t get_http_client(xz_chat_t* chat) {
+    esp_http_client_handle_t client = atomic_exchange(&chat->http_user_client, NULL);
+    if(client) return client;
+    if(!chat->http) {
+        if(!(chat->http=http_client_util_create())) return NULL;
+        if(xz_http_client_set_headers(chat->http, chat->lang, chat->device_id, chat->client_id)) {
+            http_client_util_delete(chat->http);
+            chat->http = NULL;
+        }
+    }
+    return chat->http;
+}
+
+static esp_err_t _version_check_done(xz_chat_t* chat, esp_err_t ret) {
     if(!ret) {
         chat_set_flag(chat, XZ_FLAG_VER_CHECKED);
         if(!chat->version_check_response->require_activation) {
             chat_set_flag(chat, XZ_FLAG_ACT_CHECKED);
         }
+        atomic_store(&chat->activation_pace_ms, chat->version_check_response->activation.timeout_ms);
     }
     chat->event_data.version_check_err = ret;
     chat->event_data.parsed_response = ret? NULL: chat->version_check_response;
     chat->event_data.protocol_config = ret? NULL: chat->prot_conf;
     dispatch_event(chat, XZ_EVENT_VERSION_CHECK_RESULT);
-    if(ret) {
-        RELEASE(chat->version_check_response);
-        RELEASE(chat->prot_conf);
-    }
     return ret;
 }
-void xz_chat_version_check(xz_chat_t* chat, esp_http_client_handle_t client) {
-    CMD(chat, _version_check, chat, client);
+
+// a version check from the http task succeeded, its results are owned by the main task from here
+static esp_err_t _version_check_apply(xz_chat_t* chat, xz_http_client_response_t* resp, void* prot_conf) {
+    if(chat_has_any_flag(chat, XZ_FLAG_VER_CHECKED)) { // another check in flight got here first
+        CHAT_FREE(chat, resp, resp);
+        CHAT_FREE(chat, prot_conf, prot_conf);
+        return ESP_ERR_INVALID_STATE;
+    }
+    CHAT_FREE(chat, resp, chat->version_check_response);
+    CHAT_FREE(chat, prot_conf, chat->prot_conf);
+    chat->version_check_response = resp;
+    chat->prot_conf = prot_conf;
+    chat->prot_type = resp->prot_type;
+    return _version_check_done(chat, ESP_OK);
+}
+
+static esp_err_t _swap_prot_conf(xz_chat_t* chat, xz_http_client_response_t* resp, void* prot_conf);
+
+#ifdef CONFIG_XZ_CHAT_CACHE_PROT_CONF
+// scratch for the blobs comes from the resp pool
+static bool prot_cache_matches(xz_chat_t* chat, const xz_http_client_response_t* resp) {
+    void* scratch = CHAT_ALLOC(chat, resp, XZ_PROT_CACHE_SCRATCH_SIZE);
+    bool same = scratch && xz_prot_cache_matches(resp, chat->prot_pref, scratch);
+    CHAT_FREE(chat, resp, scratch);
+    return same;
+}
+
+static void prot_cache_save(xz_chat_t* chat, const xz_http_client_response_t* resp) {
+    void* scratch = CHAT_ALLOC(chat, resp, XZ_PROT_CACHE_SCRATCH_SIZE);
+    if(scratch) xz_prot_cache_save(resp, chat->prot_pref, scratch);
+    CHAT_FREE(chat, resp, scratch);
 }
+#endif
 
-static esp_err_t _activation_check(xz_chat_t* chat, esp_http_client_handle_t client) {
-    if(chat_has_any_flag(chat, XZ_FLAG_ACT_CHECKED)) return ESP_ERR_INVALID_STATE;
+static esp_err_t http_version_check(xz_chat_t* chat, bool revalidate) {
     esp_err_t ret = ESP_OK;
-    esp_http_client_handle_t http = client;
-    if(!http) {
-        ESP_GOTO_ON_FALSE((http=http_client_util_create()), ESP_ERR_NO_MEM, err, TAG, "create http client");
-        ESP_GOTO_ON_ERROR(xz_http_client_set_headers(http, chat->lang), err, TAG, "set header");
+    esp_http_client_handle_t http;
+    xz_http_client_response_t* resp = NULL;
+    void* prot_conf = NULL;
+    ESP_GOTO_ON_FALSE((http=get_http_client(chat)), ESP_ERR_NO_MEM, err, TAG, "create http client");
+    ESP_GOTO_ON_FALSE((resp=CHAT_ALLOC(chat, resp, XZ_VERSION_RESP_SIZE)), ESP_ERR_NO_MEM, err, TAG, "malloc resp");
+    ESP_GOTO_ON_ERROR(xz_http_client_version_check(http, chat->ota.version_check_url, chat->prot_pref, resp->buf, XZ_VERSION_RESP_BUF_SIZE, resp), err, TAG, "check version");
+#ifdef CONFIG_XZ_CHAT_CACHE_PROT_CONF
+    if(revalidate && !resp->require_activation && prot_cache_matches(chat, resp)) {
+        ESP_LOGI(TAG, "cached protocol config is up to date");
+        CHAT_FREE(chat, resp, resp);
+        return ESP_OK;
     }
-    ESP_GOTO_ON_ERROR(xz_http_client_activation_check(http, chat->ota.activation_check_url), err, TAG, "check activation");
+#endif
+    ESP_GOTO_ON_FALSE((prot_conf=gen_prot_conf_from_http_resp(chat, resp)), ESP_ERR_NO_MEM, err, TAG, "gen prot conf");
+#ifdef CONFIG_XZ_CHAT_CACHE_PROT_CONF
+    if(resp->require_activation) xz_prot_cache_erase(); // saved once activated
+    else prot_cache_save(chat, resp);
+#endif
+    chat->activation_backoff_ms = 0;
+    chat->next_activation_poll = 0;
 err:
-    if(!client && http) http_client_util_delete(http);
+    if(ret) {
+        CHAT_FREE(chat, resp, resp);
+        CHAT_FREE(chat, prot_conf, prot_conf);
+    }
+    if(revalidate) {
+        // keep running on the cached config if the check failed
+        if(!ret) CMD(chat, _swap_prot_conf, chat, resp, prot_conf);
+    } else if(ret) {
+        CMD(chat, _version_check_done, chat, (void*)(intptr_t)ret);
+    } else {
+        CMD(chat, _version_check_apply, chat, resp, prot_conf);
+    }
+    return ret;
+}
+
+static esp_err_t _activation_check_done(xz_chat_t* chat, esp_err_t ret) {
+#ifdef CONFIG_XZ_CHAT_CACHE_PROT_CONF
+    if(!ret && chat->version_check_response) prot_cache_save(chat, chat->version_check_response); // activated, safe to start from it next boot
+#endif
     chat->event_data.activation_check_err = ret;
     dispatch_event(chat, XZ_EVENT_ACTIVATION_CHECK_RESULT);
     if(!ret) {
@@ -190,37 +365,179 @@ err:
     return ret;
 }
 
+static esp_err_t http_activation_check(xz_chat_t* chat) {
+    esp_err_t ret = ESP_OK;
+    esp_http_client_handle_t http;
+    int pace = atomic_load(&chat->activation_pace_ms);
+    ESP_GOTO_ON_FALSE((http=get_http_client(chat)), ESP_ERR_NO_MEM, err, TAG, "create http client");
+    ESP_GOTO_ON_ERROR(xz_http_client_activation_check(http, chat->ota.activation_check_url), err, TAG, "check activation");
+err:
+    // pace the next poll: server given interval while pending, growing backoff on errors
+    if(pace <= 0) pace = XZ_ACTIVATION_POLL_DEFAULT_MS;
+    if(ret == ESP_OK || ret == ESP_ERR_TIMEOUT) {
+        chat->activation_backoff_ms = pace;
+    } else {
+        chat->activation_backoff_ms = chat->activation_backoff_ms? chat->activation_backoff_ms * 2: pace;
+        if(chat->activation_backoff_ms > XZ_ACTIVATION_POLL_MAX_MS) chat->activation_backoff_ms = XZ_ACTIVATION_POLL_MAX_MS;
+    }
+    chat->next_activation_poll = esp_timer_get_time() + chat->activation_backoff_ms * 1000ll;
+    CMD(chat, _activation_check_done, chat, (void*)(intptr_t)ret);
+    return ret;
+}
+
+static void http_task_loop(void* arg) {
+    xz_chat_t* chat = (xz_chat_t*)arg;
+    uint32_t bits = 0;
+    while(0 == (TASK_STOP_BIT & bits)) {
+        uint32_t req = atomic_load(&chat->http_req);
+        TickType_t wait = portMAX_DELAY;
+        if(req & (XZ_HTTP_REQ_VERSION_CHECK|XZ_HTTP_REQ_REVALIDATE)) {
+            atomic_fetch_and(&chat->http_req, ~(XZ_HTTP_REQ_VERSION_CHECK|XZ_HTTP_REQ_REVALIDATE));
+            http_version_check(chat, !(req & XZ_HTTP_REQ_VERSION_CHECK));
+            wait = 0;
+        } else if(req & XZ_HTTP_REQ_ACTIVATION_CHECK) {
+            int64_t left = chat->next_activation_poll - esp_timer_get_time();
+            if(left <= 0) {
+                atomic_fetch_and(&chat->http_req, ~XZ_HTTP_REQ_ACTIVATION_CHECK);
+                if(!http_activation_check(chat)) {
+                    // nothing left to ask the ota server
+                    if(chat->http) { http_client_util_delete(chat->http); chat->http = NULL; }
+                }
+                wait = 0;
+            } else {
+                wait = pdMS_TO_TICKS((left + 999) / 1000) + 1;
+            }
+        }
+        bits = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &bits, wait);
+    }
+    if(chat->http) { http_client_util_delete(chat->http); chat->http = NULL; }
+    chat->http_task = NULL;
+    xEventGroupSetBits(chat->eg, XZ_EG_HTTP_TASK_STOPPED_BIT);
+    capped_task_delete(NULL);
+}
+
+static void post_http_req(xz_chat_t* chat, uint32_t req, esp_http_client_handle_t client) {
+    if(client) atomic_store(&chat->http_user_client, client);
+    atomic_fetch_or(&chat->http_req, req);
+    resume_task(chat->http_task);
+}
+
+#ifdef CONFIG_XZ_CHAT_CACHE_PROT_CONF
+static esp_err_t _version_check_cached(xz_chat_t* chat, esp_http_client_handle_t client) {
+    if(chat_has_any_flag(chat, XZ_FLAG_VER_CHECKED)) return ESP_ERR_INVALID_STATE;
+    xz_http_client_response_t* resp = CHAT_ALLOC(chat, resp, XZ_VERSION_RESP_SIZE);
+    if(resp && xz_prot_cache_load(chat->prot_pref, resp, XZ_VERSION_RESP_BUF_SIZE)) CHAT_FREE(chat, resp, resp);
+    void* prot_conf = resp? gen_prot_conf_from_http_resp(chat, resp): NULL;
+    if(!prot_conf) {
+        CHAT_FREE(chat, resp, resp);
+        post_http_req(chat, XZ_HTTP_REQ_VERSION_CHECK, client);
+        return ESP_OK;
+    }
+    ESP_LOGI(TAG, "using cached protocol config, revalidating in background");
+    chat->version_check_response = resp;
+    chat->prot_conf = prot_conf;
+    chat->prot_type = resp->prot_type;
+    post_http_req(chat, XZ_HTTP_REQ_REVALIDATE, client);
+    return _version_check_done(chat, ESP_OK);
+}
+#endif
+
+void xz_chat_version_check(xz_chat_t* chat, esp_http_client_handle_t client) {
+    if(chat_has_any_flag(chat, XZ_FLAG_VER_CHECKED)) return;
+#ifdef CONFIG_XZ_CHAT_CACHE_PROT_CONF
+    CMD_EX(chat, XZ_CMD_LANE_HI, false, _version_check_cached, chat, client);
+#else
+    post_http_req(chat, XZ_HTTP_REQ_VERSION_CHECK, client);
+#endif
+}
+
 void xz_chat_activation_check(xz_chat_t* chat, esp_http_client_handle_t client) {
-    CMD(chat, _activation_check, chat, client);
+    if(chat_has_any_flag(chat, XZ_FLAG_ACT_CHECKED)) return;
+    post_http_req(chat, XZ_HTTP_REQ_ACTIVATION_CHECK, client);
+}
+
+void xz_chat_cancel_checks(xz_chat_t* chat) {
+    atomic_store(&chat->http_req, 0);
+    atomic_store(&chat->http_user_client, NULL);
+    resume_task(chat->http_task);
+}
+
+static inline void release_tx_audio(xz_tx_audio_pck_t* audio) {
+    if(audio->release_cb) {
+        audio->release_cb(audio->user_data);
+    }
+}
+
+static void __send_audio(xz_chat_t* chat, xz_tx_audio_pck_t* audio) {
+    // before send_data, mqtt may encrypt in place
+    CHAT_TRACE(chat, XZ_TRACE_TX_AUDIO, 0, atomic_load_explicit(&chat->stats.tx_frames, memory_order_relaxed), 0, audio->buf, audio->len);
+    if(chat->prot_if.send_data(chat, audio)) {
+        CHAT_STAT_ADD(chat, tx_errors, 1);
+        return;
+    }
+    CHAT_STAT_ADD(chat, tx_frames, 1);
+    CHAT_STAT_ADD(chat, tx_bytes, audio->len);
+    chat_lat_mark(chat, XZ_LAT_FIRST_UPLINK);
 }
 
+/*
+ the task sending uplink holds XZ_EG_TX_IDLE_BIT low from the session check till send_data returns,
+ so quiesce_tx on the main task can wait it out before the protocol frees its tx buffers.
+*/
+static void send_audio(xz_chat_t* chat, xz_tx_audio_pck_t* audio) {
+    xEventGroupClearBits(chat->eg, XZ_EG_TX_IDLE_BIT);
+    if(chat_has_any_flag(chat, XZ_FLAG_SESS_LISTENING)) {
+        __send_audio(chat, audio);
+    }
+    xEventGroupSetBits(chat->eg, XZ_EG_TX_IDLE_BIT);
+}
+
+void chat_tx_audio(xz_chat_t* chat, xz_tx_audio_pck_t* audio) {
+    if(!chat_has_any_flag(chat, XZ_FLAG_SESS_LISTENING)) {
+        release_tx_audio(audio);
+        return;
+    }
+    if(chat->send_audio_q == NULL) {
+        send_audio(chat, audio);
+        release_tx_audio(audio);
+        return;
+    }
+    if(chat->send_audio_q_policy == XZ_SEND_AUDIO_Q_BLOCK) {
+        xQueueSend(chat->send_audio_q, audio, portMAX_DELAY);
+    } else {
+        while(pdTRUE != xQueueSend(chat->send_audio_q, audio, 0)) {
+            xz_tx_audio_pck_t oldest;
+            if(pdTRUE == xQueueReceive(chat->send_audio_q, &oldest, 0)) {
+                release_tx_audio(&oldest);
+                atomic_fetch_add(&chat->send_audio_q_dropped, 1);
+            }
+        }
+    }
+    int depth = uxQueueMessagesWaiting(chat->send_audio_q);
+    if(depth > atomic_load(&chat->send_audio_q_hwm)) {
+        atomic_store(&chat->send_audio_q_hwm, depth); // only read audio task writes it
+    }
+}
+
+#ifndef CONFIG_XZ_CHAT_REACTOR
 static void read_audio_loop(void* arg) {
     xz_chat_t* chat = (xz_chat_t*)arg;
  
 #ifdef CONFIG_XZ_CONTINUOUSLY_DIGEST_AUDIO_INPUT
     while(0== (TASK_STOP_BIT & ulTaskNotifyTake(pdTRUE, 0))) {
-        xz_tx_audio_pck_t audio;
+        xz_tx_audio_pck_t audio = {0};
         if(chat->read_audio_cb(&audio, chat))
             continue;
-        if(chat_has_any_flag(chat, XZ_FLAG_SESS_LISTENING)) {
-            chat->prot_if.send_data(chat, audio.buf, audio.len);
-        } 
-        if(audio.release_cb) {
-            audio.release_cb(audio.user_data);
-        }
+        chat_tx_audio(chat, &audio);
     }
 #else
     while(0== (TASK_STOP_BIT & ulTaskNotifyTake(pdTRUE, portMAX_DELAY))) {
         while(xEventGroupGetBits(chat->eg) & XZ_EG_READ_AUDIO_TASK_RUN_BIT) {
-            xz_tx_audio_pck_t audio;
+            xz_tx_audio_pck_t audio = {0};
             if(chat->read_audio_cb(&audio, chat))
                 continue;
-            if(chat_has_any_flag(chat, XZ_FLAG_SESS_LISTENING)) {
-                chat->prot_if.send_data(chat, audio.buf, audio.len);
-            }
-            if(audio.release_cb) {
-                audio.release_cb(audio.user_data);
-            }
+            chat_tx_audio(chat, &audio);
         }
     }
 #endif
@@ -228,6 +545,141 @@ static void read_audio_loop(void* arg) {
     xEventGroupSetBits(chat->eg, XZ_EG_READ_AUDIO_TASK_STOPPED_BIT);
     capped_task_delete(NULL);
 }
+#endif
+
+static void drain_send_audio_q(xz_chat_t* chat) {
+    xz_tx_audio_pck_t audio;
+    while(pdTRUE == xQueueReceive(chat->send_audio_q, &audio, 0)) {
+        release_tx_audio(&audio);
+    }
+}
+
+void chat_send_audio_loop(void* arg) {
+    xz_chat_t* chat = (xz_chat_t*)arg;
+    while(0== (TASK_STOP_BIT & ulTaskNotifyTake(pdTRUE, 0))) {
+        xz_tx_audio_pck_t audio;
+        if(pdTRUE != xQueueReceive(chat->send_audio_q, &audio, pdMS_TO_TICKS(100)))
+            continue;
+        send_audio(chat, &audio);
+        release_tx_audio(&audio);
+    }
+    drain_send_audio_q(chat);
+    chat->send_audio_task = NULL;
+    xEventGroupSetBits(chat->eg, XZ_EG_SEND_AUDIO_TASK_STOPPED_BIT);
+    capped_task_delete(NULL);
+}
+
+// call with SESS_LISTENING cleared. drops the queued frames and waits for the one being sent, if any
+static esp_err_t quiesce_tx(xz_chat_t* chat) {
+    if(chat->send_audio_q) drain_send_audio_q(chat);
+    if(XZ_EG_TX_IDLE_BIT & xEventGroupWaitBits(chat->eg, XZ_EG_TX_IDLE_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(5000))) return ESP_OK;
+    ESP_LOGE(TAG, "uplink send stuck");
+    return ESP_ERR_TIMEOUT;
+}
+
+void xz_chat_get_send_audio_q_stats(xz_chat_t* chat, xz_chat_send_audio_q_stats_t* stats, bool reset) {
+    stats->depth = chat->send_audio_q? uxQueueMessagesWaiting(chat->send_audio_q): 0;
+    if(reset) {
+        stats->high_water = atomic_exchange(&chat->send_audio_q_hwm, 0);
+        stats->dropped = atomic_exchange(&chat->send_audio_q_dropped, 0);
+    } else {
+        stats->high_water = atomic_load(&chat->send_audio_q_hwm);
+        stats->dropped = atomic_load(&chat->send_audio_q_dropped);
+    }
+}
+
+void xz_chat_get_stats(xz_chat_t* chat, xz_chat_stats_t* stats, bool reset) {
+    #define SNAP(f) stats->f = reset? atomic_exchange_explicit(&chat->stats.f, 0, memory_order_relaxed): atomic_load_explicit(&chat->stats.f, memory_order_relaxed)
+    SNAP(tx_frames); SNAP(tx_bytes); SNAP(tx_errors);
+    SNAP(rx_frames); SNAP(rx_bytes); SNAP(rx_msgs); SNAP(rx_oversize); SNAP(rx_bad_packets); SNAP(rx_lost_frames); SNAP(rx_late_frames);
+    SNAP(cmd_q_high_water); SNAP(cmd_q_full);
+    SNAP(audio_cb_calls); SNAP(audio_cb_max_us); SNAP(audio_cb_total_us);
+    SNAP(alloc_overflow);
+    #undef SNAP
+    xz_chat_get_send_audio_q_stats(chat, &stats->send_audio_q, reset);
+}
+
+void xz_chat_audio_ready(xz_chat_t* chat) {
+    chat_wake(chat);
+}
+
+#ifdef CONFIG_XZ_CHAT_REACTOR
+/*
+ reactor mode. the main task runs the commands, reads uplink frames and serves the protocol socket,
+ sleeping in select on the eventfd that chat_post_cmd / xz_chat_audio_ready write and on the socket.
+*/
+#define XZ_REACTOR_AUDIO_POLL_MS 20 // while capturing, for apps that don't call xz_chat_audio_ready
+#define XZ_REACTOR_AUDIO_BURST 4    // frames per round, a capture backlog doesn't hold commands and downlink
+
+static esp_err_t reactor_init(xz_chat_t* chat) {
+#ifndef CONFIG_IDF_TARGET_LINUX
+    esp_vfs_eventfd_config_t conf = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_err_t ret = esp_vfs_eventfd_register(&conf);
+    if(ret && ret != ESP_ERR_INVALID_STATE) return ret; // already registered by the app or another chat
+#endif
+    chat->wake_fd = eventfd(0, EFD_SUPPORT_ISR);
+    return chat->wake_fd >= 0? ESP_OK: ESP_ERR_NO_MEM;
+}
+
+static bool reactor_capturing(xz_chat_t* chat) {
+    if(!chat_has_any_flag(chat, XZ_FLAG_STARTED)) return false;
+#ifdef CONFIG_XZ_CONTINUOUSLY_DIGEST_AUDIO_INPUT
+    return true;
+#else
+    return (xEventGroupGetBits(chat->eg) & XZ_EG_READ_AUDIO_TASK_RUN_BIT) != 0;
+#endif
+}
+
+// returns us till the next look, 0 if more frames may be ready
+static int64_t reactor_read_audio(xz_chat_t* chat) {
+    for(int i = 0; i < XZ_REACTOR_AUDIO_BURST; i++) {
+        xz_tx_audio_pck_t audio = {0};
+        if(chat->read_audio_cb(&audio, chat)) return XZ_REACTOR_AUDIO_POLL_MS * 1000;
+        chat_tx_audio(chat, &audio);
+    }
+    return 0;
+}
+
+static esp_err_t _reactor_exit(xz_chat_t* chat) {
+    chat->reactor_exit = true;
+    return ESP_OK;
+}
+
+static void reactor_loop(void* arg) {
+    xz_chat_t* chat = (xz_chat_t*) arg;
+    chat_set_flag(chat, XZ_FLAG_INIT);
+    bool readable = false;
+    while(!chat->reactor_exit) {
+        while(!chat->reactor_exit && run_cmd(chat, 0));
+        if(chat->reactor_exit) break;
+        int64_t wait_us = -1; // till woken
+        if(reactor_capturing(chat)) wait_us = reactor_read_audio(chat);
+        int fd = -1;
+        if(chat_has_any_flag(chat, XZ_FLAG_STARTED) && chat->prot_if.io) {
+            int64_t w = chat->prot_if.io(chat, readable);
+            if(w > 0 && (wait_us < 0 || w < wait_us)) wait_us = w;
+            fd = chat->prot_if.io_fd(chat);
+        }
+        readable = false;
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(chat->wake_fd, &rfds);
+        if(fd >= 0) FD_SET(fd, &rfds);
+        struct timeval tv = { .tv_sec = wait_us / 1000000, .tv_usec = wait_us % 1000000 };
+        if(0 < select((fd > chat->wake_fd? fd: chat->wake_fd) + 1, &rfds, NULL, NULL, wait_us < 0? NULL: &tv)) {
+            if(FD_ISSET(chat->wake_fd, &rfds)) {
+                uint64_t n;
+                read(chat->wake_fd, &n, sizeof(n));
+            }
+            readable = fd >= 0 && FD_ISSET(fd, &rfds);
+        }
+    }
+    atomic_store(&chat->flags, 0);
+    chat->main_task = NULL;
+    xEventGroupSetBits(chat->eg, XZ_EG_MAIN_TASK_STOPPED_BIT);
+    capped_task_delete(NULL);
+}
+#endif
 
 static esp_err_t _start(xz_chat_t* chat) {
     if(!chat_has_any_flag(chat, XZ_FLAG_ACT_CHECKED) || chat_has_any_flag(chat, XZ_FLAG_STARTED)) return ESP_ERR_INVALID_STATE;
@@ -245,14 +697,20 @@ static esp_err_t _start(xz_chat_t* chat) {
         default: ret = ESP_ERR_INVALID_ARG;
         }
         if(ret) return ret;
-        RELEASE(chat->prot_conf); // when protocol context is already initialized, it's configuration is nolonger needed.
-        RELEASE(chat->version_check_response);
+        CHAT_FREE(chat, prot_conf, chat->prot_conf); // when protocol context is already initialized, it's configuration is nolonger needed.
+        CHAT_FREE(chat, resp, chat->version_check_response);
     }
     ESP_RETURN_ON_ERROR(chat->prot_if.start(chat), TAG, "start prot"); // if start fails, we dont need to deinit chat->prot_ctx
+    if(chat->send_audio_q) {
+        ESP_GOTO_ON_ERROR(capped_task_create(&chat->send_audio_task, "xz_send_audio_task", chat_send_audio_loop, chat, &chat->send_audio_task_conf), err, TAG, "create send audio task");
+    }
+#ifndef CONFIG_XZ_CHAT_REACTOR
     ESP_GOTO_ON_ERROR(capped_task_create(&chat->read_audio_task, "xz_read_audio_task", read_audio_loop, chat, &chat->read_audio_task_conf), err, TAG, "create read audio task");
+#endif
     ESP_LOGI(TAG, "started");
 err:
     if(ret) {
+        term_task_wait(chat->send_audio_task, chat->eg, XZ_EG_SEND_AUDIO_TASK_STOPPED_BIT, pdMS_TO_TICKS(5000));
         chat->prot_if.stop(chat);
     } else { 
         chat_set_flag(chat, XZ_FLAG_STARTED);
@@ -261,42 +719,141 @@ err:
     return ret;
 }
 void xz_chat_start(xz_chat_t* chat) {
-    CMD(chat, _start, chat);
+    CMD_EX(chat, XZ_CMD_LANE_HI, false, _start, chat);
+}
+
+static void cancel_playback_drain(xz_chat_t* chat) {
+    if(chat_has_any_flag(chat, XZ_FLAG_PLAYBACK_DRAINING)) {
+        chat_clear_flag(chat, XZ_FLAG_PLAYBACK_DRAINING);
+        xTimerStop(chat->drain_timer, 0);
+    }
+}
+
+/*
+ latency timeline. points are stamped from any task with chat_lat_mark,
+ turns are opened and closed on the main task, which folds them into lat_stats.
+*/
+static void lat_request(xz_chat_t* chat) {
+    uint32_t none = 0;
+    atomic_compare_exchange_strong(&chat->lat_request_ms, &none, chat_lat_now());
+}
+
+// when the request being handled was posted, taken even if it turns out to be a no-op so it won't date a later one
+static uint32_t lat_take_request(xz_chat_t* chat) {
+    uint32_t req = atomic_exchange(&chat->lat_request_ms, 0);
+    return req? req: chat_lat_now();
+}
+
+static void lat_turn_end(xz_chat_t* chat) {
+    xz_lat_record_t r;
+    for(int i=0; i<XZ_LAT_MARKS; i++) {
+        r.ms[i] = atomic_exchange(&chat->lat_ms[i], 0);
+    }
+    if(!r.ms[XZ_LAT_LISTEN_START]) return; // never got to listening, nothing to report
+    r.turn = ++ chat->lat_turns;
+    portENTER_CRITICAL(&chat->lat_lock);
+    xz_lat_stats_add(&chat->lat_stats, &r);
+    portEXIT_CRITICAL(&chat->lat_lock);
+    xz_chat_event_data_t ed = { .latency = &r };
+    dispatch_event_with(chat, XZ_EVENT_LATENCY_RECORD, &ed);
+}
+
+// request_ms from lat_take_request, 0 if the chat goes back to listening on its own
+static void lat_turn_begin(xz_chat_t* chat, uint32_t request_ms) {
+    if(!request_ms && !atomic_load(&chat->lat_ms[XZ_LAT_LISTEN_START])) return; // the requested turn is still being set up
+    lat_turn_end(chat);
+    if(request_ms) {
+        atomic_store(&chat->lat_ms[XZ_LAT_REQUEST], request_ms);
+        atomic_store(&chat->lat_ms[XZ_LAT_DEQUEUE], chat_lat_now());
+    }
+}
+
+void xz_chat_get_latency_stats(xz_chat_t* chat, xz_lat_stats_t* stats, bool reset) {
+    portENTER_CRITICAL(&chat->lat_lock);
+    *stats = chat->lat_stats;
+    if(reset) memset(&chat->lat_stats, 0, sizeof(chat->lat_stats));
+    portEXIT_CRITICAL(&chat->lat_lock);
 }
 
 static esp_err_t _exit_session(xz_chat_t* chat) {
+    cancel_playback_drain(chat);
     if(!chat_has_any_flag(chat, XZ_FLAGS_IN_SESS)) return ESP_ERR_INVALID_STATE;
 #ifndef CONFIG_CONTINUOUSLY_DIGEST_AUDIO_INPUT
     xEventGroupClearBits(chat->eg, XZ_EG_READ_AUDIO_TASK_RUN_BIT);
 #endif
     chat_clear_flag(chat, XZ_FLAGS_IN_SESS);
-    chat->prot_if.close_audio_chan(chat);
-    return ESP_OK;
+    esp_err_t ret = quiesce_tx(chat);
+    chat->prot_if.close_audio_chan(chat); // even if a sender is stuck, the protocol keeps its tx buffers while TX_IDLE is low
+    chat_lat_mark(chat, XZ_LAT_GOODBYE);
+    lat_turn_end(chat);
+    return ret;
 }
 
 static esp_err_t _stop(xz_chat_t* chat) {
     esp_err_t ret;
     _exit_session(chat);
     if(!chat_has_any_flag(chat, XZ_FLAG_STARTED)) return ESP_ERR_INVALID_STATE;
-    if((ret=chat->prot_if.stop(chat))) return ret;
+    // read audio task goes first so nothing is queued after the sender exits, both before stop frees the protocol's tx buffers
     if((ret=term_task_wait(chat->read_audio_task, chat->eg, XZ_EG_READ_AUDIO_TASK_STOPPED_BIT, pdMS_TO_TICKS(5000)))) return ret;
+    if((ret=term_task_wait(chat->send_audio_task, chat->eg, XZ_EG_SEND_AUDIO_TASK_STOPPED_BIT, pdMS_TO_TICKS(5000)))) return ret;
+    if((ret=chat->prot_if.stop(chat))) return ret;
     chat_clear_flag(chat, XZ_FLAG_STARTED);
     dispatch_event(chat, XZ_EVENT_STOPPED);
     return ret;
 }
 void xz_chat_stop(xz_chat_t* chat) {
-    CMD(chat, _stop, chat);
+    CMD_EX(chat, XZ_CMD_LANE_HI, false, _stop, chat);
+}
+
+static esp_err_t destroy_prot_ctx(xz_chat_t* chat) {
+    esp_err_t ret;
+    switch(chat->prot_type) {
+        case XZ_PROT_TYPE_WS: ret = xz_ws_prot_destroy((xz_ws_prot_ctx_t*) chat->prot_ctx); break;
+        case XZ_PROT_TYPE_MQTT: ret = xz_mqtt_prot_destroy((xz_mqtt_prot_ctx_t*) chat->prot_ctx); break;
+        default: ret= ESP_ERR_INVALID_ARG;
+    }
+    if(!ret) chat->prot_ctx = NULL;
+    return ret;
+}
+
+// background version check returned a config different from the cached one
+static esp_err_t _swap_prot_conf(xz_chat_t* chat, xz_http_client_response_t* resp, void* prot_conf) {
+    esp_err_t ret = ESP_OK;
+    bool started = chat_has_any_flag(chat, XZ_FLAG_STARTED);
+    ESP_LOGI(TAG, "protocol config changed%s", started? ", restarting protocol": "");
+    if(started) ESP_GOTO_ON_ERROR(_stop(chat), err, TAG, "stop");
+    if(chat->prot_ctx) ESP_GOTO_ON_ERROR(destroy_prot_ctx(chat), err, TAG, "destroy prot");
+    CHAT_FREE(chat, resp, chat->version_check_response);
+    CHAT_FREE(chat, prot_conf, chat->prot_conf);
+    chat->version_check_response = resp;
+    chat->prot_conf = prot_conf;
+    chat->prot_type = resp->prot_type;
+    if(resp->require_activation) {
+        // device was unregistered meanwhile, let the app go through activation again
+        chat_clear_flag(chat, XZ_FLAG_ACT_CHECKED);
+        return _version_check_done(chat, ESP_OK);
+    }
+    if(started) return _start(chat);
+    return ESP_OK;
+err:
+    CHAT_FREE(chat, resp, resp);
+    CHAT_FREE(chat, prot_conf, prot_conf);
+    return ret;
 }
 
 static esp_err_t __start_listening(xz_chat_t* chat, xz_chat_listening_mode_t listening_mode) {
+    cancel_playback_drain(chat);
     chat->listening_mode = listening_mode;
     esp_err_t ret = xz_prot_send_start_listening(chat, listening_mode);
     if(ret) return ret;
+    chat_lat_mark(chat, XZ_LAT_LISTEN_START);
     chat_clear_flag(chat, XZ_FLAG_SESS_LEAVING|XZ_FLAG_SESS_SPEAKING);
     chat_set_flag(chat, XZ_FLAG_SESS_LISTENING);
 #ifndef CONFIG_CONTINUOUSLY_DIGEST_AUDIO_INPUT
     xEventGroupSetBits(chat->eg, XZ_EG_READ_AUDIO_TASK_RUN_BIT);
+#ifndef CONFIG_XZ_CHAT_REACTOR
     resume_task(chat->read_audio_task);
+#endif
 #endif
     return ESP_OK;
 }
@@ -315,21 +872,73 @@ static esp_err_t __enter_session_then_listen(xz_chat_t* chat, xz_chat_listening_
 }
 
 void xz_chat_exit_session(xz_chat_t* chat) {
-    CMD(chat, _exit_session, chat);
+    CMD_EX(chat, XZ_CMD_LANE_HI, false, _exit_session, chat);
+}
+
+static esp_err_t _playback_drained(xz_chat_t* chat) {
+    if(!chat_has_any_flag(chat, XZ_FLAG_PLAYBACK_DRAINING)) return ESP_OK; // cancelled or already done
+    cancel_playback_drain(chat);
+    if(!chat_has_any_flag(chat, XZ_FLAGS_IN_SESS)) return ESP_ERR_INVALID_STATE;
+    chat_clear_flag(chat, XZ_FLAG_SESS_SPEAKING);
+    if(chat->drain_listening_mode == XZ_DRAIN_NO_LISTENING) return ESP_OK;
+    lat_turn_begin(chat, 0);
+    esp_err_t ret = __start_listening(chat, chat->drain_listening_mode);
+    if(ret) {
+        // if server send tts.stop and close connection, then sending start listening msg will fail.
+        chat_set_flag(chat, XZ_FLAG_SESS_LEAVING);
+        _exit_session(chat);
+    }
+    return ret;
+}
+
+static void drain_timer_cb(TimerHandle_t timer) {
+    xz_chat_t* chat = (xz_chat_t*) pvTimerGetTimerID(timer);
+    cmd_q_el_t el = {(_cmd_el_fn_t)_playback_drained, chat};
+    if(chat_post_cmd(chat, XZ_CMD_LANE_HI, &el, true, 0)) {
+        xTimerReset(timer, 0); // don't block the timer task, try again later
+    }
+}
+
+/*
+ the switch to listening waits for the speaker to empty its buffer, without blocking the main task.
+ it happens on xz_chat_report_playback_drained or, if the app doesn't report, after fallback_ms.
+*/
+static esp_err_t __listen_after_playback(xz_chat_t* chat, int listening_mode, int fallback_ms) {
+    chat->drain_listening_mode = listening_mode;
+    chat_set_flag(chat, XZ_FLAG_PLAYBACK_DRAINING);
+    if(atomic_load(&chat->playback_idle)) {
+        return _playback_drained(chat);
+    }
+    xTimerChangePeriod(chat->drain_timer, pdMS_TO_TICKS(fallback_ms), 0);
+    return ESP_OK;
+}
+
+void xz_chat_report_playback_remaining(xz_chat_t* chat, int remaining_ms) {
+    atomic_store(&chat->playback_idle, remaining_ms <= 0);
+    if(!chat_has_any_flag(chat, XZ_FLAG_PLAYBACK_DRAINING)) return;
+    if(remaining_ms <= 0) {
+        xTimerStop(chat->drain_timer, 0);
+        CMD_EX(chat, XZ_CMD_LANE_HI, true, _playback_drained, chat);
+    } else {
+        xTimerChangePeriod(chat->drain_timer, pdMS_TO_TICKS(remaining_ms) + 1, 0);
+    }
 }
 
 static esp_err_t __abort_speaking_then_listen(xz_chat_t* chat, xz_chat_listening_mode_t listening_mode) {
     chat_clear_flag(chat, XZ_FLAG_SESS_SPEAKING);
     esp_err_t ret = xz_prot_send_abort_speaking(chat, XZ_ABORT_REASON_NONE);
     if(ret) return ret;
-    vTaskDelay(pdMS_TO_TICKS(250)); // wait till remaining data played.
-    return __start_listening(chat, listening_mode);
+    chat_set_flag(chat, XZ_FLAG_SESS_LEAVING); // still in session while the remaining data is played
+    return __listen_after_playback(chat, listening_mode, 250);
 }
 
 static esp_err_t _new_session(xz_chat_t* chat) {
     int flags = atomic_load(&chat->flags);
+    uint32_t req = lat_take_request(chat);
     if((flags & XZ_FLAG_STARTED) == 0) return ESP_ERR_INVALID_STATE;
     xz_chat_listening_mode_t listening_mode = chat->enable_realtime_listening? XZ_LISTENING_MODE_REALTIME: XZ_LISTENING_MODE_AUTO_STOP;
+    if(flags & (XZ_FLAG_SESS_SPEAKING|XZ_FLAG_SESS_LEAVING) || 0 == (flags & XZ_FLAGS_IN_SESS))
+        lat_turn_begin(chat, req);
     if(0 == (flags & XZ_FLAGS_IN_SESS))
         return __enter_session_then_listen(chat, listening_mode);
     if(flags & XZ_FLAG_SESS_SPEAKING)
@@ -339,13 +948,17 @@ static esp_err_t _new_session(xz_chat_t* chat) {
     return ESP_ERR_INVALID_STATE;
 }
 void xz_chat_new_session(xz_chat_t* chat) {
-    CMD(chat, _new_session, chat);
+    lat_request(chat);
+    CMD_EX(chat, XZ_CMD_LANE_HI, true, _new_session, chat);
 }
 
 static esp_err_t _toggle_chat_state(xz_chat_t* chat) {
     int flags = atomic_load(&chat->flags);
+    uint32_t req = lat_take_request(chat);
     if((flags & XZ_FLAG_STARTED) == 0) return ESP_ERR_INVALID_STATE;
     xz_chat_listening_mode_t listening_mode = chat->enable_realtime_listening? XZ_LISTENING_MODE_REALTIME: XZ_LISTENING_MODE_AUTO_STOP;
+    if(flags & (XZ_FLAG_SESS_SPEAKING|XZ_FLAG_SESS_LEAVING) || 0 == (flags & XZ_FLAGS_IN_SESS))
+        lat_turn_begin(chat, req);
     if(0 == (flags & XZ_FLAGS_IN_SESS))
         return __enter_session_then_listen(chat, listening_mode);
     if(flags & XZ_FLAG_SESS_SPEAKING)
@@ -357,7 +970,8 @@ static esp_err_t _toggle_chat_state(xz_chat_t* chat) {
     return ESP_ERR_INVALID_STATE;
 }
 void xz_chat_toggle_chat_state(xz_chat_t* chat) {
-    CMD(chat, _toggle_chat_state, chat);
+    lat_request(chat);
+    CMD_EX(chat, XZ_CMD_LANE_HI, true, _toggle_chat_state, chat);
 }
 
 esp_err_t xz_chat_destroy(xz_chat_t* chat) {
@@ -366,27 +980,50 @@ esp_err_t xz_chat_destroy(xz_chat_t* chat) {
         ESP_LOGE(TAG, "Cannot call xz_chat_destroy in its own event callback.");
         return ESP_FAIL;
     }
+    if(chat->drain_timer) { xTimerDelete(chat->drain_timer, portMAX_DELAY); chat->drain_timer = NULL; }
+    // http task posts results to the main task, so it goes first. a request in flight may take a while
+    atomic_store(&chat->http_req, 0);
+    esp_err_t ret0 = term_task_wait(chat->http_task, chat->eg, XZ_EG_HTTP_TASK_STOPPED_BIT, pdMS_TO_TICKS(15000));
+    RELEASE_TASK(chat->http_task);
+#ifdef CONFIG_XZ_CHAT_REACTOR
+    // the reactor sleeps in select, not on a task notification. it leaves after the commands already queued
+    if(chat->main_task) {
+        CMD(chat, _reactor_exit, chat);
+        if(!(XZ_EG_MAIN_TASK_STOPPED_BIT & xEventGroupWaitBits(chat->eg, XZ_EG_MAIN_TASK_STOPPED_BIT, pdFALSE, pdFALSE, pdMS_TO_TICKS(5000)))) {
+            ESP_LOGW(TAG, "main task busy, deleting it");
+        }
+    }
+#endif
     RELEASE_TASK(chat->main_task);
 
-    esp_err_t ret0= term_task_wait(chat->read_audio_task, chat->eg, XZ_EG_READ_AUDIO_TASK_STOPPED_BIT, pdMS_TO_TICKS(5000));
+    ret0 = term_task_wait(chat->read_audio_task, chat->eg, XZ_EG_READ_AUDIO_TASK_STOPPED_BIT, pdMS_TO_TICKS(5000)) || ret0;
     RELEASE_TASK(chat->read_audio_task);
+    ret0 = term_task_wait(chat->send_audio_task, chat->eg, XZ_EG_SEND_AUDIO_TASK_STOPPED_BIT, pdMS_TO_TICKS(5000)) || ret0;
+    RELEASE_TASK(chat->send_audio_task);
+    xz_chat_trace_free(chat);
 
-    esp_err_t ret1;
-    switch(chat->prot_type) {
-        case XZ_PROT_TYPE_WS: ret1 = xz_ws_prot_destroy((xz_ws_prot_ctx_t*) chat->prot_ctx); break;
-        case XZ_PROT_TYPE_MQTT: ret1 = xz_mqtt_prot_destroy((xz_mqtt_prot_ctx_t*) chat->prot_ctx); break;
-        default: ret1= ESP_ERR_INVALID_ARG;
-    }
-    if(!ret1) chat->prot_ctx = NULL;
+    esp_err_t ret1 = destroy_prot_ctx(chat);
 
     if(chat->eg) {vEventGroupDelete(chat->eg); chat->eg = NULL;}
 
     if(chat->cmd_q) { vQueueDelete(chat->cmd_q);chat->cmd_q = NULL; }
+    if(chat->cmd_hi_q) { vQueueDelete(chat->cmd_hi_q);chat->cmd_hi_q = NULL; }
+    if(chat->cmd_sem) { vSemaphoreDelete(chat->cmd_sem);chat->cmd_sem = NULL; }
+#ifdef CONFIG_XZ_CHAT_REACTOR
+    if(chat->wake_fd >= 0) { close(chat->wake_fd); chat->wake_fd = -1; }
+#endif
+    if(chat->send_audio_q) { drain_send_audio_q(chat); vQueueDelete(chat->send_audio_q); chat->send_audio_q = NULL; }
 
-    RELEASE(chat->version_check_response);
-    RELEASE(chat->prot_conf);
-    RELEASE(chat->send_buf);
-    RELEASE(chat->session_buf);
+    CHAT_FREE(chat, resp, chat->version_check_response);
+    CHAT_FREE(chat, prot_conf, chat->prot_conf);
+    XZ_BUF_RELEASE(&chat->allocator, chat->send_buf);
+    chat_session_buf_release(chat);
+#ifdef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    xz_pool_deinit(&chat->pools.resp);
+    xz_pool_deinit(&chat->pools.prot_conf);
+    xz_pool_deinit(&chat->pools.session);
+    xz_pool_deinit(&chat->pools.mcp);
+#endif
     
     esp_err_t ret = ret0 || ret1;
     if(ret) {
@@ -398,6 +1035,7 @@ esp_err_t xz_chat_destroy(xz_chat_t* chat) {
 }
 
 static esp_err_t _start_tts(xz_chat_t* chat) {
+    cancel_playback_drain(chat); // next sentence came before the last one drained, stay speaking
     if(!chat_has_any_flag(chat, XZ_FLAGS_IN_SESS)) return ESP_ERR_INVALID_STATE;
     if(chat->listening_mode==XZ_LISTENING_MODE_AUTO_STOP) {
         chat_clear_flag(chat, XZ_FLAG_SESS_LISTENING);
@@ -413,62 +1051,129 @@ static esp_err_t _start_tts(xz_chat_t* chat) {
 
 static esp_err_t _stop_tts(xz_chat_t* chat) {
     if(!chat_has_any_flag(chat, XZ_FLAG_SESS_SPEAKING)) return ESP_ERR_INVALID_STATE;
+    if(chat_has_any_flag(chat, XZ_FLAG_PLAYBACK_DRAINING)) return ESP_OK;
 
-    // wait for the speaker to empty its buffer
-    vTaskDelay(pdMS_TO_TICKS(500));
-    chat_clear_flag(chat, XZ_FLAG_SESS_SPEAKING);
-    if(chat->listening_mode == XZ_LISTENING_MODE_MANUAL_STOP) {
-        return ESP_OK;
-    }
-    esp_err_t ret = __start_listening(chat, chat->enable_realtime_listening? XZ_LISTENING_MODE_REALTIME: XZ_LISTENING_MODE_AUTO_STOP);
-    if(ret) {
-        // if server send tts.stop and close connection, then sending start listening msg will fail.
-        chat_set_flag(chat, XZ_FLAG_SESS_LEAVING);
-        _exit_session(chat);
-        return ret;
+    int listening_mode = XZ_DRAIN_NO_LISTENING;
+    if(chat->listening_mode != XZ_LISTENING_MODE_MANUAL_STOP) {
+        listening_mode = chat->enable_realtime_listening? XZ_LISTENING_MODE_REALTIME: XZ_LISTENING_MODE_AUTO_STOP;
     }
-    return ESP_OK;
+    return __listen_after_playback(chat, listening_mode, 500);
 }
 
-static esp_err_t _process_mcp(xz_chat_t* chat, char* buf, int len) {
+static esp_err_t _process_mcp(xz_chat_t* chat, char* buf, intptr_t len) {
     // todo: process the string in buf and invoke responding mcp function
-    free(buf);
+    CHAT_FREE(chat, mcp, buf);
     return ESP_OK;
 }
 
-void xz_prot_process_json(xz_chat_t* chat, char*  json,  int len,  char*  type,  int tlen) {
+/*
+ perfect hash over the known message types: (5*type[0] + 4*type[1] + len) & 15.
+ recompute the slots if a type is added, a wrong slot only makes the type unknown.
+*/
+#define MSG_TYPE_HASH(s, n) ((5*(uint8_t)(s)[0] + 4*(uint8_t)(s)[1] + (n)) & 15)
+static const struct {
+    const char* name;
+    uint8_t len;
+    uint8_t type;
+} msg_type_table[16] = {
+    [0]  = {"mcp",     3, XZ_MSG_MCP},
+    [1]  = {"hello",   5, XZ_MSG_HELLO},
+    [2]  = {"stt",     3, XZ_MSG_STT},
+    [6]  = {"goodbye", 7, XZ_MSG_GOODBYE},
+    [7]  = {"tts",     3, XZ_MSG_TTS},
+    [9]  = {"system",  6, XZ_MSG_SYSTEM},
+    [10] = {"alert",   5, XZ_MSG_ALERT},
+    [12] = {"iot",     3, XZ_MSG_IOT},
+    [15] = {"llm",     3, XZ_MSG_LLM},
+};
+
+xz_msg_type_t xz_prot_msg_type(const char* type, int tlen) {
+    if(tlen < 2) return XZ_MSG_UNKNOWN;
+    int h = MSG_TYPE_HASH(type, tlen);
+    if(msg_type_table[h].len == tlen && 0 == memcmp(msg_type_table[h].name, type, tlen))
+        return msg_type_table[h].type;
+    return XZ_MSG_UNKNOWN;
+}
+
+static inline xz_chat_span_t json_span(const xz_json_idx_t* idx, const char* path) {
+    xz_chat_span_t sp = {0};
+    sp.s = xz_json_idx_str(idx, path, &sp.len);
+    return sp;
+}
+
+void xz_prot_process_json(xz_chat_t* chat, const xz_json_idx_t* idx, xz_msg_type_t mt, char*  type,  int tlen) {
     const char* s; int slen;
-    if(QESTREQL(type, "tts")) {
-        if((s = emjson_find_string(json, len, "$.state"))) {
+    int typed_event = -1;
+    xz_chat_event_data_t* ed = &chat->event_data;
+    CHAT_STAT_ADD(chat, rx_msgs, 1);
+    ed->json = (char*)idx->json;
+    ed->len = idx->len;
+    ed->idx = idx;
+    ed->type = type;
+    ed->type_len = tlen;
+    memset(&ed->llm, 0, sizeof(ed->llm));
+
+    switch(mt) {
+    case XZ_MSG_TTS:
+        if((s = xz_json_idx_str(idx, "$.state", NULL))) {
             if(QESTREQL(s, "start")) {
-                CMD(chat, _start_tts, chat);
+                chat_lat_mark(chat, XZ_LAT_TTS_START);
+                CMD_EX(chat, XZ_CMD_LANE_NORMAL, true, _start_tts, chat);
+                typed_event = XZ_EVENT_TTS_START;
             } else if(QESTREQL(s, "stop")) {
-                CMD(chat, _stop_tts, chat);
+                chat_lat_mark(chat, XZ_LAT_TTS_STOP);
+                CMD_EX(chat, XZ_CMD_LANE_NORMAL, true, _stop_tts, chat);
+                typed_event = XZ_EVENT_TTS_STOP;
+            } else if(QESTREQL(s, "sentence_start")) {
+                ed->text = json_span(idx, "$.text");
+                typed_event = XZ_EVENT_TTS_SENTENCE;
             }
         }
-    } else if(QESTREQL(type, "mcp")) {
-        if(mjson_find(json, len, "$.payload", &s, &slen)==MJSON_TOK_OBJECT) {
-            CMD(chat, _process_mcp, chat, strndup(s, slen), (void*)slen);
-        }
-    } /*else if(QESTREQL(type, "system")) {
-        if(emjson_locate_string(json, len, "$.command", &s, &slen)) {
-            ESP_LOGW(TAG, "recv system command: %.*s", slen, s);
-            // if(QESTREQL(s, "reboot")) {
-            //     esp_restart();
-            // }
+        break;
+    case XZ_MSG_STT:
+        chat_lat_mark(chat, XZ_LAT_LISTEN_STOP); // server side vad ended the speech
+        ed->text = json_span(idx, "$.text");
+        typed_event = XZ_EVENT_STT_TEXT;
+        break;
+    case XZ_MSG_LLM:
+        ed->llm.emotion = json_span(idx, "$.emotion");
+        ed->llm.text = json_span(idx, "$.text");
+        if(ed->llm.emotion.s) typed_event = XZ_EVENT_LLM_EMOTION;
+        break;
+    case XZ_MSG_SYSTEM:
+        ed->command = json_span(idx, "$.command");
+        if(ed->command.s) typed_event = XZ_EVENT_SYSTEM_COMMAND;
+        break;
+    case XZ_MSG_GOODBYE:
+        ed->session_id = json_span(idx, "$.session_id");
+        typed_event = XZ_EVENT_GOODBYE;
+        break;
+    case XZ_MSG_MCP:
+        if(xz_json_idx_find(idx, "$.payload", &s, &slen)==XZ_JSON_OBJECT) {
+            char* payload = CHAT_ALLOC(chat, mcp, slen + 1);
+            if(payload) {
+                memcpy(payload, s, slen);
+                payload[slen] = 0;
+                cmd_q_el_t el = {(_cmd_el_fn_t)_process_mcp, chat, payload, (void*)(intptr_t)slen};
+                if(chat_post_cmd(chat, XZ_CMD_LANE_NORMAL, &el, false, portMAX_DELAY))
+                    CHAT_FREE(chat, mcp, payload); // _process_mcp owns it only once posted
+            }
         }
-    }*/
+        break;
+    default:
+        break;
+    }
 
-    chat->event_data.json = json;
-    chat->event_data.len = len;
-    chat->event_data.type = type;
-    chat->event_data.type_len = tlen;
+    if(typed_event >= 0) dispatch_event(chat, typed_event);
     dispatch_event(chat, XZ_EVENT_JSON_RECEIVED);
 }
 
 static esp_err_t _start_manual_listening(xz_chat_t* chat) {
     int flags = atomic_load(&chat->flags);
+    uint32_t req = lat_take_request(chat);
     if((flags & XZ_FLAG_STARTED) == 0) return ESP_ERR_INVALID_STATE;
+    if(flags & (XZ_FLAG_SESS_SPEAKING|XZ_FLAG_SESS_LEAVING) || 0 == (flags & XZ_FLAGS_IN_SESS))
+        lat_turn_begin(chat, req);
     if((flags & XZ_FLAGS_IN_SESS) == 0)
         return __enter_session_then_listen(chat, XZ_LISTENING_MODE_MANUAL_STOP);
     if(flags & XZ_FLAG_SESS_SPEAKING)
@@ -478,13 +1183,15 @@ static esp_err_t _start_manual_listening(xz_chat_t* chat) {
     return ESP_ERR_INVALID_STATE;
 }
 void xz_chat_start_manual_listening(xz_chat_t* chat) {
-    CMD(chat, _start_manual_listening, chat);
+    lat_request(chat);
+    CMD_EX(chat, XZ_CMD_LANE_HI, false, _start_manual_listening, chat);
 }
 
 static esp_err_t _stop_manual_listening(xz_chat_t* chat) {
     if(chat_has_any_flag(chat, XZ_FLAG_SESS_LISTENING)) return ESP_ERR_INVALID_STATE;
     esp_err_t ret = xz_prot_send_stop_listening(chat);
     if(!ret) {
+        chat_lat_mark(chat, XZ_LAT_LISTEN_STOP);
         chat_set_flag(chat, XZ_FLAG_SESS_LEAVING);
         chat_clear_flag(chat, XZ_FLAG_SESS_LISTENING);
     }
@@ -492,7 +1199,26 @@ static esp_err_t _stop_manual_listening(xz_chat_t* chat) {
 }
 
 void xz_chat_stop_manual_listening(xz_chat_t* chat) {
-    CMD(chat, _stop_manual_listening, chat);
+    CMD_EX(chat, XZ_CMD_LANE_HI, false, _stop_manual_listening, chat);
+}
+
+esp_err_t xz_chat_post_cmd(xz_chat_t* chat, xz_chat_cmd_t cmd) {
+    static const struct {
+        void* fn;
+        uint8_t lane;
+        bool coalesce;
+        bool request; // stamps XZ_LAT_REQUEST
+    } cmds[] = {
+        [XZ_CHAT_CMD_NEW_SESSION] =             {_new_session,             XZ_CMD_LANE_HI,     true,  true},
+        [XZ_CHAT_CMD_EXIT_SESSION] =            {_exit_session,            XZ_CMD_LANE_HI,     true,  false},
+        [XZ_CHAT_CMD_TOGGLE_CHAT_STATE] =       {_toggle_chat_state,       XZ_CMD_LANE_HI,     true,  true},
+        [XZ_CHAT_CMD_START_MANUAL_LISTENING] =  {_start_manual_listening,  XZ_CMD_LANE_HI,     false, true},
+        [XZ_CHAT_CMD_STOP_MANUAL_LISTENING] =   {_stop_manual_listening,   XZ_CMD_LANE_HI,     false, false},
+    };
+    if(cmd < 0 || cmd >= sizeof(cmds)/sizeof(cmds[0])) return ESP_ERR_INVALID_ARG;
+    if(cmds[cmd].request) lat_request(chat);
+    cmd_q_el_t el = {(_cmd_el_fn_t)cmds[cmd].fn, chat};
+    return chat_post_cmd(chat, cmds[cmd].lane, &el, cmds[cmd].coalesce, 0);
 }
 
 bool xz_chat_is_listening(xz_chat_t* chat) {
@@ -511,6 +1237,14 @@ void xz_chat_set_audio_cb(xz_chat_t* chat, xz_chat_audio_cb_t cb) {
     chat->audio_cb = cb;
 }
 
+void xz_chat_set_audio_loss_cb(xz_chat_t* chat, xz_chat_audio_loss_cb_t cb) {
+    chat->audio_loss_cb = cb;
+}
+
+uint32_t xz_chat_get_audio_lost_frames(xz_chat_t* chat) {
+    return atomic_load(&chat->audio_lost_frames);
+}
+
 void xz_chat_set_event_cb(xz_chat_t* chat, xz_chat_event_cb_t cb) {
     chat->event_cb = cb;
 }
@@ -5,10 +5,10 @@
 
 const static char* const TAG = "xz_actv";
 
-esp_err_t xz_http_client_set_headers(esp_http_client_handle_t client, const char* lang) {
+esp_err_t xz_http_client_set_headers(esp_http_client_handle_t client, const char* lang, const char* device_id, const char* client_id) {
     return esp_http_client_set_header(client, "actvation-Version", "1")
-        || esp_http_client_set_header(client, "Device-Id", xz_board_info_mac())
-        || esp_http_client_set_header(client, "Client-Id", xz_board_info_uuid())
+        || esp_http_client_set_header(client, "Device-Id", device_id)
+        || esp_http_client_set_header(client, "Client-Id", client_id)
         || esp_http_client_set_header(client, "User-Agent", XZ_BOARD_NAME "/" XZ_VER)
         || esp_http_client_set_header(client, "Accept-Language", lang)
         || esp_http_client_set_header(client, "Content-Type", "application/json");
@@ -20,7 +20,12 @@ esp_err_t xz_http_client_version_check(esp_http_client_handle_t client, const ch
     char* lang = NULL;
     esp_http_client_get_header(client, "Accept-Language", &lang);
     if(lang==NULL || *lang==0) lang="en-US";
-    len = xz_board_info_printf(buf, len, lang);
+    char* device_id = NULL, *client_id = NULL; // identity of this instance, set with the headers
+    esp_http_client_get_header(client, "Device-Id", &device_id);
+    esp_http_client_get_header(client, "Client-Id", &client_id);
+    if(device_id==NULL || *device_id==0) device_id = (char*)xz_board_info_mac();
+    if(client_id==NULL || *client_id==0) client_id = (char*)xz_board_info_uuid();
+    len = xz_board_info_printf(buf, len, lang, device_id, client_id);
     ESP_LOGD(TAG, "version_check post: %.*s", len, buf);
     ESP_RETURN_ON_ERROR(http_client_util_post(client, buf, &len, buf, len, url), TAG, "send post");
     ESP_LOGI(TAG, "version_check resp: %.*s", len, buf);
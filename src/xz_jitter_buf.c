@@ -0,0 +1,100 @@
+#include "xz_jitter_buf.h"
+#include <stdlib.h>
+#include <string.h>
+
+// slots are a ring starting at head, which holds next_seq. seq must be within the window
+static inline int slot_of(xz_jitter_buf_t* jb, uint32_t seq) {
+    return (jb->head + (seq - jb->next_seq)) % jb->slots;
+}
+
+esp_err_t xz_jitter_buf_init(xz_jitter_buf_t* jb, const xz_jitter_buf_config_t* conf, const xz_chat_allocator_t* alloc) {
+    if(conf->depth <= 0 || conf->window < conf->depth || conf->frame_size <= 0) return ESP_ERR_INVALID_ARG;
+    memset(jb, 0, sizeof(xz_jitter_buf_t));
+    jb->slots = conf->window;
+    jb->depth = conf->depth;
+    jb->frame_size = conf->frame_size;
+    jb->alloc = alloc;
+    if(!(jb->data=xz_buf_alloc(alloc, XZ_BUF_AUDIO_RX, jb->slots * jb->frame_size)) || !(jb->lens=xz_buf_alloc(alloc, XZ_BUF_AUDIO_RX, jb->slots * sizeof(int)))) {
+        xz_jitter_buf_deinit(jb);
+        return ESP_ERR_NO_MEM;
+    }
+    xz_jitter_buf_reset(jb);
+    return ESP_OK;
+}
+
+void xz_jitter_buf_deinit(xz_jitter_buf_t* jb) {
+    XZ_BUF_RELEASE(jb->alloc, jb->data);
+    XZ_BUF_RELEASE(jb->alloc, jb->lens);
+    jb->slots = 0;
+}
+
+void xz_jitter_buf_reset(xz_jitter_buf_t* jb) {
+    for(int i=0; i<jb->slots; i++) jb->lens[i] = -1;
+    jb->count = 0;
+    jb->head = 0;
+    jb->skipped = 0;
+    jb->started = false;
+    jb->released = false;
+    jb->primed = false;
+}
+
+// drop the slot at next_seq and move on, returns true if it held a frame
+static inline bool advance(xz_jitter_buf_t* jb) {
+    int i = jb->head;
+    jb->head = (jb->head + 1) % jb->slots;
+    jb->next_seq ++;
+    if(jb->lens[i] < 0) return false;
+    jb->lens[i] = -1;
+    jb->count --;
+    return true;
+}
+
+esp_err_t xz_jitter_buf_put(xz_jitter_buf_t* jb, uint32_t seq, const uint8_t* data, int len) {
+    if(len > jb->frame_size) return ESP_ERR_INVALID_SIZE;
+    if(!jb->started) {
+        jb->next_seq = jb->last_seq = seq;
+        jb->started = true;
+    }
+    int32_t d = (int32_t)(seq - jb->next_seq);
+    if(d < 0) {
+        // before anything is released, an earlier frame can move the playout position back
+        if(jb->released || (int32_t)(jb->last_seq - seq) >= jb->slots) return ESP_ERR_INVALID_STATE;
+        jb->head = (jb->head + d % jb->slots + jb->slots) % jb->slots;
+        jb->next_seq = seq;
+        d = 0;
+    }
+    if((int32_t)(seq - jb->last_seq) > 0) jb->last_seq = seq;
+    while(d >= jb->slots) { // too far ahead, give up the oldest, they are reported as lost by the next pop
+        advance(jb);
+        jb->skipped ++;
+        d --;
+    }
+    int i = slot_of(jb, seq);
+    if(jb->lens[i] >= 0) return ESP_ERR_INVALID_STATE;
+    memcpy(&jb->data[i * jb->frame_size], data, len);
+    jb->lens[i] = len;
+    jb->count ++;
+    if(jb->count >= jb->depth) jb->primed = true;
+    return ESP_OK;
+}
+
+int xz_jitter_buf_pop(xz_jitter_buf_t* jb, uint8_t** data, int* lost) {
+    *lost = 0;
+    if(!jb->primed) return 0;
+    if(jb->count == 0) { // underrun, buffer up again
+        jb->primed = false;
+        return 0;
+    }
+    *lost = jb->skipped;
+    jb->skipped = 0;
+    while(jb->lens[jb->head] < 0) { // missing, later frames are already here
+        advance(jb);
+        (*lost) ++;
+    }
+    int i = jb->head;
+    int len = jb->lens[i];
+    *data = &jb->data[i * jb->frame_size];
+    advance(jb);
+    jb->released = true;
+    return len;
+}
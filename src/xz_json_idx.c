@@ -0,0 +1,221 @@
+#include "xz_json_idx.h"
+#include <string.h>
+#include <stdlib.h>
+
+typedef struct {
+    const char* s;
+    int len;
+    int i;
+    xz_json_idx_t* idx;
+} parser_t;
+
+#define NO_ENTRY (-2) // value is not indexed
+
+static int parse_value(parser_t* p, int entry, int depth);
+
+static inline void skip_ws(parser_t* p) {
+    while(p->i < p->len && (p->s[p->i]==' ' || p->s[p->i]=='\t' || p->s[p->i]=='\n' || p->s[p->i]=='\r')) p->i++;
+}
+
+// s[i] is the opening quote, on return i is past the closing quote
+static int parse_string(parser_t* p, const char** str, int* n) {
+    int start = ++ p->i;
+    while(p->i < p->len) {
+        char c = p->s[p->i];
+        if(c == '\\') {
+            p->i += 2;
+        } else if(c == '"') {
+            *str = &p->s[start];
+            *n = p->i - start;
+            p->i ++;
+            return 0;
+        } else {
+            p->i ++;
+        }
+    }
+    return -1;
+}
+
+static inline bool is_number_char(char c) {
+    return (c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.' || c == 'e' || c == 'E';
+}
+
+static int parse_literal(parser_t* p, const char* lit) {
+    int n = strlen(lit);
+    if(p->i + n > p->len || memcmp(&p->s[p->i], lit, n)) return -1;
+    p->i += n;
+    return 0;
+}
+
+// s[i] is '{', self is the entry index of this object, members are indexed only if self != NO_ENTRY
+static int parse_object(parser_t* p, int self, int depth) {
+    xz_json_idx_t* idx = p->idx;
+    p->i ++;
+    skip_ws(p);
+    if(p->i < p->len && p->s[p->i] == '}') {
+        p->i ++;
+        return 0;
+    }
+    while(p->i < p->len) {
+        skip_ws(p);
+        if(p->i >= p->len || p->s[p->i] != '"') return -1;
+        const char* key; int key_len;
+        if(parse_string(p, &key, &key_len)) return -1;
+        skip_ws(p);
+        if(p->i >= p->len || p->s[p->i] != ':') return -1;
+        p->i ++;
+        skip_ws(p);
+        int entry = NO_ENTRY;
+        if(self != NO_ENTRY && depth <= XZ_JSON_IDX_MAX_DEPTH && idx->n < XZ_JSON_IDX_MAX_ENTRIES) {
+            entry = idx->n ++;
+            idx->e[entry].key = key;
+            idx->e[entry].key_len = key_len;
+            idx->e[entry].parent = self;
+        }
+        if(parse_value(p, entry, depth)) return -1;
+        skip_ws(p);
+        if(p->i >= p->len) return -1;
+        char c = p->s[p->i++];
+        if(c == '}') return 0;
+        if(c != ',') return -1;
+    }
+    return -1;
+}
+
+static int parse_array(parser_t* p, int depth) {
+    p->i ++;
+    skip_ws(p);
+    if(p->i < p->len && p->s[p->i] == ']') {
+        p->i ++;
+        return 0;
+    }
+    while(p->i < p->len) {
+        skip_ws(p);
+        if(parse_value(p, NO_ENTRY, depth)) return -1;
+        skip_ws(p);
+        if(p->i >= p->len) return -1;
+        char c = p->s[p->i++];
+        if(c == ']') return 0;
+        if(c != ',') return -1;
+    }
+    return -1;
+}
+
+static int parse_value(parser_t* p, int entry, int depth) {
+    if(p->i >= p->len) return -1;
+    const char* val = &p->s[p->i];
+    int start = p->i;
+    int ret;
+    xz_json_type_t type;
+    switch(p->s[p->i]) {
+    case '"': {
+        int n;
+        ret = parse_string(p, &val, &n);
+        if(entry >= 0) {
+            p->idx->e[entry].val = val;
+            p->idx->e[entry].val_len = n;
+            p->idx->e[entry].type = XZ_JSON_STRING;
+        }
+        return ret;
+    }
+    case '{':
+        if(depth >= XZ_JSON_IDX_MAX_NESTING) return -1;
+        type = XZ_JSON_OBJECT;
+        ret = parse_object(p, entry, depth + 1);
+        break;
+    case '[':
+        if(depth >= XZ_JSON_IDX_MAX_NESTING) return -1;
+        type = XZ_JSON_ARRAY;
+        ret = parse_array(p, depth + 1);
+        break;
+    case 't':
+        type = XZ_JSON_TRUE;
+        ret = parse_literal(p, "true");
+        break;
+    case 'f':
+        type = XZ_JSON_FALSE;
+        ret = parse_literal(p, "false");
+        break;
+    case 'n':
+        type = XZ_JSON_NULL;
+        ret = parse_literal(p, "null");
+        break;
+    default:
+        type = XZ_JSON_NUMBER;
+        while(p->i < p->len && is_number_char(p->s[p->i])) p->i++;
+        ret = p->i > start? 0: -1;
+    }
+    if(entry >= 0) {
+        p->idx->e[entry].val = val;
+        p->idx->e[entry].val_len = p->i - start;
+        p->idx->e[entry].type = type;
+    }
+    return ret;
+}
+
+esp_err_t xz_json_idx_build(xz_json_idx_t* idx, const char* json, int len) {
+    parser_t p = { .s = json, .len = len, .i = 0, .idx = idx };
+    idx->json = json;
+    idx->len = len;
+    idx->n = 0;
+    skip_ws(&p);
+    if(p.i >= len || json[p.i] != '{' || parse_object(&p, -1, 1)) {
+        idx->n = 0;
+        return ESP_ERR_INVALID_ARG;
+    }
+    return ESP_OK;
+}
+
+void xz_json_idx_rebase(xz_json_idx_t* idx, const char* copy) {
+    for(int k=0; k<idx->n; k++) {
+        idx->e[k].key = copy + (idx->e[k].key - idx->json);
+        idx->e[k].val = copy + (idx->e[k].val - idx->json);
+    }
+    idx->json = copy;
+}
+
+xz_json_type_t xz_json_idx_find(const xz_json_idx_t* idx, const char* path, const char** val, int* len) {
+    if(path[0]=='$' && path[1]=='.') path += 2;
+    int parent = -1;
+    int found = -1;
+    while(*path) {
+        const char* dot = strchr(path, '.');
+        int seg_len = dot? dot - path: strlen(path);
+        found = -1;
+        for(int k=parent+1; k<idx->n; k++) { // members always come after their object
+            const xz_json_idx_entry_t* e = &idx->e[k];
+            if(e->parent == parent && e->key_len == seg_len && 0==memcmp(e->key, path, seg_len)) {
+                found = k;
+                break;
+            }
+        }
+        if(found < 0) return XZ_JSON_NONE;
+        parent = found;
+        path += seg_len;
+        if(*path == '.') path ++;
+    }
+    if(found < 0) return XZ_JSON_NONE;
+    if(val) *val = idx->e[found].val;
+    if(len) *len = idx->e[found].val_len;
+    return idx->e[found].type;
+}
+
+const char* xz_json_idx_str(const xz_json_idx_t* idx, const char* path, int* len) {
+    const char* s; int n;
+    if(xz_json_idx_find(idx, path, &s, &n) != XZ_JSON_STRING) return NULL;
+    if(len) *len = n;
+    return s;
+}
+
+bool xz_json_idx_streq(const xz_json_idx_t* idx, const char* path, const char* str) {
+    int n;
+    const char* s = xz_json_idx_str(idx, path, &n);
+    return s && n == strlen(str) && 0 == memcmp(s, str, n);
+}
+
+bool xz_json_idx_i32(const xz_json_idx_t* idx, const char* path, int* out) {
+    const char* s;
+    if(xz_json_idx_find(idx, path, &s, NULL) != XZ_JSON_NUMBER) return false;
+    *out = (int)strtol(s, NULL, 10);
+    return true;
+}
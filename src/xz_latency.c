@@ -0,0 +1,51 @@
+#include "xz_latency.h"
+
+static const uint32_t bucket_upper[XZ_LAT_BUCKETS] = {
+    20, 50, 100, 150, 200, 300, 400, 500, 750, 1000, 1500, 2000, 3000, 5000, 10000, UINT32_MAX,
+};
+
+static const struct {
+    uint8_t from, to;
+} spans[XZ_LAT_SPANS] = {
+    [XZ_LAT_SPAN_QUEUE] =               {XZ_LAT_REQUEST,     XZ_LAT_DEQUEUE},
+    [XZ_LAT_SPAN_HELLO] =               {XZ_LAT_HELLO_SENT,  XZ_LAT_HELLO_RECEIVED},
+    [XZ_LAT_SPAN_SETUP] =               {XZ_LAT_DEQUEUE,     XZ_LAT_LISTEN_START},
+    [XZ_LAT_SPAN_WAKE_TO_UPLINK] =      {XZ_LAT_REQUEST,     XZ_LAT_FIRST_UPLINK},
+    [XZ_LAT_SPAN_SPEECH_END_TO_TTS] =   {XZ_LAT_LISTEN_STOP, XZ_LAT_TTS_START},
+    [XZ_LAT_SPAN_SPEECH_END_TO_AUDIO] = {XZ_LAT_LISTEN_STOP, XZ_LAT_FIRST_DOWNLINK},
+    [XZ_LAT_SPAN_TTS] =                 {XZ_LAT_TTS_START,   XZ_LAT_TTS_STOP},
+};
+
+uint32_t xz_lat_bucket_upper_ms(int bucket) {
+    if(bucket < 0 || bucket >= XZ_LAT_BUCKETS) return UINT32_MAX;
+    return bucket_upper[bucket];
+}
+
+void xz_lat_hist_add(xz_lat_hist_t* h, uint32_t ms) {
+    int b = 0;
+    while(ms > bucket_upper[b]) b++; // the last bound catches everything
+    h->bucket[b]++;
+    h->count++;
+    h->sum_ms += ms;
+    if(ms > h->max_ms) h->max_ms = ms;
+}
+
+uint32_t xz_lat_hist_percentile(const xz_lat_hist_t* h, int pct) {
+    if(h->count == 0) return 0;
+    uint64_t rank = ((uint64_t)h->count * pct + 99) / 100; // 1 based
+    if(rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for(int b=0; b<XZ_LAT_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if(seen >= rank) return bucket_upper[b] < h->max_ms? bucket_upper[b]: h->max_ms;
+    }
+    return h->max_ms;
+}
+
+void xz_lat_stats_add(xz_lat_stats_t* s, const xz_lat_record_t* r) {
+    for(int i=0; i<XZ_LAT_SPANS; i++) {
+        uint32_t from = r->ms[spans[i].from], to = r->ms[spans[i].to];
+        if(!from || !to || (int32_t)(to - from) < 0) continue;
+        xz_lat_hist_add(&s->span[i], to - from);
+    }
+}
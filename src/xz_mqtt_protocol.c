@@ -9,7 +9,11 @@
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
+#include <errno.h>
+#include <inttypes.h>
 #include "task_util.h"
+#include "esp_timer.h"
+#include "xz_tls_transport.h"
 static const char* const TAG = "xz_mqtt";
 
 #define OPUS_FRAME_DURATION_MS 60
@@ -26,7 +30,18 @@ void xz_mqtt_prot_config_fill_rest_from_response(xz_mqtt_prot_config_t* conf, st
 }
 
 void xz_mqtt_prot_config_set_default(xz_mqtt_prot_config_t* conf) {
+    conf->rx_msg_max_size = 8192;
+#ifdef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    conf->udp_conf.recv_buf_size = CONFIG_XZ_CHAT_STATIC_UDP_RECV_BUF_SIZE;
+#else
     conf->udp_conf.recv_buf_size = 15000;
+#endif
+    conf->udp_conf.jitter_buf = (xz_jitter_buf_config_t){
+            .depth = 0, // disabled
+            .window = 6,
+            .frame_size = 1024,
+        };
+    conf->udp_conf.dns_ttl_ms = 10*60*1000;
     conf->udp_conf.task_conf = (capped_task_config_t){
             .prio = 5,
             .stack = 1024*3,
@@ -50,34 +65,33 @@ void xz_mqtt_prot_config_set_default(xz_mqtt_prot_config_t* conf) {
 
 static esp_err_t xz_mqtt_prot_send_msg(xz_chat_t* chat, const char* buf, int len) {
     xz_mqtt_prot_ctx_t* ctx = (xz_mqtt_prot_ctx_t*)chat->prot_ctx;
+    CHAT_TRACE(chat, XZ_TRACE_TX_JSON, 0, 0, 0, buf, len);
     return esp_mqtt_client_publish(ctx->mqtt_hd, ctx->pub_topic, buf, len, 0, 0)>=0? ESP_OK: ESP_FAIL;
 }
 
-static esp_err_t xz_mqtt_prot_send_data(xz_chat_t* chat, const void* buf, int len) {
+static esp_err_t xz_mqtt_prot_send_data(xz_chat_t* chat, xz_tx_audio_pck_t* audio) {
     xz_mqtt_prot_ctx_t* ctx = (xz_mqtt_prot_ctx_t*)chat->prot_ctx;
+    int len = audio->len;
     char* nonce = ctx->udp.aes_nonce;
     *(uint16_t*)&nonce[2] = htons(len);
     *(uint32_t*)&nonce[8] = htonl(0); // timestamp
     *(uint32_t*)&nonce[12] = htonl(++ ctx->udp.local_sequence);
 
     int needed_size = ctx->udp.aes_nonce_len + len;
-    if(ctx->udp.encrypted_buf_size < needed_size) {
-        void* tmp = realloc(ctx->udp.encrypted_buf, needed_size);
-        if(tmp) {
-            ctx->udp.encrypted_buf = tmp;
-            ctx->udp.encrypted_buf_size = needed_size;
-        } else {
-            return ESP_ERR_NO_MEM;
-        }
+    uint8_t* pck;
+    if(audio->writable && audio->headroom >= ctx->udp.aes_nonce_len) { // nonce header and encryption in the caller's buffer
+        pck = (uint8_t*)audio->buf - ctx->udp.aes_nonce_len;
+    } else if(!(pck=chat_tx_buf(chat, &ctx->udp.encrypted_buf, &ctx->udp.encrypted_buf_size, needed_size))) {
+        return ESP_ERR_NO_MEM;
     }
-    memcpy(ctx->udp.encrypted_buf, nonce, ctx->udp.aes_nonce_len);
+    memcpy(pck, nonce, ctx->udp.aes_nonce_len);
     size_t nc_off = 0;
     uint8_t stream_block[16] = {0};
-    if(0!= mbedtls_aes_crypt_ctr(&ctx->udp.aes_ctx, len, &nc_off, (uint8_t*)nonce, stream_block, buf, &ctx->udp.encrypted_buf[ctx->udp.aes_nonce_len])) {// invalid input length
+    if(0!= mbedtls_aes_crypt_ctr(&ctx->udp.aes_ctx, len, &nc_off, (uint8_t*)nonce, stream_block, audio->buf, &pck[ctx->udp.aes_nonce_len])) {// invalid input length
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return ESP_FAIL; 
     }
-    return send(ctx->udp.sock, ctx->udp.encrypted_buf, needed_size, 0)>=0? ESP_OK: ESP_FAIL;
+    return send(ctx->udp.sock, pck, needed_size, 0)>=0? ESP_OK: ESP_FAIL;
 }
 
 static esp_err_t xz_mqtt_prot_close_audio_chan(xz_chat_t* chat) {
@@ -88,26 +102,69 @@ static esp_err_t xz_mqtt_prot_close_audio_chan(xz_chat_t* chat) {
     if(chat->session_buf) {
         int n = snprintf(chat->send_buf, chat->send_buf_size, "{\"session_id\":\"%s\",\"type\":\"goodbye\"}", chat->session_id);
         xz_mqtt_prot_send_msg(chat, chat->send_buf, n);
-        RELEASE(chat->session_buf);
+        chat_session_buf_release(chat);
     }
-    if(ctx->udp.sock != -1) {
-        close(ctx->udp.sock);
-        ctx->udp.sock = -1;
+    // udp socket and aes key are kept for the next session
+    return ESP_OK;
+}
+
+static void close_udp_sock(xz_mqtt_prot_ctx_t* ctx) {
+    int sock = ctx->udp.sock;
+    if(sock == -1) return;
+    ctx->udp.sock = -1;
+    ctx->udp.peer_len = 0;
+    close(sock); // udp task pauses on the recv error
+}
+
+// resolve the udp server, the address is cached per host:port for dns_ttl_ms.
+// a stale entry of the same host is used if the lookup fails.
+static esp_err_t resolve_udp_server(xz_mqtt_prot_ctx_t* ctx, const char* host, int port) {
+    bool same = ctx->udp.dns.addr_len && ctx->udp.dns.port == port && 0 == strcmp(ctx->udp.dns.host, host);
+    int64_t now = esp_timer_get_time();
+    if(same && now < ctx->udp.dns.expiry) return ESP_OK;
+
+    char serv[8];
+    snprintf(serv, sizeof(serv), "%d", port);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo* res = NULL;
+    int err = getaddrinfo(host, serv, &hints, &res);
+    if(err || !res || res->ai_addrlen > sizeof(ctx->udp.dns.addr)) {
+        if(res) freeaddrinfo(res);
+        if(same) {
+            ESP_LOGW(TAG, "resolve %s failed (%d), use cached address", host, err);
+            return ESP_OK;
+        }
+        ESP_LOGE(TAG, "resolve %s failed (%d)", host, err);
+        return ESP_FAIL;
     }
-    RELEASE(ctx->udp.encrypted_buf);
-    ctx->udp.encrypted_buf_size = 0;
-    mbedtls_aes_free(&ctx->udp.aes_ctx);
+    memcpy(&ctx->udp.dns.addr, res->ai_addr, res->ai_addrlen);
+    ctx->udp.dns.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    snprintf(ctx->udp.dns.host, sizeof(ctx->udp.dns.host), "%s", host);
+    ctx->udp.dns.port = port;
+    ctx->udp.dns.expiry = now + (int64_t)ctx->udp.dns_ttl_ms * 1000;
     return ESP_OK;
 }
 
-// if gethostbyname fails, out_addr will remain unchange.
-// it's your job to initialize out_addr's other property if required.
-static esp_err_t str2sockaddr(const char* hostname, int port, struct sockaddr_in* out_addr) {
-    struct hostent *host = gethostbyname(hostname);
-    if(host==NULL) return ESP_FAIL;
-    out_addr->sin_family = AF_INET;
-    out_addr->sin_port = htons(port);
-    memcpy(&out_addr->sin_addr, host->h_addr, host->h_length);
+// make sure the udp socket is connected to the resolved address, an already connected one is reused
+static esp_err_t connect_udp_sock(xz_mqtt_prot_ctx_t* ctx) {
+    const struct sockaddr_storage* addr = &ctx->udp.dns.addr;
+    socklen_t addr_len = ctx->udp.dns.addr_len;
+    if(ctx->udp.sock != -1 && ctx->udp.peer_len == addr_len && 0 == memcmp(&ctx->udp.peer, addr, addr_len)) {
+        return ESP_OK;
+    }
+    int sock = socket(addr->ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0) return ESP_ERR_NO_MEM;
+    if(connect(sock, (const struct sockaddr*)addr, addr_len) < 0) {
+        close(sock);
+        return ESP_FAIL;
+    }
+    // swap before closing the old one, so the udp task moves over to the new socket
+    int old = ctx->udp.sock;
+    ctx->udp.sock = sock;
+    memcpy(&ctx->udp.peer, addr, addr_len);
+    ctx->udp.peer_len = addr_len;
+    if(old != -1) close(old);
     return ESP_OK;
 }
 
@@ -120,15 +177,16 @@ static esp_err_t xz_mqtt_prot_open_audio_chan(xz_chat_t* chat) {
     esp_err_t ret = ESP_OK;
 
     xEventGroupClearBits(chat->eg, XZ_EG_SERVER_HELLO_BIT|XZ_EG_PROT_DISCONN_BIT|XZ_EG_PROT_ERR_BIT);
+    chat_lat_mark(chat, XZ_LAT_HELLO_SENT);
     ESP_RETURN_ON_ERROR(xz_mqtt_prot_send_msg(chat, XZ_MQTT_PROT_OPEN_AUDIO_CMD, sizeof(XZ_MQTT_PROT_OPEN_AUDIO_CMD)-1), TAG, "send hello");
     ESP_RETURN_ON_FALSE(XZ_EG_SERVER_HELLO_BIT&xEventGroupWaitBits(chat->eg, XZ_EG_SERVER_HELLO_BIT|XZ_EG_PROT_ERR_BIT|XZ_EG_PROT_DISCONN_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000)), ESP_ERR_TIMEOUT, TAG, "wait server hello");
-    if((ctx->udp.sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_IP)) <0) {ret= ESP_ERR_NO_MEM; return ret;}
-    struct sockaddr_in dest_addr = {0};
-    ESP_GOTO_ON_ERROR(str2sockaddr(ctx->udp.server, ctx->udp.port, &dest_addr), err, TAG, "get host by name");
-    ESP_GOTO_ON_FALSE(connect(ctx->udp.sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr)) >=0, ESP_FAIL, err, TAG, "connect");
-    ctx->udp.encrypted_buf = NULL;
-    ctx->udp.encrypted_buf_size = 0;
+    ESP_GOTO_ON_ERROR(resolve_udp_server(ctx, ctx->udp.server, ctx->udp.port), err, TAG, "resolve udp server");
+    int sock = ctx->udp.sock;
+    ESP_GOTO_ON_ERROR(connect_udp_sock(ctx), err, TAG, "connect");
+    if(ctx->udp.sock != sock) chat_lat_mark(chat, XZ_LAT_CONNECTED);
+#ifndef CONFIG_XZ_CHAT_REACTOR
     resume_task(ctx->udp.task_hd);
+#endif
 err:
     if(ret) {
         xz_mqtt_prot_close_audio_chan(chat);
@@ -136,6 +194,116 @@ err:
     return ret;
 }
 
+// on the receiving task: a hello set up a new session, take its key and start sequence and jitter buffer over
+static void rx_sync_session(xz_mqtt_prot_ctx_t* ctx) {
+    if(atomic_load(&ctx->udp.rx_gen) == ctx->udp.rx_gen_seen) return;
+    uint8_t key[sizeof(ctx->udp.rx_key)];
+    bool first = ctx->udp.rx_gen_seen == 0;
+    portENTER_CRITICAL(&ctx->udp.rx_lock);
+    memcpy(key, ctx->udp.rx_key, sizeof(key));
+    ctx->udp.rx_gen_seen = atomic_load(&ctx->udp.rx_gen);
+    portEXIT_CRITICAL(&ctx->udp.rx_lock);
+    if(first || memcmp(ctx->udp.rx_keyed, key, sizeof(key))) { // key schedule only when the key changes
+        mbedtls_aes_setkey_enc(&ctx->udp.rx_aes_ctx, key, 128);
+        memcpy(ctx->udp.rx_keyed, key, sizeof(key));
+    }
+    ctx->udp.remote_sequence = 0;
+    if(ctx->udp.jb.slots) xz_jitter_buf_reset(&ctx->udp.jb);
+}
+
+static void process_udp_packet(xz_chat_t* chat, xz_mqtt_prot_ctx_t* ctx, uint8_t* recv_buf, int n) {
+    rx_sync_session(ctx);
+    if(ctx->udp.rx_gen_seen == 0) return; // no hello yet
+    if(n < (int)sizeof(ctx->udp.nonce)) {
+        CHAT_STAT_ADD(chat, rx_bad_packets, 1);
+        ESP_LOGE(TAG, "Invalid audio packet size: %d", n);
+        return;
+    }
+    if (recv_buf[0] != 0x01) {
+        CHAT_STAT_ADD(chat, rx_bad_packets, 1);
+        ESP_LOGE(TAG, "Invalid audio packet type: %x", recv_buf[0]);
+        return;
+    }
+    uint32_t timestamp = ntohl(*(uint32_t*)&recv_buf[8]);
+    uint32_t sequence = ntohl(*(uint32_t*)&recv_buf[12]);
+    int lost = 0;
+    if(ctx->udp.jb.slots == 0) {
+        if ((int32_t)(sequence - ctx->udp.remote_sequence) < 0) {
+            CHAT_STAT_ADD(chat, rx_late_frames, 1);
+            ESP_LOGW(TAG, "Received audio packet with old sequence: %" PRIu32 ", expected: %" PRIu32, sequence, ctx->udp.remote_sequence);
+            return;
+        }
+        if (sequence != ctx->udp.remote_sequence + 1) {
+            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %" PRIu32 ", expected: %" PRIu32, sequence, ctx->udp.remote_sequence + 1);
+        }
+        if(ctx->udp.remote_sequence) lost = sequence - ctx->udp.remote_sequence - 1; // 0 before the first packet of a session
+    }
+    size_t decrypted_size = n - sizeof(ctx->udp.nonce);
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    uint8_t* encrypted = recv_buf + sizeof(ctx->udp.nonce);
+    if(0 != mbedtls_aes_crypt_ctr(&ctx->udp.rx_aes_ctx, decrypted_size, &nc_off, (uint8_t*)recv_buf, stream_block, encrypted, encrypted)) { // in-place cryption
+        CHAT_STAT_ADD(chat, rx_bad_packets, 1);
+        ESP_LOGE(TAG, "Failed to decrypt audio data");
+        return;
+    }
+    CHAT_TRACE(chat, XZ_TRACE_RX_AUDIO, 0, sequence, timestamp, encrypted, decrypted_size);
+    if(ctx->udp.jb.slots) {
+        bool primed = ctx->udp.jb.primed;
+        esp_err_t ret = xz_jitter_buf_put(&ctx->udp.jb, sequence, encrypted, decrypted_size);
+        if(ret == ESP_ERR_INVALID_STATE) {
+            CHAT_STAT_ADD(chat, rx_late_frames, 1);
+            ESP_LOGW(TAG, "Received late audio packet: %" PRIu32, sequence);
+        } else if(ret) {
+            CHAT_STAT_ADD(chat, rx_bad_packets, 1);
+            ESP_LOGE(TAG, "Audio packet too large for jitter buffer: %zu", decrypted_size);
+        } else if(!primed && ctx->udp.jb.primed) {
+            ctx->udp.jb_next_release = esp_timer_get_time(); // playout starts now
+        }
+        return;
+    }
+    chat_report_audio_loss(chat, lost);
+    chat_deliver_audio(chat, encrypted, decrypted_size);
+    ctx->udp.remote_sequence = sequence;
+}
+
+// release due frames at the server's frame cadence, returns us till the next release, 0 if nothing is buffered
+static int64_t release_jitter_buf(xz_chat_t* chat, xz_mqtt_prot_ctx_t* ctx) {
+    rx_sync_session(ctx); // frames of the last session are not released into a new one
+    int64_t frame_us = (chat->server_frame_duration>0? chat->server_frame_duration: OPUS_FRAME_DURATION_MS) * 1000;
+    int64_t now = esp_timer_get_time();
+    while(ctx->udp.jb.primed && ctx->udp.jb_next_release <= now) {
+        uint8_t* data; int lost;
+        int len = xz_jitter_buf_pop(&ctx->udp.jb, &data, &lost);
+        if(len > 0) {
+            if(lost) {
+                ESP_LOGW(TAG, "%d audio packets lost", lost);
+                chat_report_audio_loss(chat, lost);
+            }
+            chat_deliver_audio(chat, data, len);
+        }
+        ctx->udp.jb_next_release += frame_us;
+    }
+    return ctx->udp.jb.primed? ctx->udp.jb_next_release - now: 0;
+}
+
+#ifdef CONFIG_XZ_CHAT_REACTOR
+static int xz_mqtt_prot_io_fd(xz_chat_t* chat) {
+    xz_mqtt_prot_ctx_t* ctx = (xz_mqtt_prot_ctx_t*)chat->prot_ctx;
+    return ctx && ctx->udp.recv_buf? ctx->udp.sock: -1;
+}
+
+// on the main task, what udp_recv_loop does in the default mode
+static int64_t xz_mqtt_prot_io(xz_chat_t* chat, bool readable) {
+    xz_mqtt_prot_ctx_t* ctx = (xz_mqtt_prot_ctx_t*)chat->prot_ctx;
+    if(!ctx || !ctx->udp.recv_buf) return 0;
+    int n;
+    while(readable && ctx->udp.sock != -1 && 0 < (n=recv(ctx->udp.sock, ctx->udp.recv_buf, ctx->udp.recv_buf_size, MSG_DONTWAIT))) {
+        process_udp_packet(chat, ctx, ctx->udp.recv_buf, n);
+    }
+    return ctx->udp.jb.slots? release_jitter_buf(chat, ctx): 0;
+}
+#else
 static void udp_recv_loop(void* arg) {
     xz_chat_t* chat = (xz_chat_t*) arg;
     xz_mqtt_prot_ctx_t* ctx = (xz_mqtt_prot_ctx_t*)chat->prot_ctx;
@@ -144,35 +312,21 @@ static void udp_recv_loop(void* arg) {
         uint8_t* recv_buf = ctx->udp.recv_buf;
         int sock = ctx->udp.sock;
         int n;
-        while(0 <= (n=recv(sock, recv_buf, ctx->udp.recv_buf_size, 0))) {
-            if(n < ctx->udp.aes_nonce_len) {
-                ESP_LOGE(TAG, "Invalid audio packet size: %u", n);
-                continue;
-            }
-            if (recv_buf[0] != 0x01) {
-                ESP_LOGE(TAG, "Invalid audio packet type: %x", recv_buf[0]);
-                continue;
+        while(sock != -1) {
+            if(ctx->udp.jb.slots) {
+                int64_t wait_ms = (release_jitter_buf(chat, ctx) + 999) / 1000; // lwip takes ms, round up so it's never 0 while frames are due
+                struct timeval tv = { .tv_sec = wait_ms / 1000, .tv_usec = (wait_ms % 1000) * 1000 }; // 0 blocks
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
             }
-            uint32_t timestamp = ntohl(*(uint32_t*)&recv_buf[8]);
-            uint32_t sequence = ntohl(*(uint32_t*)&recv_buf[12]);
-            if (sequence < ctx->udp.remote_sequence) {
-                ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, ctx->udp.remote_sequence);
-                continue;
+            if(0 > (n=recv(sock, recv_buf, ctx->udp.recv_buf_size, 0))) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) continue; // time to release buffered frames
+                if(ctx->udp.sock != sock) { // replaced by a socket to another server, or closed
+                    sock = ctx->udp.sock;
+                    continue;
+                }
+                break;
             }
-            if (sequence != ctx->udp.remote_sequence + 1) {
-                ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, ctx->udp.remote_sequence + 1);
-            }
-            size_t decrypted_size = n - ctx->udp.aes_nonce_len;
-            size_t nc_off = 0;
-            uint8_t stream_block[16] = {0};
-            uint8_t* encrypted = recv_buf + ctx->udp.aes_nonce_len;
-            if(0 != mbedtls_aes_crypt_ctr(&ctx->udp.aes_ctx, decrypted_size, &nc_off, (uint8_t*)recv_buf, stream_block, encrypted, encrypted)) { // in-place cryption
-                ESP_LOGE(TAG, "Failed to decrypt audio data");
-                continue;
-            }
-            if(chat_has_any_flag(chat, XZ_FLAG_SESS_SPEAKING) && chat->audio_cb)
-                chat->audio_cb(encrypted, decrypted_size, chat);
-            ctx->udp.remote_sequence = sequence;
+            process_udp_packet(chat, ctx, recv_buf, n);
         }
         ESP_LOGI(TAG, "udp recv pause");
     }
@@ -180,16 +334,23 @@ static void udp_recv_loop(void* arg) {
     xEventGroupSetBits(chat->eg, XZ_EG_UDP_TASK_STOPPED_BIT);
     capped_task_delete(NULL);
 }
+#endif
 
 esp_err_t xz_mqtt_prot_destroy(xz_mqtt_prot_ctx_t* ctx) {
     if(!ctx) return ESP_OK;
 
     esp_err_t ret = esp_mqtt_client_destroy(ctx->mqtt_hd);
     if(!ret) ctx->mqtt_hd = NULL;
+    close_udp_sock(ctx);
     RELEASE_TASK(ctx->udp.task_hd);
 
-    RELEASE(ctx->udp.recv_buf);
+    XZ_BUF_RELEASE(ctx->alloc, ctx->udp.recv_buf);
+    XZ_BUF_RELEASE(ctx->alloc, ctx->udp.encrypted_buf);
+    mbedtls_aes_free(&ctx->udp.aes_ctx);
+    mbedtls_aes_free(&ctx->udp.rx_aes_ctx);
     RELEASE(ctx->pub_topic);
+    xz_jitter_buf_deinit(&ctx->udp.jb);
+    xz_rx_asm_deinit(&ctx->rx);
 
     if(!ret) {
         free(ctx);
@@ -197,95 +358,142 @@ esp_err_t xz_mqtt_prot_destroy(xz_mqtt_prot_ctx_t* ctx) {
     return ret;
 }
 
-static void mqtt_event_handler(xz_chat_t* chat, esp_event_base_t base, int32_t event_id, esp_mqtt_event_t *event) {
-    switch (event_id) {
-    case MQTT_EVENT_DATA: {
-        xz_mqtt_prot_ctx_t* ctx = (xz_mqtt_prot_ctx_t*)chat->prot_ctx;
-
-        /*
-            handling partial data
-        */
-        // char* data;
-        // if(event->data_len == event->total_data_len) {
-        //     data = event->data;
-        //     goto process_recv_data;
-        // }
-        // if(event->topic) { // for truncked message, only the first part has topic
-        //     if(chat->recv_buf == NULL)
-        //         if(NULL== (chat->recv_buf=malloc(event->total_data_len)))
-        //             ESP_LOGE(TAG, "failed malloc mqtt recv buf");
-        // }
-        // if(chat->recv_buf) {
-        //     memcpy(chat->recv_buf+event->current_data_offset, event->data, event->data_len);
-        //     if(event->data_len+event->current_data_offset >= event->total_data_len) {
-        //         data = chat->recv_buf;
-        //         goto process_recv_data;
-        //     }
-        // }
-        // return;
-
-// process_recv_data:
-        if(event->data_len != event->total_data_len) { // by defualt, rx_buffer is 1k, should be enough
-            ESP_LOGE(TAG, "recv buf too small");
+static void process_mqtt_message(xz_chat_t* chat, xz_mqtt_prot_ctx_t* ctx, char* data, int len) {
+    xz_json_idx_t* idx = &chat->json_idx;
+    const char* type; int type_len;
+    ESP_LOGI(TAG, "got: %.*s", len, data);
+    CHAT_TRACE(chat, XZ_TRACE_RX_JSON, 0, 0, 0, data, len);
+    if(xz_json_idx_build(idx, data, len) || !(type = xz_json_idx_str(idx, "$.type", &type_len))) {
+        ESP_LOGE(TAG, "Message type is not specified");
+        return;
+    }
+    const char* s; int n;
+    xz_msg_type_t mt = xz_prot_msg_type(type, type_len);
+    if(mt == XZ_MSG_HELLO) {
+        if(!xz_json_idx_streq(idx, "$.transport", "udp")) {
+            ESP_LOGE(TAG, "Unsupported transport");
             return;
         }
-        char* data = event->data;
-        int len = event->total_data_len;
-        const char* type; int type_len;
-        ESP_LOGI(TAG, "got: %.*s", len, data);
-        if(!emjson_locate_string(data, len, "$.type", &type, &type_len)) {
-            ESP_LOGE(TAG, "Message type is not specified");
-            // goto process_recv_data_end;
+        if(xz_json_idx_find(idx, "$.udp", NULL, NULL) != XZ_JSON_OBJECT) {
+            ESP_LOGE(TAG, "UDP is not specified");
             return;
         }
-        char* s; int n;
-        if(QESTREQL(type, "hello")) {
-            if(!(emjson_locate_string(data, len, "$.transport", &s, &n) && QESTREQL(s, "udp"))) {
-                ESP_LOGE(TAG, "Unsupported transport");
-                // goto process_recv_data_end;
-                return;
-            }
 
-            chat->session_buf = strndup(data, len);
-            data = chat->session_buf;
+        if(!(data = chat_session_buf_set(chat, data, len))) return;
+        xz_json_idx_rebase(idx, data);
+        type = xz_json_idx_str(idx, "$.type", NULL);
+
+        ctx->udp.server = (char*)xz_json_idx_str(idx, "$.udp.server", NULL);
+        xz_json_idx_i32(idx, "$.udp.port", &ctx->udp.port);
+        int nonce_len = 0, key_len = 0;
+        char* nonce = (char*)xz_json_idx_str(idx, "$.udp.nonce", &nonce_len);
+        char* key = (char*)xz_json_idx_str(idx, "$.udp.key", &key_len);
+        if(!ctx->udp.server || nonce_len != 2*sizeof(ctx->udp.nonce) || key_len != 2*sizeof(ctx->udp.key)) {
+            ESP_LOGE(TAG, "Invalid udp params");
+            chat_session_buf_release(chat);
+            return;
+        }
 
-            char* key;
-            if(mjson_find(data, len, "$.udp", &s, &n) != MJSON_TOK_OBJECT) {
-                ESP_LOGE(TAG, "UDP is not specified");
-                RELEASE(chat->session_buf);
-                return;
-            }
+        chat->session_id = (char*)xz_json_idx_str(idx, "$.session_id", NULL);
+        xz_json_idx_i32(idx, "$.audio_params.sample_rate", &chat->server_sample_rate);
+        xz_json_idx_i32(idx, "$.audio_params.frame_duration", &chat->server_frame_duration);
+        emjson_truncate_string_batch(key, ctx->udp.server, nonce, chat->session_id, NULL);
+        dec_hex_i(key);
+        dec_hex_i(nonce);
+        memcpy(ctx->udp.nonce, nonce, sizeof(ctx->udp.nonce));
+        ctx->udp.aes_nonce = (char*)ctx->udp.nonce;
+        ctx->udp.aes_nonce_len = sizeof(ctx->udp.nonce);
+        if(!ctx->udp.keyed || memcmp(ctx->udp.key, key, sizeof(ctx->udp.key))) { // key schedule only when the key changes
+            mbedtls_aes_setkey_enc(&ctx->udp.aes_ctx, (const unsigned char*)key, 128);
+            memcpy(ctx->udp.key, key, sizeof(ctx->udp.key));
+            ctx->udp.keyed = true;
+        }
+        ctx->udp.local_sequence = 0;
+        portENTER_CRITICAL(&ctx->udp.rx_lock);
+        memcpy(ctx->udp.rx_key, key, sizeof(ctx->udp.rx_key));
+        atomic_fetch_add(&ctx->udp.rx_gen, 1);
+        portEXIT_CRITICAL(&ctx->udp.rx_lock);
+        chat_lat_mark(chat, XZ_LAT_HELLO_RECEIVED);
+        xEventGroupSetBits(chat->eg, XZ_EG_SERVER_HELLO_BIT);
 
-            ctx->udp.server = emjson_find_string(s, n, "$.server");
-            emjson_get_i32(s, n, "$.port", &ctx->udp.port);
-            ctx->udp.aes_nonce = emjson_find_string(s, n, "$.nonce");
-            emjson_locate_string(s, n, "$.nonce", (const char**)&ctx->udp.aes_nonce, &ctx->udp.aes_nonce_len);
-            key = emjson_find_string(s, n, "$.key");
+    } else if(mt == XZ_MSG_GOODBYE) {
+        if((s = xz_json_idx_str(idx, "$.session_id", &n)) && strncmp(chat->session_id, s, n)) {
 
-            chat->session_id = emjson_find_string(data, len, "$.session_id");
-            if(mjson_find(data, len, "$.audio_params", &s, &n) == MJSON_TOK_OBJECT) {
-                emjson_get_i32(s, n, "$.sample_rate", &chat->server_sample_rate);
-                emjson_get_i32(s, n, "$.frame_duration", &chat->server_frame_duration);
-            }
-            emjson_truncate_string_batch(key, ctx->udp.server, ctx->udp.aes_nonce, chat->session_id, NULL);
-            dec_hex_i(key);
-            dec_hex_i(ctx->udp.aes_nonce);
-            ctx->udp.aes_nonce_len /= 2;
-            mbedtls_aes_init(&ctx->udp.aes_ctx);
-            mbedtls_aes_setkey_enc(&ctx->udp.aes_ctx, (const unsigned char*)key, 128);
-            ctx->udp.local_sequence = 0;
-            ctx->udp.remote_sequence = 0;
-            xEventGroupSetBits(chat->eg, XZ_EG_SERVER_HELLO_BIT);
+        } else {
+            chat_session_buf_release(chat); // close audo chan by server, release session buf so client won't send goodbye to server again
+            xz_chat_exit_session(chat);
+        }
+    }
+    xz_prot_process_json(chat, idx, mt, (char*)type, type_len);
+}
 
-        } else if(QESTREQL(type, "goodbye")) {
-            if(emjson_locate_string(data, len, "$.session_id", &s, &n) && strncmp(chat->session_id, s, n)) {
+// audio records hold the plaintext, it's encrypted again with the key of the replayed hello and goes through the udp path
+void xz_mqtt_prot_replay(xz_chat_t* chat, const xz_trace_rec_t* rec, uint8_t* payload) {
+    xz_mqtt_prot_ctx_t* ctx = (xz_mqtt_prot_ctx_t*)chat->prot_ctx;
+    if(rec->kind == XZ_TRACE_RX_JSON) {
+        process_mqtt_message(chat, ctx, (char*)payload, rec->len);
+        return;
+    }
+    if(!ctx->udp.keyed || !ctx->udp.aes_nonce) {
+        ESP_LOGW(TAG, "replay: audio before hello, skipped");
+        return;
+    }
+    int needed_size = sizeof(ctx->udp.nonce) + rec->len;
+    uint8_t* pck = chat_tx_buf(chat, &ctx->udp.encrypted_buf, &ctx->udp.encrypted_buf_size, needed_size);
+    if(!pck) return;
+    memcpy(pck, ctx->udp.nonce, sizeof(ctx->udp.nonce));
+    pck[0] = 0x01;
+    *(uint16_t*)&pck[2] = htons(rec->len);
+    *(uint32_t*)&pck[8] = htonl(rec->ts);
+    *(uint32_t*)&pck[12] = htonl(rec->seq);
+    uint8_t counter[16], stream_block[16] = {0};
+    size_t nc_off = 0;
+    memcpy(counter, pck, sizeof(counter));
+    if(0 != mbedtls_aes_crypt_ctr(&ctx->udp.aes_ctx, rec->len, &nc_off, counter, stream_block, payload, &pck[sizeof(ctx->udp.nonce)])) return;
+    process_udp_packet(chat, ctx, pck, needed_size);
+    if(ctx->udp.jb.slots) release_jitter_buf(chat, ctx); // paced by wall time, as fast replays only release what's due
+}
 
-            } else {
-                RELEASE(chat->session_buf); // close audo chan by server, release session buf so client won't send goodbye to server again
-                xz_chat_exit_session(chat);
+// rx_topic may be cut short, then its stored prefix is compared
+static bool rx_topic_is(const xz_mqtt_prot_ctx_t* ctx, const char* topic, int len) {
+    int n = len < (int)sizeof(ctx->rx_topic) - 1? len: (int)sizeof(ctx->rx_topic) - 1;
+    return (int)strlen(ctx->rx_topic) == n && memcmp(ctx->rx_topic, topic, n) == 0;
+}
+
+static void mqtt_event_handler(xz_chat_t* chat, esp_event_base_t base, int32_t event_id, esp_mqtt_event_t *event) {
+    switch (event_id) {
+    case MQTT_EVENT_DATA: {
+        xz_mqtt_prot_ctx_t* ctx = (xz_mqtt_prot_ctx_t*)chat->prot_ctx;
+        if(event->data_len == event->total_data_len) {
+            process_mqtt_message(chat, ctx, event->data, event->data_len);
+            return;
+        }
+        /*
+            message is larger than the mqtt rx buffer and comes in chunks,
+            the assembly is keyed on the first chunk's topic, the rest follow in order.
+        */
+        if(event->current_data_offset == 0) {
+            if(ctx->rx.active) {
+                ESP_LOGW(TAG, "incomplete message on %s discarded", ctx->rx_topic);
             }
+            snprintf(ctx->rx_topic, sizeof(ctx->rx_topic), "%.*s", event->topic_len, event->topic);
+            xz_rx_asm_begin(&ctx->rx, event->total_data_len);
+        } else if(!ctx->rx.active) {
+            return; // the first chunk was lost
+        } else if(event->topic_len > 0 && !rx_topic_is(ctx, event->topic, event->topic_len)) {
+            ESP_LOGW(TAG, "chunk on %.*s while assembling %s, discarded", event->topic_len, event->topic, ctx->rx_topic);
+            xz_rx_asm_end(&ctx->rx);
+            return;
         }
-        xz_prot_process_json(chat, data, len, type, type_len);
+        xz_rx_asm_append(&ctx->rx, event->data, event->data_len);
+        if(event->current_data_offset + event->data_len < event->total_data_len) return;
+        xz_rx_asm_end(&ctx->rx);
+        if(ctx->rx.dropping) {
+            CHAT_STAT_ADD(chat, rx_oversize, 1);
+            ESP_LOGE(TAG, "message on %s larger than %d dropped", ctx->rx_topic, ctx->rx.max_size);
+            return;
+        }
+        process_mqtt_message(chat, ctx, (char*)ctx->rx.buf, ctx->rx.len);
         return;
     }
     // case MQTT_EVENT_BEFORE_CONNECT:
@@ -309,16 +517,66 @@ static void mqtt_event_handler(xz_chat_t* chat, esp_event_base_t base, int32_t e
 }
 
 
+#ifdef CONFIG_XZ_PROT_TLS_SESSION_CACHE
+// false if the client uses tls options the resuming transport can't carry, it keeps its own transport then
+static bool tls_conf_from_client(const esp_mqtt_client_config_t* c, xz_tls_transport_config_t* tls) {
+    if(c->broker.verification.psk_hint_key || c->credentials.authentication.use_secure_element || c->credentials.authentication.ds_data) return false;
+    *tls = (xz_tls_transport_config_t) {
+        .tls = {
+            .crt_bundle_attach = c->broker.verification.crt_bundle_attach,
+            .use_global_ca_store = c->broker.verification.use_global_ca_store,
+            .cacert_buf = (const unsigned char*)c->broker.verification.certificate,
+            .cacert_bytes = xz_tls_pem_len(c->broker.verification.certificate, c->broker.verification.certificate_len),
+            .skip_common_name = c->broker.verification.skip_cert_common_name_check,
+            .common_name = c->broker.verification.common_name,
+            .alpn_protos = c->broker.verification.alpn_protos,
+            .clientcert_buf = (const unsigned char*)c->credentials.authentication.certificate,
+            .clientcert_bytes = xz_tls_pem_len(c->credentials.authentication.certificate, c->credentials.authentication.certificate_len),
+            .clientkey_buf = (const unsigned char*)c->credentials.authentication.key,
+            .clientkey_bytes = xz_tls_pem_len(c->credentials.authentication.key, c->credentials.authentication.key_len),
+            .clientkey_password = (const unsigned char*)c->credentials.authentication.key_password,
+            .clientkey_password_len = c->credentials.authentication.key_password_len,
+        },
+        .default_port = 8883,
+    };
+    return true;
+}
+#endif
+
 esp_err_t xz_mqtt_prot_init(xz_mqtt_prot_ctx_t** ctx, xz_mqtt_prot_config_t* conf, xz_chat_t* chat) {
     xz_mqtt_prot_ctx_t* p = calloc(1, sizeof(xz_mqtt_prot_ctx_t));
     if(p == NULL) return ESP_ERR_NO_MEM;
     esp_err_t ret = ESP_OK;
-    ESP_GOTO_ON_FALSE((p->mqtt_hd=esp_mqtt_client_init(&conf->client_conf)), ESP_ERR_NO_MEM, err, TAG, "create mqtt client");
+    p->alloc = &chat->allocator;
+    p->udp.sock = -1;
+    p->udp.dns_ttl_ms = conf->udp_conf.dns_ttl_ms;
+    mbedtls_aes_init(&p->udp.aes_ctx);
+    mbedtls_aes_init(&p->udp.rx_aes_ctx);
+    portMUX_INITIALIZE(&p->udp.rx_lock);
+    esp_mqtt_client_config_t client_conf = conf->client_conf;
+#ifdef CONFIG_XZ_PROT_TLS_SESSION_CACHE
+    xz_tls_transport_config_t tls_conf;
+    if(client_conf.broker.address.transport == MQTT_TRANSPORT_OVER_SSL && !client_conf.network.transport && tls_conf_from_client(&client_conf, &tls_conf)) {
+        // owned and destroyed by the mqtt client
+        ESP_GOTO_ON_FALSE((client_conf.network.transport=xz_tls_transport_init(&tls_conf)), ESP_ERR_NO_MEM, err, TAG, "create tls transport");
+    }
+#endif
+    ESP_GOTO_ON_FALSE((p->mqtt_hd=esp_mqtt_client_init(&client_conf)), ESP_ERR_NO_MEM, err, TAG, "create mqtt client");
     p->pub_topic = strdup(conf->pub_topic);
+    ESP_GOTO_ON_ERROR(xz_rx_asm_init(&p->rx, conf->rx_msg_max_size, p->alloc), err, TAG, "init rx asm");
     ESP_GOTO_ON_ERROR(esp_mqtt_client_register_event(p->mqtt_hd, ESP_EVENT_ANY_ID, (esp_event_handler_t)mqtt_event_handler, chat), err, TAG, "register event");
     // init udp task
     p->udp.recv_buf_size = conf->udp_conf.recv_buf_size;
     p->udp.task_conf = conf->udp_conf.task_conf;
+#ifdef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    // kept till destroy instead of taken on every start
+    ESP_GOTO_ON_FALSE((p->udp.recv_buf=xz_buf_alloc(p->alloc, XZ_BUF_AUDIO_RX, p->udp.recv_buf_size)), ESP_ERR_NO_MEM, err, TAG, "reserve udp recv buf");
+    p->udp.encrypted_buf_size = sizeof(p->udp.nonce) + CONFIG_XZ_CHAT_STATIC_TX_FRAME_SIZE;
+    ESP_GOTO_ON_FALSE((p->udp.encrypted_buf=xz_buf_alloc(p->alloc, XZ_BUF_AUDIO_TX, p->udp.encrypted_buf_size)), ESP_ERR_NO_MEM, err, TAG, "reserve udp send buf");
+#endif
+    if(conf->udp_conf.jitter_buf.depth > 0) {
+        ESP_GOTO_ON_ERROR(xz_jitter_buf_init(&p->udp.jb, &conf->udp_conf.jitter_buf, p->alloc), err, TAG, "init jitter buf");
+    }
 err:
     if(ret) {
         xz_mqtt_prot_destroy(p);
@@ -335,8 +593,13 @@ static esp_err_t xz_mqtt_prot_stop(xz_chat_t* chat) {
     if(!ctx) return ESP_ERR_INVALID_STATE;
 
     esp_err_t ret0 = esp_mqtt_client_stop(ctx->mqtt_hd);
+    close_udp_sock(ctx);
     esp_err_t ret1 = term_task_wait(ctx->udp.task_hd, chat->eg, XZ_EG_UDP_TASK_STOPPED_BIT, pdMS_TO_TICKS(5000));
-    RELEASE(ctx->udp.recv_buf);
+#ifndef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    XZ_BUF_RELEASE(ctx->alloc, ctx->udp.recv_buf);
+    XZ_BUF_RELEASE(ctx->alloc, ctx->udp.encrypted_buf);
+    ctx->udp.encrypted_buf_size = 0;
+#endif
     return ret0 || ret1;
 }
 
@@ -345,8 +608,12 @@ static esp_err_t xz_mqtt_prot_start(xz_chat_t* chat) {
     esp_err_t ret= ESP_OK;
     xEventGroupClearBits(chat->eg, XZ_EG_PROT_CONN_BIT|XZ_EG_PROT_ERR_BIT|XZ_EG_PROT_DISCONN_BIT);
     ESP_GOTO_ON_ERROR(esp_mqtt_client_start(ctx->mqtt_hd), err, TAG, "start mqtt");
-    ESP_GOTO_ON_FALSE((ctx->udp.recv_buf=malloc(ctx->udp.recv_buf_size)), ESP_ERR_NO_MEM, err, TAG, "malloc udp recv buf");
+#ifndef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    ESP_GOTO_ON_FALSE((ctx->udp.recv_buf=xz_buf_alloc(ctx->alloc, XZ_BUF_AUDIO_RX, ctx->udp.recv_buf_size)), ESP_ERR_NO_MEM, err, TAG, "malloc udp recv buf");
+#endif
+#ifndef CONFIG_XZ_CHAT_REACTOR
     ESP_GOTO_ON_ERROR(capped_task_create(&ctx->udp.task_hd, "udp_task", udp_recv_loop, chat, &ctx->udp.task_conf), err, TAG, "create udp task");
+#endif
     ESP_GOTO_ON_FALSE(XZ_EG_PROT_CONN_BIT&xEventGroupWaitBits(chat->eg, XZ_EG_PROT_CONN_BIT|XZ_EG_PROT_DISCONN_BIT|XZ_EG_PROT_ERR_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(15000)), ESP_ERR_TIMEOUT, err, TAG, "wait conn");
 err:
     if(ret) {
@@ -364,4 +631,8 @@ const xz_prot_if_t xz_mqtt_prot_if = {
     .close_audio_chan = xz_mqtt_prot_close_audio_chan,
     .send_msg = xz_mqtt_prot_send_msg,
     .send_data = xz_mqtt_prot_send_data,
+#ifdef CONFIG_XZ_CHAT_REACTOR
+    .io_fd = xz_mqtt_prot_io_fd,
+    .io = xz_mqtt_prot_io,
+#endif
 };
\ No newline at end of file
@@ -0,0 +1,41 @@
+#include "xz_pool.h"
+#include <string.h>
+#include "esp_log.h"
+
+static const char* const TAG = "xz_pool";
+
+esp_err_t xz_pool_init(xz_pool_t* p, int blocks, size_t block_size, const xz_chat_allocator_t* alloc, xz_buf_class_t cls) {
+    memset(p, 0, sizeof(xz_pool_t));
+    if(blocks <= 0 || blocks > XZ_POOL_MAX_BLOCKS || block_size == 0) return ESP_ERR_INVALID_ARG;
+    p->block_size = (block_size + 3) & ~(size_t)3;
+    if(!(p->mem=xz_buf_alloc(alloc, cls, p->block_size * blocks))) return ESP_ERR_NO_MEM;
+    p->alloc = alloc;
+    p->blocks = blocks;
+    return ESP_OK;
+}
+
+void xz_pool_deinit(xz_pool_t* p) {
+    if(atomic_load(&p->used)) ESP_LOGW(TAG, "deinit with blocks in use: %lx", (unsigned long)atomic_load(&p->used));
+    XZ_BUF_RELEASE(p->alloc, p->mem);
+    p->blocks = 0;
+}
+
+void* xz_pool_alloc(xz_pool_t* p, size_t size) {
+    if(size > p->block_size) return NULL;
+    uint32_t used = atomic_load(&p->used);
+    for(;;) {
+        int i = __builtin_ffs(~used) - 1; // lowest free
+        if(i < 0 || i >= p->blocks) return NULL;
+        if(atomic_compare_exchange_weak(&p->used, &used, used | (1u << i))) return p->mem + i * p->block_size;
+    }
+}
+
+void xz_pool_free(xz_pool_t* p, void* ptr) {
+    if(!ptr) return;
+    size_t off = (uint8_t*)ptr - p->mem;
+    if(!p->mem || (uint8_t*)ptr < p->mem || off >= p->block_size * p->blocks || off % p->block_size) {
+        ESP_LOGE(TAG, "free of %p, not a block", ptr);
+        return;
+    }
+    atomic_fetch_and(&p->used, ~(1u << (off / p->block_size)));
+}
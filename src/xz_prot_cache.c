@@ -0,0 +1,138 @@
+#include "xz_prot_cache.h"
+#include "xz_board_info.h"
+#include <nvs_flash.h>
+#include <string.h>
+#include "esp_check.h"
+#include "task_util.h"
+
+#define XZ_PROT_CACHE_KEY "xz_prot"
+#define XZ_PROT_CACHE_VER 1
+
+const static char* const TAG = "xz_prot_cache";
+
+typedef struct {
+    uint8_t ver;
+    uint8_t prot_pref;
+    uint8_t prot_type;
+    uint8_t reserved;
+    int32_t num;    // mqtt port or ws version
+    char strs[];    // nul separated, empty for NULL
+} blob_t;
+
+static int put_str(char* p, int left, const char* s) {
+    int n = s? strlen(s) + 1: 1;
+    if(n > left) return -1;
+    if(s) memcpy(p, s, n);
+    else *p = 0;
+    return n;
+}
+
+static int serialize(const xz_http_client_response_t* resp, xz_prot_type_t prot_pref, blob_t* b, int cap) {
+    const char* strs[5];
+    int nstrs;
+    memset(b, 0, sizeof(blob_t));
+    b->ver = XZ_PROT_CACHE_VER;
+    b->prot_pref = prot_pref;
+    b->prot_type = resp->prot_type;
+    switch(resp->prot_type) {
+    case XZ_PROT_TYPE_MQTT:
+        b->num = resp->mqtt.port;
+        strs[0] = resp->mqtt.endpoint; strs[1] = resp->mqtt.pub; strs[2] = resp->mqtt.cid;
+        strs[3] = resp->mqtt.pass; strs[4] = resp->mqtt.uname;
+        nstrs = 5;
+        break;
+    case XZ_PROT_TYPE_WS:
+        b->num = resp->ws.ver;
+        strs[0] = resp->ws.url; strs[1] = resp->ws.tok;
+        nstrs = 2;
+        break;
+    default:
+        return -1;
+    }
+    int len = sizeof(blob_t);
+    for(int i=0; i<nstrs; i++) {
+        int n = put_str(&b->strs[len - sizeof(blob_t)], cap - len, strs[i]);
+        if(n < 0) return -1;
+        len += n;
+    }
+    return len;
+}
+
+static char* next_str(char** p) {
+    char* s = *p;
+    *p += strlen(s) + 1;
+    return *s? s: NULL;
+}
+
+esp_err_t xz_prot_cache_save(const xz_http_client_response_t* resp, xz_prot_type_t prot_pref, void* scratch) {
+    esp_err_t ret = ESP_OK;
+    nvs_handle_t hl = 0;
+    blob_t* b = scratch;
+    int len;
+    ESP_GOTO_ON_FALSE((len=serialize(resp, prot_pref, b, XZ_PROT_CACHE_MAX_SIZE)) > 0, ESP_ERR_INVALID_SIZE, err, TAG, "serialize");
+    ESP_GOTO_ON_ERROR(nvs_open_from_partition(XZ_NVS_PART_NAME, XZ_NVS_NS, NVS_READWRITE, &hl), err, TAG, "can't open partition %s", XZ_NVS_PART_NAME);
+    ESP_GOTO_ON_ERROR(nvs_set_blob(hl, XZ_PROT_CACHE_KEY, b, len), err, TAG, "set blob");
+    ESP_GOTO_ON_ERROR(nvs_commit(hl), err, TAG, "commit");
+err:
+    if(hl) nvs_close(hl);
+    return ret;
+}
+
+esp_err_t xz_prot_cache_load(xz_prot_type_t prot_pref, xz_http_client_response_t* resp, size_t buf_size) {
+    nvs_handle_t hl;
+    size_t len = 0;
+    if(nvs_open_from_partition(XZ_NVS_PART_NAME, XZ_NVS_NS, NVS_READONLY, &hl)) return ESP_ERR_NOT_FOUND;
+    if(nvs_get_blob(hl, XZ_PROT_CACHE_KEY, NULL, &len) || len <= sizeof(blob_t) || len > XZ_PROT_CACHE_MAX_SIZE || len >= buf_size) goto err;
+    // the blob is loaded straight into buf, strings are then pointed to in place
+    memset(resp, 0, sizeof(xz_http_client_response_t));
+    blob_t* b = (blob_t*)resp->buf;
+    if(nvs_get_blob(hl, XZ_PROT_CACHE_KEY, b, &len) || b->ver != XZ_PROT_CACHE_VER || b->prot_pref != prot_pref) goto err;
+    resp->buf[len] = 0;
+    char* p = b->strs;
+    resp->prot_type = b->prot_type;
+    switch(resp->prot_type) {
+    case XZ_PROT_TYPE_MQTT:
+        resp->mqtt.port = b->num;
+        resp->mqtt.endpoint = next_str(&p); resp->mqtt.pub = next_str(&p); resp->mqtt.cid = next_str(&p);
+        resp->mqtt.pass = next_str(&p); resp->mqtt.uname = next_str(&p);
+        if(!resp->mqtt.endpoint) goto err;
+        break;
+    case XZ_PROT_TYPE_WS:
+        resp->ws.ver = b->num;
+        resp->ws.url = next_str(&p); resp->ws.tok = next_str(&p);
+        if(!resp->ws.url) goto err;
+        break;
+    default:
+        goto err;
+    }
+    if(p > resp->buf + len) goto err; // truncated blob
+    nvs_close(hl);
+    return ESP_OK;
+err:
+    nvs_close(hl);
+    return ESP_ERR_NOT_FOUND;
+}
+
+bool xz_prot_cache_matches(const xz_http_client_response_t* resp, xz_prot_type_t prot_pref, void* scratch) {
+    bool same = false;
+    blob_t* b = scratch;
+    blob_t* cached = (blob_t*)((char*)b + XZ_PROT_CACHE_MAX_SIZE);
+    int len = serialize(resp, prot_pref, b, XZ_PROT_CACHE_MAX_SIZE);
+    size_t cached_len = XZ_PROT_CACHE_MAX_SIZE;
+    nvs_handle_t hl;
+    if(len > 0 && 0 == nvs_open_from_partition(XZ_NVS_PART_NAME, XZ_NVS_NS, NVS_READONLY, &hl)) {
+        same = 0 == nvs_get_blob(hl, XZ_PROT_CACHE_KEY, cached, &cached_len) && cached_len == len && 0 == memcmp(b, cached, len);
+        nvs_close(hl);
+    }
+    return same;
+}
+
+esp_err_t xz_prot_cache_erase() {
+    nvs_handle_t hl;
+    ESP_RETURN_ON_ERROR(nvs_open_from_partition(XZ_NVS_PART_NAME, XZ_NVS_NS, NVS_READWRITE, &hl), TAG, "can't open partition %s", XZ_NVS_PART_NAME);
+    esp_err_t ret = nvs_erase_key(hl, XZ_PROT_CACHE_KEY);
+    if(ret == ESP_ERR_NVS_NOT_FOUND) ret = ESP_OK;
+    if(!ret) ret = nvs_commit(hl);
+    nvs_close(hl);
+    return ret;
+}
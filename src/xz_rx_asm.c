@@ -0,0 +1,57 @@
+#include "xz_rx_asm.h"
+#include "sdkconfig.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define XZ_RX_ASM_ALIGN 256
+
+static esp_err_t reserve(xz_rx_asm_t* a, int size);
+
+esp_err_t xz_rx_asm_init(xz_rx_asm_t* a, int max_size, const xz_chat_allocator_t* alloc) {
+    memset(a, 0, sizeof(xz_rx_asm_t));
+    a->max_size = max_size;
+    a->alloc = alloc;
+#ifdef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    return reserve(a, max_size);
+#else
+    return ESP_OK;
+#endif
+}
+
+void xz_rx_asm_deinit(xz_rx_asm_t* a) {
+    XZ_BUF_RELEASE(a->alloc, a->buf);
+    a->cap = a->len = 0;
+    a->active = a->dropping = false;
+}
+
+static esp_err_t reserve(xz_rx_asm_t* a, int size) {
+    if(size > a->max_size) return ESP_ERR_INVALID_SIZE;
+    if(size <= a->cap) return ESP_OK;
+    int cap = (size + XZ_RX_ASM_ALIGN - 1) / XZ_RX_ASM_ALIGN * XZ_RX_ASM_ALIGN;
+    if(cap > a->max_size) cap = a->max_size;
+    void* tmp = xz_buf_realloc(a->alloc, XZ_BUF_CONTROL, a->buf, cap);
+    if(tmp == NULL) return ESP_ERR_NO_MEM;
+    a->buf = tmp;
+    a->cap = cap;
+    return ESP_OK;
+}
+
+esp_err_t xz_rx_asm_begin(xz_rx_asm_t* a, int total) {
+    a->len = 0;
+    a->active = true;
+    esp_err_t ret = reserve(a, total);
+    a->dropping = ret != ESP_OK;
+    return ret;
+}
+
+esp_err_t xz_rx_asm_append(xz_rx_asm_t* a, const void* data, int len) {
+    if(a->dropping) return ESP_ERR_INVALID_SIZE;
+    esp_err_t ret = reserve(a, a->len + len);
+    if(ret) {
+        a->dropping = true;
+        return ret;
+    }
+    memcpy(a->buf + a->len, data, len);
+    a->len += len;
+    return ESP_OK;
+}
@@ -0,0 +1,191 @@
+#include "sdkconfig.h"
+#ifdef CONFIG_XZ_PROT_TLS_SESSION_CACHE
+#include "xz_tls_transport.h"
+#include "esp_tls.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "lwip/sockets.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define XZ_TLS_SESSION_SLOTS 4 // ota, mqtt, websocket and one spare
+#define XZ_TLS_HOST_MAX 64
+
+static const char* const TAG = "xz_tls";
+
+typedef struct {
+    char host[XZ_TLS_HOST_MAX];
+    int port;
+    esp_tls_client_session_t* session;
+    uint32_t used; // lru stamp
+} session_slot_t;
+
+static session_slot_t s_slots[XZ_TLS_SESSION_SLOTS];
+static uint32_t s_clock;
+static portMUX_TYPE s_lock = portMUX_INITIALIZER_UNLOCKED;
+
+typedef struct {
+    esp_tls_t* tls;
+    xz_tls_transport_config_t conf;
+    char host[XZ_TLS_HOST_MAX];
+    int port;
+} xz_tls_t;
+
+// takes the cached session out, the caller owns it
+static esp_tls_client_session_t* session_take(const char* host, int port) {
+    esp_tls_client_session_t* s = NULL;
+    portENTER_CRITICAL(&s_lock);
+    for(int i=0; i<XZ_TLS_SESSION_SLOTS; i++) {
+        if(s_slots[i].session && s_slots[i].port == port && 0 == strcmp(s_slots[i].host, host)) {
+            s = s_slots[i].session;
+            s_slots[i].session = NULL;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&s_lock);
+    return s;
+}
+
+// hands the session over to the cache, replacing the one of the same host or the least recently used
+static void session_put(const char* host, int port, esp_tls_client_session_t* s) {
+    esp_tls_client_session_t* old;
+    portENTER_CRITICAL(&s_lock);
+    session_slot_t* slot = &s_slots[0];
+    for(int i=0; i<XZ_TLS_SESSION_SLOTS; i++) {
+        if(s_slots[i].port == port && 0 == strcmp(s_slots[i].host, host)) {
+            slot = &s_slots[i];
+            break;
+        }
+        if(s_slots[i].used < slot->used) slot = &s_slots[i];
+    }
+    old = slot->session;
+    slot->session = s;
+    slot->port = port;
+    strlcpy(slot->host, host, sizeof(slot->host));
+    slot->used = ++ s_clock;
+    portEXIT_CRITICAL(&s_lock);
+    if(old) esp_tls_free_client_session(old);
+}
+
+void xz_tls_session_cache_clear() {
+    for(int i=0; i<XZ_TLS_SESSION_SLOTS; i++) {
+        portENTER_CRITICAL(&s_lock);
+        esp_tls_client_session_t* s = s_slots[i].session;
+        s_slots[i].session = NULL;
+        portEXIT_CRITICAL(&s_lock);
+        if(s) esp_tls_free_client_session(s);
+    }
+}
+
+// tls 1.3 tickets come after the handshake, so the session is saved again before closing
+static void save_session(xz_tls_t* ctx) {
+    esp_tls_client_session_t* s = esp_tls_get_client_session(ctx->tls);
+    if(s) session_put(ctx->host, ctx->port, s);
+}
+
+static int tls_poll(xz_tls_t* ctx, bool write, int timeout_ms) {
+    int sock = -1;
+    if(!ctx->tls || esp_tls_get_conn_sockfd(ctx->tls, &sock) != ESP_OK || sock < 0) return -1;
+    if(!write && esp_tls_get_bytes_avail(ctx->tls) > 0) return 1;
+    fd_set fds, efds;
+    FD_ZERO(&fds);
+    FD_ZERO(&efds);
+    FD_SET(sock, &fds);
+    FD_SET(sock, &efds);
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    int ret = select(sock + 1, write? NULL: &fds, write? &fds: NULL, &efds, timeout_ms < 0? NULL: &tv);
+    if(ret > 0 && FD_ISSET(sock, &efds)) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+        ESP_LOGE(TAG, "poll error %d on %s", err, ctx->host);
+        return -1;
+    }
+    return ret;
+}
+
+static int tls_poll_read(esp_transport_handle_t t, int timeout_ms) {
+    return tls_poll(esp_transport_get_context_data(t), false, timeout_ms);
+}
+
+static int tls_poll_write(esp_transport_handle_t t, int timeout_ms) {
+    return tls_poll(esp_transport_get_context_data(t), true, timeout_ms);
+}
+
+static int tls_close(esp_transport_handle_t t) {
+    xz_tls_t* ctx = esp_transport_get_context_data(t);
+    if(!ctx->tls) return 0;
+    save_session(ctx);
+    esp_tls_conn_destroy(ctx->tls);
+    ctx->tls = NULL;
+    return 0;
+}
+
+static int tls_connect(esp_transport_handle_t t, const char* host, int port, int timeout_ms) {
+    xz_tls_t* ctx = esp_transport_get_context_data(t);
+    tls_close(t);
+    strlcpy(ctx->host, host, sizeof(ctx->host));
+    ctx->port = port;
+    esp_tls_cfg_t cfg = ctx->conf.tls;
+    cfg.timeout_ms = timeout_ms;
+    cfg.client_session = session_take(host, port);
+    cfg.keep_alive_cfg = ctx->conf.keep_alive.keep_alive_enable? &ctx->conf.keep_alive: NULL;
+    if(!(ctx->tls = esp_tls_init())) {
+        if(cfg.client_session) esp_tls_free_client_session(cfg.client_session);
+        return -1;
+    }
+    bool resumed = cfg.client_session != NULL;
+    int ret = esp_tls_conn_new_sync(host, strlen(host), port, &cfg, ctx->tls);
+    if(resumed) esp_tls_free_client_session(cfg.client_session); // copied into the handshake, a fresh one is saved below
+    if(ret <= 0) {
+        ESP_LOGE(TAG, "connect %s:%d failed", host, port);
+        esp_tls_conn_destroy(ctx->tls);
+        ctx->tls = NULL;
+        return -1;
+    }
+    ESP_LOGD(TAG, "connected %s:%d, %s session", host, port, resumed? "resumed": "new");
+    save_session(ctx);
+    return 0;
+}
+
+static int tls_read(esp_transport_handle_t t, char* buf, int len, int timeout_ms) {
+    xz_tls_t* ctx = esp_transport_get_context_data(t);
+    int poll = tls_poll(ctx, false, timeout_ms);
+    if(poll <= 0) return poll == 0? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT: ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    int ret = esp_tls_conn_read(ctx->tls, buf, len);
+    if(ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_TIMEOUT) return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    if(ret == 0) return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN; // readable but nothing, peer closed
+    return ret < 0? ERR_TCP_TRANSPORT_CONNECTION_FAILED: ret;
+}
+
+static int tls_write(esp_transport_handle_t t, const char* buf, int len, int timeout_ms) {
+    xz_tls_t* ctx = esp_transport_get_context_data(t);
+    int poll = tls_poll(ctx, true, timeout_ms);
+    if(poll <= 0) return poll == 0? ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT: ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    int ret = esp_tls_conn_write(ctx->tls, buf, len);
+    if(ret == ESP_TLS_ERR_SSL_WANT_WRITE || ret == ESP_TLS_ERR_SSL_WANT_READ) return 0;
+    return ret < 0? ERR_TCP_TRANSPORT_CONNECTION_FAILED: ret;
+}
+
+static int tls_destroy(esp_transport_handle_t t) {
+    tls_close(t);
+    free(esp_transport_get_context_data(t));
+    return 0;
+}
+
+esp_transport_handle_t xz_tls_transport_init(const xz_tls_transport_config_t* conf) {
+    xz_tls_t* ctx = calloc(1, sizeof(xz_tls_t));
+    if(!ctx) return NULL;
+    esp_transport_handle_t t = esp_transport_init();
+    if(!t) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->conf = *conf;
+    esp_transport_set_context_data(t, ctx);
+    esp_transport_set_func(t, tls_connect, tls_read, tls_write, tls_close, tls_poll_read, tls_poll_write, tls_destroy);
+    if(conf->default_port) esp_transport_set_default_port(t, conf->default_port);
+    return t;
+}
+
+#endif
@@ -0,0 +1,226 @@
+#include "xz_trace.h"
+#include "xz_protocol_priv.h"
+#include "xz_chat_priv.h"
+#include "esp_check.h"
+#include "task_util.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+static const char* const TAG = "xz_trace";
+
+#ifdef CONFIG_XZ_CHAT_TRACE
+
+#define XZ_TRACE_IO_BUF_SIZE 4096
+
+struct xz_trace {
+    FILE* fp;       // NULL once stopped
+    SemaphoreHandle_t lock;
+    char* io_buf;
+};
+
+void xz_trace_write(xz_trace_t* tr, xz_trace_kind_t kind, int arg, uint32_t seq, uint32_t ts, const void* data, int len) {
+    xz_trace_rec_t rec = {
+        .t_us = esp_timer_get_time(),
+        .seq = seq,
+        .ts = ts,
+        .len = len,
+        .kind = kind,
+        .arg = arg,
+    };
+    xSemaphoreTake(tr->lock, portMAX_DELAY);
+    if(tr->fp) {
+        if(fwrite(&rec, sizeof(rec), 1, tr->fp) != 1 || (len && fwrite(data, len, 1, tr->fp) != 1)) {
+            ESP_LOGE(TAG, "write failed, trace stopped");
+            fclose(tr->fp);
+            tr->fp = NULL;
+        }
+    }
+    xSemaphoreGive(tr->lock);
+}
+
+esp_err_t xz_chat_trace_start(xz_chat_t* chat, const char* path) {
+    xz_trace_t* tr = chat->trace_ctx;
+    if(!tr) {
+        ESP_RETURN_ON_FALSE((tr=calloc(1, sizeof(xz_trace_t))), ESP_ERR_NO_MEM, TAG, "calloc trace");
+        if(!(tr->lock=xSemaphoreCreateMutex()) || !(tr->io_buf=xz_buf_alloc(&chat->allocator, XZ_BUF_TRANSIENT, XZ_TRACE_IO_BUF_SIZE))) {
+            if(tr->lock) vSemaphoreDelete(tr->lock);
+            free(tr);
+            return ESP_ERR_NO_MEM;
+        }
+        chat->trace_ctx = tr; // kept till destroy, a writer may still hold it after stop
+    }
+    xz_chat_trace_stop(chat);
+    FILE* fp = fopen(path, "wb");
+    ESP_RETURN_ON_FALSE(fp, ESP_FAIL, TAG, "open %s", path);
+    setvbuf(fp, tr->io_buf, _IOFBF, XZ_TRACE_IO_BUF_SIZE);
+    xz_trace_file_hdr_t hdr = {
+        .magic = XZ_TRACE_MAGIC,
+        .version = XZ_TRACE_VERSION,
+        .prot_type = chat->prot_type,
+        .ws_version = chat->prot_type == XZ_PROT_TYPE_WS && chat->prot_ctx? ((xz_ws_prot_ctx_t*)chat->prot_ctx)->version: 0,
+    };
+    if(fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+        fclose(fp);
+        return ESP_FAIL;
+    }
+    xSemaphoreTake(tr->lock, portMAX_DELAY);
+    tr->fp = fp;
+    xSemaphoreGive(tr->lock);
+    chat->trace = tr;
+    ESP_LOGI(TAG, "recording to %s", path);
+    return ESP_OK;
+}
+
+void xz_chat_trace_stop(xz_chat_t* chat) {
+    xz_trace_t* tr = chat->trace_ctx;
+    if(!tr) return;
+    chat->trace = NULL;
+    xSemaphoreTake(tr->lock, portMAX_DELAY);
+    if(tr->fp) {
+        fclose(tr->fp);
+        tr->fp = NULL;
+    }
+    xSemaphoreGive(tr->lock);
+}
+
+void xz_chat_trace_free(xz_chat_t* chat) {
+    xz_chat_trace_stop(chat);
+    xz_trace_t* tr = chat->trace_ctx;
+    if(!tr) return;
+    vSemaphoreDelete(tr->lock);
+    xz_buf_free(&chat->allocator, tr->io_buf);
+    free(tr);
+    chat->trace_ctx = NULL;
+}
+
+/*
+ replay. records are fed to the protocol's parsing path in the caller's task,
+ so json goes through the same hello/goodbye handling, typed events and commands as live traffic.
+ the chat must not be started, a protocol context is borrowed or a bare one is made for the run.
+*/
+static void* replay_ctx_create(xz_chat_t* chat, const xz_trace_file_hdr_t* hdr) {
+    if(hdr->prot_type == XZ_PROT_TYPE_WS) {
+        xz_ws_prot_ctx_t* ctx = calloc(1, sizeof(xz_ws_prot_ctx_t));
+        if(ctx) {
+            ctx->version = hdr->ws_version;
+            ctx->alloc = &chat->allocator;
+        }
+        chat->prot_if = xz_ws_prot_if;
+        return ctx;
+    }
+    xz_mqtt_prot_ctx_t* ctx = calloc(1, sizeof(xz_mqtt_prot_ctx_t));
+    if(ctx) {
+        ctx->alloc = &chat->allocator;
+        ctx->udp.sock = -1;
+        mbedtls_aes_init(&ctx->udp.aes_ctx);
+        mbedtls_aes_init(&ctx->udp.rx_aes_ctx);
+        portMUX_INITIALIZE(&ctx->udp.rx_lock);
+    }
+    chat->prot_if = xz_mqtt_prot_if;
+    return ctx;
+}
+
+static esp_err_t _replay_sync(SemaphoreHandle_t done) {
+    xSemaphoreGive(done);
+    return ESP_OK;
+}
+
+// wait till the main task ran every command the replay posted, they may use the protocol context
+static void replay_sync(xz_chat_t* chat) {
+    SemaphoreHandle_t done = xSemaphoreCreateBinary();
+    if(!done) return;
+    CMD(chat, _replay_sync, done);
+    xSemaphoreTake(done, pdMS_TO_TICKS(5000));
+    vSemaphoreDelete(done);
+}
+
+static void replay_ctx_free(xz_chat_t* chat, void* p, xz_prot_type_t type) {
+    if(type == XZ_PROT_TYPE_WS) {
+        xz_ws_prot_ctx_t* ctx = p;
+        XZ_BUF_RELEASE(ctx->alloc, ctx->send_audio_buf);
+    } else {
+        xz_mqtt_prot_ctx_t* ctx = p;
+        mbedtls_aes_free(&ctx->udp.aes_ctx);
+        mbedtls_aes_free(&ctx->udp.rx_aes_ctx);
+        XZ_BUF_RELEASE(ctx->alloc, ctx->udp.encrypted_buf);
+    }
+    free(p);
+}
+
+esp_err_t xz_chat_trace_replay(xz_chat_t* chat, const char* path, int speed_pct) {
+    ESP_RETURN_ON_FALSE(!chat_has_any_flag(chat, XZ_FLAG_STARTED), ESP_ERR_INVALID_STATE, TAG, "stop the chat first");
+    esp_err_t ret = ESP_OK;
+    xz_trace_file_hdr_t hdr;
+    xz_trace_rec_t rec;
+    uint8_t* payload = NULL;
+    uint32_t payload_size = 0;
+    void* bare_ctx = NULL;
+    xz_prot_type_t saved_type = chat->prot_type;
+    xz_prot_if_t saved_if = chat->prot_if;
+    FILE* fp = fopen(path, "rb");
+    ESP_RETURN_ON_FALSE(fp, ESP_FAIL, TAG, "open %s", path);
+    ESP_GOTO_ON_FALSE(fread(&hdr, sizeof(hdr), 1, fp) == 1 && 0 == memcmp(hdr.magic, XZ_TRACE_MAGIC, 4) && hdr.version == XZ_TRACE_VERSION,
+        ESP_ERR_INVALID_VERSION, err, TAG, "not a trace");
+    ESP_GOTO_ON_FALSE(hdr.prot_type == XZ_PROT_TYPE_WS || hdr.prot_type == XZ_PROT_TYPE_MQTT, ESP_ERR_INVALID_ARG, err, TAG, "protocol %d", hdr.prot_type);
+    if(!chat->prot_ctx || chat->prot_type != hdr.prot_type) {
+        ESP_GOTO_ON_FALSE(!chat->prot_ctx, ESP_ERR_INVALID_STATE, err, TAG, "protocol context of another type");
+        ESP_GOTO_ON_FALSE((bare_ctx=replay_ctx_create(chat, &hdr)), ESP_ERR_NO_MEM, err, TAG, "replay ctx");
+        chat->prot_ctx = bare_ctx;
+        chat->prot_type = hdr.prot_type;
+    }
+    chat_set_flag(chat, XZ_FLAG_SESS_LISTENING); // as if a session was open, so tts start/stop take effect
+
+    int64_t t0_trace = 0, t0 = esp_timer_get_time();
+    int n = 0;
+    while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+        ESP_GOTO_ON_FALSE(rec.len <= XZ_TRACE_REC_MAX_LEN, ESP_ERR_INVALID_SIZE, err, TAG, "record %d of %" PRIu32 " bytes", n, rec.len);
+        if(rec.len + 1 > payload_size) {
+            uint8_t* tmp = xz_buf_realloc(&chat->allocator, XZ_BUF_TRANSIENT, payload, rec.len + 1);
+            ESP_GOTO_ON_FALSE(tmp, ESP_ERR_NO_MEM, err, TAG, "payload of %" PRIu32, rec.len);
+            payload = tmp;
+            payload_size = rec.len + 1;
+        }
+        ESP_GOTO_ON_FALSE(rec.len == 0 || fread(payload, rec.len, 1, fp) == 1, ESP_ERR_INVALID_SIZE, err, TAG, "truncated record %d", n);
+        payload[rec.len] = 0;
+        if(n++ == 0) t0_trace = rec.t_us;
+        if(speed_pct > 0) {
+            int64_t due = t0 + (rec.t_us - t0_trace) * 100 / speed_pct;
+            int64_t wait = due - esp_timer_get_time();
+            if(wait > 1000) vTaskDelay(pdMS_TO_TICKS(wait / 1000));
+        }
+        if(rec.kind == XZ_TRACE_RX_JSON || rec.kind == XZ_TRACE_RX_AUDIO) {
+            if(chat->prot_type == XZ_PROT_TYPE_WS) xz_ws_prot_replay(chat, &rec, payload);
+            else xz_mqtt_prot_replay(chat, &rec, payload);
+        }
+    }
+    ESP_LOGI(TAG, "replayed %d records in %" PRId64 " ms", n, (esp_timer_get_time() - t0) / 1000);
+err:
+    replay_sync(chat);
+    chat_clear_flag(chat, XZ_FLAGS_IN_SESS);
+    chat_session_buf_release(chat);
+    if(bare_ctx) {
+        replay_ctx_free(chat, bare_ctx, chat->prot_type);
+        chat->prot_ctx = NULL;
+        chat->prot_type = saved_type;
+        chat->prot_if = saved_if;
+    }
+    xz_buf_free(&chat->allocator, payload);
+    fclose(fp);
+    return ret;
+}
+
+#else
+
+esp_err_t xz_chat_trace_start(xz_chat_t* chat, const char* path) {
+    ESP_LOGE(TAG, "enable CONFIG_XZ_CHAT_TRACE");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+void xz_chat_trace_stop(xz_chat_t* chat) {}
+void xz_chat_trace_free(xz_chat_t* chat) {}
+esp_err_t xz_chat_trace_replay(xz_chat_t* chat, const char* path, int speed_pct) {
+    ESP_LOGE(TAG, "enable CONFIG_XZ_CHAT_TRACE");
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
@@ -1,12 +1,13 @@
 #include "xz_protocol_priv.h"
 #include "xz_chat_priv.h"
 #include "xz_util.h"
-#include "xz_board_info.h"
 #include "ext_mjson.h"
 #include "esp_check.h"
 #ifndef CONFIG_ESP_TLS_SKIP_SERVER_CERT_VERIFY
     #include "esp_crt_bundle.h"
 #endif
+#include "xz_tls_transport.h"
+#include "esp_transport_ws.h"
 
 
 static const char* const TAG = "xz_ws";
@@ -33,23 +34,31 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
-void xz_ws_prot_config_fill_rest_from_response(xz_ws_prot_config_t* conf, struct xz_http_client_resp_ws* resp) {
+_Static_assert(sizeof(struct BinaryProtocol2) <= XZ_TX_AUDIO_HEADROOM && sizeof(struct BinaryProtocol3) <= XZ_TX_AUDIO_HEADROOM, "XZ_TX_AUDIO_HEADROOM too small");
+
+esp_err_t xz_ws_prot_config_fill_rest_from_response(xz_ws_prot_config_t* conf, struct xz_http_client_resp_ws* resp, const char* device_id, const char* client_id) {
     char* headers = conf->headers;
-    int hlen = 0;
+    int hlen = 0, n;
     if(resp->tok) {
-        hlen = sprintf(headers, "Authorization: %s%s\r\n", strchr(resp->tok, ' ')? "":"Bearer ", resp->tok);
+        hlen = snprintf(headers, sizeof(conf->headers), "Authorization: %s%s\r\n", strchr(resp->tok, ' ')? "":"Bearer ", resp->tok);
+        ESP_RETURN_ON_FALSE(hlen >= 0 && hlen < (int)sizeof(conf->headers), ESP_ERR_INVALID_SIZE, TAG, "token too long for headers");
     }
     conf->version = resp->ver? resp->ver: WS_PROT_DEFAULT_VERSION;
-    sprintf(&headers[hlen], "Protocol-Version: %d\r\nDevice-Id: %s\r\nClient-Id: %s\r\n", conf->version, xz_board_info_mac(), xz_board_info_uuid());
+    n = snprintf(&headers[hlen], sizeof(conf->headers) - hlen, "Protocol-Version: %d\r\nDevice-Id: %s\r\nClient-Id: %s\r\n", conf->version, device_id, client_id);
+    ESP_RETURN_ON_FALSE(n >= 0 && n < (int)sizeof(conf->headers) - hlen, ESP_ERR_INVALID_SIZE, TAG, "headers too long");
     conf->client_conf.headers = headers;
     conf->client_conf.uri = resp->url;
+    return ESP_OK;
 }
 
 void xz_ws_prot_config_set_default(xz_ws_prot_config_t* conf) {
+    conf->rx_msg_max_size = 15000+32; // 15000 for audio frame, add some more for payload header
+    conf->persistent = false;
+    conf->idle_timeout_ms = 5*60*1000;
     conf->client_conf = (esp_websocket_client_config_t) {
         .disable_auto_reconnect = true,
         // .enable_close_reconnect = false, // reconnect after server close
-        .buffer_size = (15000+32), // 15000 for audio frame, add some more for payload header,
+        .buffer_size = 2048, // larger messages are reassembled, see rx_msg_max_size
         #ifndef CONFIG_ESP_TLS_SKIP_SERVER_CERT_VERIFY
             .crt_bundle_attach = esp_crt_bundle_attach,
         #endif
@@ -61,57 +70,60 @@ void xz_ws_prot_config_set_default(xz_ws_prot_config_t* conf) {
 
 static esp_err_t xz_ws_prot_send_msg(xz_chat_t* chat, const char* str, int len) {
     xz_ws_prot_ctx_t* ctx = (xz_ws_prot_ctx_t*)chat->prot_ctx;
+    CHAT_TRACE(chat, XZ_TRACE_TX_JSON, 0, 0, 0, str, len);
     return esp_websocket_client_send_text(ctx->ws_hd, str, len, pdMS_TO_TICKS(2000))>=0? ESP_OK: ESP_FAIL;
 }
 
-static esp_err_t xz_ws_prot_send_data(xz_chat_t* chat, const void* data, int len) {
+static esp_err_t xz_ws_prot_send_data(xz_chat_t* chat, xz_tx_audio_pck_t* audio) {
     xz_ws_prot_ctx_t* ctx = (xz_ws_prot_ctx_t*)chat->prot_ctx;
-    int needed_size;
+    int len = audio->len;
+    int hlen;
     switch(ctx->version) {
-        case 2: needed_size = sizeof(struct BinaryProtocol2) + len; break;
-        case 3: needed_size = sizeof(struct BinaryProtocol3) + len; break;
-        default: needed_size = 0;
+        case 2: hlen = sizeof(struct BinaryProtocol2); break;
+        case 3: hlen = sizeof(struct BinaryProtocol3); break;
+        default: hlen = 0;
     }
-    if(ctx->send_audio_buf_size < needed_size) {
-        void* tmp = realloc(ctx->send_audio_buf, needed_size);
-        if(tmp) {
-            ctx->send_audio_buf = tmp;
-            ctx->send_audio_buf_size = needed_size;
-        } else {
-            return ESP_ERR_NO_MEM;
-        }
+    uint8_t* frame;
+    if(hlen == 0) {
+        frame = audio->buf;
+    } else if(audio->headroom >= hlen) { // header goes into the headroom, no copy
+        frame = (uint8_t*)audio->buf - hlen;
+    } else {
+        if(!(frame=chat_tx_buf(chat, &ctx->send_audio_buf, &ctx->send_audio_buf_size, hlen + len))) return ESP_ERR_NO_MEM;
+        memcpy(frame + hlen, audio->buf, len);
     }
-    void* data_to_send;
     switch(ctx->version) {
         case 2:
-            struct BinaryProtocol2* p2 = ctx->send_audio_buf;
+            struct BinaryProtocol2* p2 = (struct BinaryProtocol2*)frame;
             p2->version = htons(2);
             p2->type = 0;
             p2->reserved = 0;
             p2->timestamp = 0;
             p2->payload_size = htonl(len);
-            memcpy(p2->payload, data, len);
-            data_to_send = ctx->send_audio_buf;
             break;
         case 3:
-            struct BinaryProtocol3* p3 = ctx->send_audio_buf;
+            struct BinaryProtocol3* p3 = (struct BinaryProtocol3*)frame;
             p3->type = 0;
             p3->reserved = 0;
             p3->payload_size = htons(len);
-            memcpy(p3->payload, data, len);
-            data_to_send = ctx->send_audio_buf;
             break;
-        default:
-            data_to_send = data;
-            needed_size = len;
     }
-    return esp_websocket_client_send_bin(ctx->ws_hd, data_to_send, needed_size, pdMS_TO_TICKS(2000))>=0? ESP_OK: ESP_FAIL;
+    return esp_websocket_client_send_bin(ctx->ws_hd, (const char*)frame, hlen + len, pdMS_TO_TICKS(2000))>=0? ESP_OK: ESP_FAIL;
 }
 
 esp_err_t xz_ws_prot_destroy(xz_ws_prot_ctx_t* ctx) {
     if(!ctx) return ESP_OK;
+    if(ctx->idle_timer) {
+        xTimerDelete(ctx->idle_timer, portMAX_DELAY);
+        ctx->idle_timer = NULL;
+    }
     esp_err_t ret = esp_websocket_client_destroy(ctx->ws_hd);
-    if(!ret) ctx->ws_hd = NULL;
+    if(!ret) {
+        ctx->ws_hd = NULL;
+        xz_rx_asm_deinit(&ctx->rx);
+        XZ_BUF_RELEASE(ctx->alloc, ctx->send_audio_buf);
+        free(ctx);
+    }
     return ret;
 }
 
@@ -120,80 +132,119 @@ static void log_error_if_nonzero(const char *message, int error_code) {
         ESP_LOGE(TAG, "Last error %s: 0x%x", message, error_code);
 }
 
+static void process_ws_message(xz_chat_t* chat, xz_ws_prot_ctx_t* ctx, int op_code, char* data, int len) {
+    CHAT_TRACE(chat, op_code == 0x1? XZ_TRACE_RX_JSON: XZ_TRACE_RX_AUDIO, op_code, 0, 0, data, len);
+    if (op_code == 0x2) { // bin // process audio data, len
+        if(chat->audio_cb) {
+            uint8_t* audio_data; int audio_len;
+            switch(ctx->version) {
+            case 2:
+                struct BinaryProtocol2* p2 = (struct BinaryProtocol2*)data;
+                // p2->version = ntohs(p2->version);
+                // p2->type = ntohs(p2->type);
+                // p2->payload_size = ntohl(p2->payload_size);
+                audio_data = p2->payload;
+                audio_len = ntohl(p2->payload_size);
+                uint32_t ts = ntohl(p2->timestamp);
+                if(ts == 0) break; // server doesn't stamp frames
+                if(ctx->rx_timestamp_valid && chat->server_frame_duration > 0) {
+                    // frames are server_frame_duration ms apart, anything more is loss
+                    int32_t gap = (int32_t)(ts - ctx->rx_timestamp);
+                    if(gap < 0) CHAT_STAT_ADD(chat, rx_late_frames, 1); // still played, websocket doesn't reorder
+                    else chat_report_audio_loss(chat, (gap + chat->server_frame_duration/2) / chat->server_frame_duration - 1);
+                }
+                if(!ctx->rx_timestamp_valid || (int32_t)(ts - ctx->rx_timestamp) > 0) ctx->rx_timestamp = ts; // a late frame doesn't move it back
+                ctx->rx_timestamp_valid = true;
+                break;
+            case 3:
+                struct BinaryProtocol3* p3 = (struct BinaryProtocol3*)data;
+                // p3->payload_size = ntohs(p3->payload_size);
+                audio_data = p3->payload;
+                audio_len = ntohs(p3->payload_size);
+                break;
+            default:
+                audio_data = (uint8_t*)data;
+                audio_len = len;
+            }
+            chat_deliver_audio(chat, audio_data, audio_len);
+        }
+
+    } else if(op_code == 0x1) { // txt
+        ESP_LOGI(TAG, "got msg %.*s", len, data);
+        xz_json_idx_t* idx = &chat->json_idx;
+        const char* s, *type; int n, type_len;
+        if(xz_json_idx_build(idx, data, len) || !(type = xz_json_idx_str(idx, "$.type", &type_len))) {
+            ESP_LOGE(TAG, "Message type is not specified");
+            return;
+        }
+        xz_msg_type_t mt = xz_prot_msg_type(type, type_len);
+        if(mt == XZ_MSG_HELLO) {
+            if(!xz_json_idx_streq(idx, "$.transport", "websocket")) {
+                ESP_LOGE(TAG, "Unsupported transport");
+                return;
+            }
+            if(!(data = chat_session_buf_set(chat, data, len))) return;
+            xz_json_idx_rebase(idx, data);
+            type = xz_json_idx_str(idx, "$.type", NULL);
+            ctx->rx_timestamp_valid = false;
+            xz_json_idx_i32(idx, "$.audio_params.sample_rate", &chat->server_sample_rate);
+            xz_json_idx_i32(idx, "$.audio_params.frame_duration", &chat->server_frame_duration);
+            chat->session_id = "";
+            if((s = xz_json_idx_str(idx, "$.session_id", &n))) {
+                chat->session_id = (char*)s;
+                chat->session_id[n] = 0;
+            }
+            chat_lat_mark(chat, XZ_LAT_HELLO_RECEIVED);
+            xEventGroupSetBits(chat->eg, XZ_EG_SERVER_HELLO_BIT);
+        } else if(mt == XZ_MSG_GOODBYE && ctx->persistent) { // otherwise the server just closes the connection
+            if(chat->session_buf && !((s = xz_json_idx_str(idx, "$.session_id", &n)) && strncmp(chat->session_id, s, n))) {
+                chat_session_buf_release(chat); // closed by server, don't send goodbye back
+                xz_chat_exit_session(chat);
+            }
+        }
+        xz_prot_process_json(chat, idx, mt, (char*)type, type_len);
+    }
+}
+
+void xz_ws_prot_replay(xz_chat_t* chat, const xz_trace_rec_t* rec, uint8_t* payload) {
+    process_ws_message(chat, (xz_ws_prot_ctx_t*)chat->prot_ctx, rec->kind == XZ_TRACE_RX_JSON? 0x1: rec->arg, (char*)payload, rec->len);
+}
+
 static void websocket_event_handler(xz_chat_t *chat, esp_event_base_t base, int32_t event_id, esp_websocket_event_data_t *ev) {
     switch (event_id) {
     case WEBSOCKET_EVENT_DATA:{
             xz_ws_prot_ctx_t* ctx = (xz_ws_prot_ctx_t*) chat->prot_ctx;
             // ESP_LOGI(TAG, "Received opcode=%d, fin=%d", ev->op_code, ev->fin);
+            if(ev->op_code >= 0x8) return; // close/ping/pong are handled by esp_websocket_client
 
             /*
-             even for non-fragmented payload, multiple events could be fired for the same message if client->rx_buffer is too small.
-             for effiency,
-                1. I prefer to setting client->rx_buffer large enough to load audio bin data.
-                2. modification to esp_websocket_client is needed to allow cpp-move kind of op and avoid memcpy
+             a message comes in several events if it's fragmented (fin==0, then op_code 0 continuation frames),
+             or if a frame is larger than client->rx_buffer (payload_offset > 0).
+             whole messages are processed right from the rx buffer, others are reassembled into ctx->rx.
             */
-            if(ev->data_len < ev->payload_len) {  // multiple events for a message
-                ESP_LOGE(TAG, "recv buf too small");
-                return;
-            }
-            if( ev->fin==false || ev->op_code==0) { // fragments
-                ESP_LOGE(TAG, "fragments handling not implemented");
+            bool frame_end = ev->payload_offset + ev->data_len >= ev->payload_len;
+            if(!ctx->rx.active && ev->op_code != 0 && ev->fin && ev->payload_offset == 0 && frame_end) {
+                process_ws_message(chat, ctx, ev->op_code, (char*)ev->data_ptr, ev->data_len);
                 return;
             }
-            if (ev->op_code == 0x2) { // bin // process audio ev->data_ptr, ev->data_len
-                if(chat->audio_cb) {
-                    uint8_t* audio_data; int audio_len;
-                    switch(ctx->version) {
-                    case 2:
-                        struct BinaryProtocol2* p2 = (struct BinaryProtocol2*)ev->data_ptr;
-                        // p2->version = ntohs(p2->version);
-                        // p2->type = ntohs(p2->type);
-                        // p2->timestamp = ntohl(p2->timestamp);
-                        // p2->payload_size = ntohl(p2->payload_size);
-                        audio_data = p2->payload;
-                        audio_len = ntohl(p2->payload_size);
-                        break;
-                    case 3:
-                        struct BinaryProtocol3* p3 = (struct BinaryProtocol3*)ev->data_ptr;
-                        // p3->payload_size = ntohs(p3->payload_size);
-                        audio_data = p3->payload;
-                        audio_len = ntohs(p3->payload_size);
-                        break;
-                    default:
-                        audio_data = ev->data_ptr;
-                        audio_len = ev->data_len;
-                    }
-                    if(chat_has_any_flag(chat, XZ_FLAG_SESS_SPEAKING))
-                        chat->audio_cb(audio_data, audio_len, chat);
+            if(ev->op_code != 0 && ev->payload_offset == 0) { // first event of a new message
+                if(ctx->rx.active) {
+                    ESP_LOGW(TAG, "incomplete message discarded");
                 }
-
-            } else if(ev->op_code == 0x1) { // txt
-                int len = ev->data_len;
-                char* data = ev->data_ptr;
-                ESP_LOGI(TAG, "got msg %.*s", len, data);
-                const char* s, *type; int n, type_len;
-                if(!emjson_locate_string(data, len, "$.type", &type, &type_len)) {
-                    ESP_LOGE(TAG, "Message type is not specified");
-                    return;
+                ctx->rx_op_code = ev->op_code;
+                xz_rx_asm_begin(&ctx->rx, ev->fin? ev->payload_len: 0);
+            } else if(!ctx->rx.active) {
+                return; // the beginning was lost
+            }
+            xz_rx_asm_append(&ctx->rx, ev->data_ptr, ev->data_len);
+            if(ev->fin && frame_end) {
+                xz_rx_asm_end(&ctx->rx);
+                if(ctx->rx.dropping) {
+                    CHAT_STAT_ADD(chat, rx_oversize, 1);
+                    ESP_LOGE(TAG, "message larger than %d dropped", ctx->rx.max_size);
+                } else {
+                    process_ws_message(chat, ctx, ctx->rx_op_code, (char*)ctx->rx.buf, ctx->rx.len);
                 }
-                if(QESTREQL(type, "hello")) {
-                    if(!(emjson_locate_string(data, len, "$.transport", &s, &n) && QESTREQL(s, "websocket"))) {
-                        ESP_LOGE(TAG, "Unsupported transport");
-                        return;
-                    }
-                    chat->session_buf = strndup(data, len);
-                    data = chat->session_buf;
-                    if(mjson_find(data, len, "$.audio_params", &s, &n) == MJSON_TOK_OBJECT) {
-                        emjson_get_i32(s, n, "$.sample_rate", &chat->server_sample_rate);
-                        emjson_get_i32(s, n, "$.frame_duration", &chat->server_frame_duration);
-                    }
-                    chat->session_id = "";
-                    if(emjson_locate_string(data, len, "$.session_id", (const char**)&chat->session_id, &n)) {
-                        chat->session_id[n] = 0;
-                    }
-                    xEventGroupSetBits(chat->eg, XZ_EG_SERVER_HELLO_BIT);
-                } 
-                xz_prot_process_json(chat, data, len, type, type_len);
             }
         }
 
@@ -210,13 +261,13 @@ static void websocket_event_handler(xz_chat_t *chat, esp_event_base_t base, int3
     case WEBSOCKET_EVENT_FINISH: // normally FIN is received instead of DISCONN
         xEventGroupSetBits(chat->eg, XZ_EG_PROT_DISCONN_BIT);
         ESP_LOGI(TAG, "ev_fin");
-        RELEASE(chat->session_buf); // release session_buf so client's attempt to send further msg will fail
+        chat_session_buf_release(chat); // release session_buf so client's attempt to send further msg will fail
         xz_chat_exit_session(chat);
         return;
     case WEBSOCKET_EVENT_DISCONNECTED:
         xEventGroupSetBits(chat->eg, XZ_EG_PROT_DISCONN_BIT);
         ESP_LOGI(TAG, "ev_disconn");
-        RELEASE(chat->session_buf);
+        chat_session_buf_release(chat);
         xz_chat_exit_session(chat);
         goto check_err;
     case WEBSOCKET_EVENT_ERROR:
@@ -234,12 +285,68 @@ check_err:
     }
 }
 
+static esp_err_t ws_idle_close(xz_chat_t* chat) {
+    xz_ws_prot_ctx_t* ctx = (xz_ws_prot_ctx_t*)chat->prot_ctx;
+    if(!ctx || chat_has_any_flag(chat, XZ_FLAGS_IN_SESS) || !esp_websocket_client_is_connected(ctx->ws_hd)) return ESP_OK;
+    ESP_LOGI(TAG, "idle, closing connection");
+    return esp_websocket_client_stop(ctx->ws_hd);
+}
+
+static void idle_timer_cb(TimerHandle_t timer) {
+    xz_chat_t* chat = (xz_chat_t*)pvTimerGetTimerID(timer);
+    cmd_q_el_t el = {(_cmd_el_fn_t)ws_idle_close, chat};
+    chat_post_cmd(chat, XZ_CMD_LANE_NORMAL, &el, true, 0); // closing is best effort, skip if the queue is full
+}
+
 esp_err_t xz_ws_prot_init(xz_ws_prot_ctx_t** ctx, xz_ws_prot_config_t* conf, xz_chat_t* chat) {
     xz_ws_prot_ctx_t* p = calloc(1, sizeof(xz_ws_prot_ctx_t));
     if(p == NULL) return ESP_ERR_NO_MEM;
     esp_err_t ret = ESP_OK;
     p->version = conf->version;
-    ESP_GOTO_ON_FALSE((p->ws_hd=esp_websocket_client_init(&conf->client_conf)), ESP_ERR_NO_MEM, err, TAG, "create ws client");
+    p->persistent = conf->persistent;
+    p->alloc = &chat->allocator;
+    ESP_GOTO_ON_ERROR(xz_rx_asm_init(&p->rx, conf->rx_msg_max_size, p->alloc), err, TAG, "init rx asm");
+#ifdef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    p->send_audio_buf_size = sizeof(struct BinaryProtocol2) + CONFIG_XZ_CHAT_STATIC_TX_FRAME_SIZE;
+    ESP_GOTO_ON_FALSE((p->send_audio_buf=xz_buf_alloc(p->alloc, XZ_BUF_AUDIO_TX, p->send_audio_buf_size)), ESP_ERR_NO_MEM, err, TAG, "reserve send audio buf");
+#endif
+    if(p->persistent && conf->idle_timeout_ms > 0) {
+        ESP_GOTO_ON_FALSE((p->idle_timer=xTimerCreate("xz_ws_idle", pdMS_TO_TICKS(conf->idle_timeout_ms), pdFALSE, chat, idle_timer_cb)), ESP_ERR_NO_MEM, err, TAG, "create idle timer");
+    }
+    esp_websocket_client_config_t client_conf = conf->client_conf;
+#ifdef CONFIG_XZ_PROT_TLS_SESSION_CACHE
+    if(client_conf.uri && 0 == strncmp(client_conf.uri, "wss://", 6) && !client_conf.ext_transport) {
+        xz_tls_transport_config_t tls_conf = {
+            .tls = {
+                .crt_bundle_attach = client_conf.crt_bundle_attach,
+                .use_global_ca_store = client_conf.use_global_ca_store,
+                .cacert_buf = (const unsigned char*)client_conf.cert_pem,
+                .cacert_bytes = xz_tls_pem_len(client_conf.cert_pem, client_conf.cert_len),
+                .clientcert_buf = (const unsigned char*)client_conf.client_cert,
+                .clientcert_bytes = xz_tls_pem_len(client_conf.client_cert, client_conf.client_cert_len),
+                .clientkey_buf = (const unsigned char*)client_conf.client_key,
+                .clientkey_bytes = xz_tls_pem_len(client_conf.client_key, client_conf.client_key_len),
+                .skip_common_name = client_conf.skip_cert_common_name_check,
+            },
+            .keep_alive = {
+                .keep_alive_enable = client_conf.keep_alive_enable,
+                .keep_alive_idle = client_conf.keep_alive_idle,
+                .keep_alive_interval = client_conf.keep_alive_interval,
+                .keep_alive_count = client_conf.keep_alive_count,
+            },
+            .default_port = 443,
+        };
+        esp_transport_handle_t tls = xz_tls_transport_init(&tls_conf);
+        ESP_GOTO_ON_FALSE(tls, ESP_ERR_NO_MEM, err, TAG, "create tls transport");
+        // websocket framing over the resuming tls transport, owned by the ws client
+        if(!(client_conf.ext_transport = esp_transport_ws_init(tls))) {
+            esp_transport_destroy(tls);
+            ESP_GOTO_ON_FALSE(false, ESP_ERR_NO_MEM, err, TAG, "create ws transport");
+        }
+        client_conf.transport = WEBSOCKET_TRANSPORT_OVER_SSL;
+    }
+#endif
+    ESP_GOTO_ON_FALSE((p->ws_hd=esp_websocket_client_init(&client_conf)), ESP_ERR_NO_MEM, err, TAG, "create ws client");
     ESP_GOTO_ON_ERROR(esp_websocket_register_events(p->ws_hd, WEBSOCKET_EVENT_ANY, (esp_event_handler_t)websocket_event_handler, chat), err, TAG, "register event");
 err:
     if(ret) {
@@ -254,14 +361,36 @@ static esp_err_t do_nothing_wrong(xz_chat_t* chat) {
     return ESP_OK;
 }
 
+static esp_err_t xz_ws_prot_stop(xz_chat_t* chat) {
+    xz_ws_prot_ctx_t* ctx = (xz_ws_prot_ctx_t*)chat->prot_ctx;
+    if(!ctx) return ESP_ERR_INVALID_STATE;
+    if(!ctx->persistent) return ESP_OK; // already stopped with the audio channel
+    if(ctx->idle_timer) xTimerStop(ctx->idle_timer, portMAX_DELAY);
+    if(esp_websocket_client_is_connected(ctx->ws_hd)) return esp_websocket_client_stop(ctx->ws_hd);
+    return ESP_OK;
+}
+
 
 static esp_err_t xz_ws_prot_close_audio_chan(xz_chat_t* chat) {
     if(!chat) return ESP_ERR_INVALID_ARG;
     xz_ws_prot_ctx_t* ctx = (xz_ws_prot_ctx_t*)chat->prot_ctx;
     if(!ctx) return ESP_ERR_INVALID_STATE;
-    RELEASE(chat->session_buf);
-    RELEASE(ctx->send_audio_buf);
-    ctx->send_audio_buf_size = 0;
+#ifndef CONFIG_XZ_CHAT_STATIC_BUFFERS
+    if(xEventGroupGetBits(chat->eg) & XZ_EG_TX_IDLE_BIT) { // else a stuck sender still writes it, freed on destroy
+        XZ_BUF_RELEASE(ctx->alloc, ctx->send_audio_buf);
+        ctx->send_audio_buf_size = 0;
+    }
+#endif
+    if(ctx->persistent && esp_websocket_client_is_connected(ctx->ws_hd)) {
+        if(chat->session_buf) {
+            int n = snprintf(chat->send_buf, chat->send_buf_size, "{\"session_id\":\"%s\",\"type\":\"goodbye\"}", chat->session_id);
+            xz_ws_prot_send_msg(chat, chat->send_buf, n);
+            chat_session_buf_release(chat);
+        }
+        if(ctx->idle_timer) xTimerReset(ctx->idle_timer, portMAX_DELAY);
+        return ESP_OK;
+    }
+    chat_session_buf_release(chat);
     return esp_websocket_client_stop(ctx->ws_hd);
 }
 
@@ -273,25 +402,29 @@ static esp_err_t xz_ws_prot_open_audio_chan(xz_chat_t* chat) {
     if(!ctx) return ESP_ERR_INVALID_STATE;
 
     esp_err_t ret = ESP_OK;
-    ctx->send_audio_buf = NULL;
-    ctx->send_audio_buf_size = 0;
-    xEventGroupClearBits(chat->eg, XZ_EG_PROT_CONN_BIT|XZ_EG_PROT_DISCONN_BIT|XZ_EG_PROT_ERR_BIT);
-    ESP_RETURN_ON_ERROR(esp_websocket_client_start(ctx->ws_hd), TAG, "start ws client");
-    ESP_GOTO_ON_FALSE(XZ_EG_PROT_CONN_BIT&xEventGroupWaitBits(chat->eg, XZ_EG_PROT_CONN_BIT|XZ_EG_PROT_DISCONN_BIT|XZ_EG_PROT_ERR_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(15000)), ESP_ERR_TIMEOUT, err, TAG, "wait conn");
+    if(ctx->idle_timer) xTimerStop(ctx->idle_timer, portMAX_DELAY);
+    if(!(ctx->persistent && esp_websocket_client_is_connected(ctx->ws_hd))) {
+        if(ctx->persistent) esp_websocket_client_stop(ctx->ws_hd); // may be left started after the server closed it
+        xEventGroupClearBits(chat->eg, XZ_EG_PROT_CONN_BIT|XZ_EG_PROT_DISCONN_BIT|XZ_EG_PROT_ERR_BIT);
+        ESP_RETURN_ON_ERROR(esp_websocket_client_start(ctx->ws_hd), TAG, "start ws client");
+        ESP_GOTO_ON_FALSE(XZ_EG_PROT_CONN_BIT&xEventGroupWaitBits(chat->eg, XZ_EG_PROT_CONN_BIT|XZ_EG_PROT_DISCONN_BIT|XZ_EG_PROT_ERR_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(15000)), ESP_ERR_TIMEOUT, err, TAG, "wait conn");
+        chat_lat_mark(chat, XZ_LAT_CONNECTED);
+    }
 
     xEventGroupClearBits(chat->eg, XZ_EG_PROT_DISCONN_BIT|XZ_EG_PROT_ERR_BIT|XZ_EG_SERVER_HELLO_BIT);
+    chat_lat_mark(chat, XZ_LAT_HELLO_SENT);
     ESP_GOTO_ON_ERROR(xz_ws_prot_send_msg(chat, XZ_WS_PROT_OPEN_AUDIO_CMD, sizeof(XZ_WS_PROT_OPEN_AUDIO_CMD)-1), err, TAG, "send hello");
     ESP_GOTO_ON_FALSE(XZ_EG_SERVER_HELLO_BIT&xEventGroupWaitBits(chat->eg, XZ_EG_SERVER_HELLO_BIT|XZ_EG_PROT_DISCONN_BIT|XZ_EG_PROT_ERR_BIT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000)), ESP_ERR_TIMEOUT, err, TAG, "wait server hello");
 err:
     if(ret) {
         xz_ws_prot_close_audio_chan(chat);
     }
-    return ESP_OK;
+    return ret;
 }
 
 const xz_prot_if_t xz_ws_prot_if = {
     .start = do_nothing_wrong,
-    .stop = do_nothing_wrong,
+    .stop = xz_ws_prot_stop,
     .open_audio_chan = xz_ws_prot_open_audio_chan,
     .close_audio_chan = xz_ws_prot_close_audio_chan,
     .send_msg = xz_ws_prot_send_msg,